@@ -24,9 +24,49 @@
 #define LZOM_E_OK LZO_E_OK
 #define LZOM_E_ERROR LZO_E_ERROR
 
+/*
+ * One single-page chunk of a scatter-gather buffer. @start is the byte offset
+ * of the chunk from the iterator the index was built from, @bv_idx and
+ * @bv_done locate it in the bvec array so that an iterator can be rebuilt
+ * without walking. @addr caches the direct mapping, it is NULL for highmem
+ * pages, which are copied through kmap instead. [@run_start, @run_end) is the
+ * virtually contiguous run of mapped chunks this one belongs to.
+ */
+struct lzom_sg_seg {
+	size_t start;
+	size_t run_start;
+	size_t run_end;
+	unsigned int len;
+	unsigned int bv_idx;
+	unsigned int bv_done;
+	unsigned int offset;
+	struct page *page;
+	unsigned char *addr;
+};
+
+/*
+ * Prefix-offset index of a buffer, built once with lzom_sg_index_build().
+ * @size is bi_size of the base iterator: the position of any iterator derived
+ * from it is size - iter.bi_size. @hint is the last segment hit.
+ *
+ * @paged is set when every segment but the first and the last is a whole
+ * page, as in most bios. Segment i then holds position pos exactly when
+ * (pos + @pgoff) >> PAGE_SHIFT == i, @pgoff being what the first segment
+ * lacks of a full page, and no search is needed.
+ */
+struct lzom_sg_index {
+	struct lzom_sg_seg *segs;
+	unsigned int nr_segs;
+	unsigned int hint;
+	unsigned int pgoff;
+	bool paged;
+	size_t size;
+};
+
 struct lzom_sg_buf {
 	struct bio_vec *bvec;
 	struct bvec_iter iter;
+	struct lzom_sg_index index;
 };
 
 #define lzom_sg_buf_pr_info(sg_buf, fmt, ...)                                  \
@@ -46,8 +86,20 @@ static inline struct lzom_sg_buf lzom_sg_buf_create(struct bvec_iter iter,
 
 int lzom_compress(struct lzom_sg_buf *src, struct lzom_sg_buf *dst,
 		  void *wrkmem);
+/* lzo-rle bitstream (version 1), encodes zero runs */
+int lzom_rle_compress(struct lzom_sg_buf *src, struct lzom_sg_buf *dst,
+		      void *wrkmem);
 
 int lzom_decompress_safe(const unsigned char *in, size_t in_len,
 			 unsigned char *out, size_t *out_len);
 
+/*
+ * Decompresses src into dst, both scatter-gather. The capacity is
+ * dst->iter.bi_size, the iterators are left untouched and the number of
+ * bytes produced is returned in *out_len. Both buffers should be indexed
+ * with lzom_sg_index_build(), otherwise every access walks the bvecs.
+ */
+int lzom_decompress_sg(struct lzom_sg_buf *src, struct lzom_sg_buf *dst,
+		       size_t *out_len);
+
 #endif /* _LZO_EXTEND_H */
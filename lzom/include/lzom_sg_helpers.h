@@ -10,13 +10,126 @@ int sg_write_bytes(struct lzom_sg_buf *buf, const unsigned char *data,
 int sg_read_bytes(struct lzom_sg_buf *buf, unsigned char *data, size_t len);
 void sg_skip_bytes(struct lzom_sg_buf *buf, size_t len);
 
+/* ========== random access index ========== */
+
+unsigned int lzom_sg_index_count(const struct lzom_sg_buf *buf);
+void lzom_sg_index_build(struct lzom_sg_buf *buf, struct lzom_sg_seg *segs,
+			 unsigned int nr_segs);
+struct bvec_iter lzom_sg_iter_at(struct lzom_sg_buf *buf,
+				 struct bvec_iter start, size_t offset);
+void lzom_sg_seek(struct lzom_sg_buf *buf, struct bvec_iter start,
+		  size_t offset);
+
 int lzom_sg_move_back(struct lzom_sg_buf *buf, struct bvec_iter *iter,
 		      size_t offset);
 unsigned char lzom_sg_read_back(struct lzom_sg_buf *buf, size_t offset);
 int lzom_sg_write_back(struct lzom_sg_buf *buf, unsigned char value,
 		       size_t offset);
 
-/* ========== read with offset ========== */
+/*
+ * Segment holding @pos of a paged index. The segments of such an index form
+ * a page table: one entry per page the buffer touches, in order.
+ */
+static inline struct lzom_sg_seg *
+lzom_sg_index_page(const struct lzom_sg_index *index, size_t pos)
+{
+	return &index->segs[(pos + index->pgoff) >> PAGE_SHIFT];
+}
+
+/*
+ * Pointer to [pos, pos + len) of a paged index through its page table, or
+ * NULL when the range leaves its page or the index is not paged. @pos is an
+ * index position. Nothing is cached, this suits scattered lookups such as
+ * hash candidates, which would only thrash a cursor.
+ */
+static inline unsigned char *lzom_sg_index_ptr(const struct lzom_sg_index *index,
+					       size_t pos, size_t len)
+{
+	const struct lzom_sg_seg *seg;
+	size_t off;
+
+	if (unlikely(!index->paged || pos >= index->size))
+		return NULL;
+
+	seg = lzom_sg_index_page(index, pos);
+	off = pos - seg->start;
+	if (unlikely(!seg->addr || len > seg->len - off))
+		return NULL;
+
+	return seg->addr + off;
+}
+
+/* ========== direct mapped cursor ========== */
+
+/*
+ * Cached window [start, end) of a buffer that is directly mapped and
+ * virtually contiguous, @addr maps @start. Positions are byte offsets from
+ * the iterator passed to lzom_sg_cursor_init(), @base is its index position.
+ * @hint is the last segment the cursor was mapped from, so that cursors
+ * walking different parts of one buffer do not evict each other.
+ */
+struct lzom_sg_cursor {
+	unsigned char *addr;
+	size_t base;
+	size_t start;
+	size_t end;
+	unsigned int hint;
+};
+
+void lzom_sg_cursor_init(struct lzom_sg_buf *buf, struct lzom_sg_cursor *c,
+			 struct bvec_iter start);
+unsigned char *lzom_sg_cursor_map(struct lzom_sg_buf *buf,
+				  struct lzom_sg_cursor *c, size_t pos,
+				  size_t len);
+
+static inline unsigned char *lzom_sg_cursor_ptr(const struct lzom_sg_cursor *c,
+						size_t pos, size_t len)
+{
+	if (likely(pos - c->start < c->end - c->start && c->end - pos >= len))
+		return c->addr + (pos - c->start);
+
+	return NULL;
+}
+
+/* Moves @c to the run of @seg, which holds @pos */
+static inline unsigned char *lzom_sg_cursor_set(struct lzom_sg_cursor *c,
+						const struct lzom_sg_seg *seg,
+						size_t pos, size_t len)
+{
+	size_t ipos = c->base + pos;
+	size_t run_start;
+
+	if (!seg->addr || len > seg->run_end - ipos)
+		return NULL;
+
+	run_start = max(seg->run_start, c->base);
+
+	c->addr = seg->addr - (seg->start - run_start);
+	c->start = run_start - c->base;
+	c->end = seg->run_end - c->base;
+
+	return c->addr + (pos - c->start);
+}
+
+/* Pointer to [pos, pos + len) or NULL when the range is not flat */
+static inline unsigned char *lzom_sg_cursor_get(struct lzom_sg_buf *buf,
+						struct lzom_sg_cursor *c,
+						size_t pos, size_t len)
+{
+	unsigned char *ptr = lzom_sg_cursor_ptr(c, pos, len);
+
+	if (likely(ptr))
+		return ptr;
+
+	return lzom_sg_cursor_map(buf, c, pos, len);
+}
+
+/* ========== access with offset ========== */
+
+int lzom_sg_read_at(struct lzom_sg_buf *buf, struct bvec_iter start,
+		    size_t offset, unsigned char *data, size_t len);
+int lzom_sg_write_at(struct lzom_sg_buf *buf, struct bvec_iter start,
+		     size_t offset, const unsigned char *data, size_t len);
 
 unsigned char lzom_sg_read1_at(struct lzom_sg_buf *buf, struct bvec_iter start,
 			       size_t offset);
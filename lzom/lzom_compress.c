@@ -25,8 +25,6 @@
 
 #undef LZO_UNSAFE
 
-#define TODO_IMPLEMENT
-
 #ifndef LZO_SAFE
 #define LZO_UNSAFE 1
 #define LZO_SAFE(name) name
@@ -37,60 +35,231 @@
 	if (unlikely(!HAVE_OP(x))) \
 	goto output_overrun
 
+/*
+ * Flat windows of the input and output. Loads and stores go straight through
+ * the mapped pointer while the access stays inside one virtually contiguous
+ * run of pages and fall back to the sg helpers only when it crosses a bvec
+ * boundary or hits a highmem page.
+ */
+struct lzom_compress_cursors {
+	struct lzom_sg_cursor ic; /* ip and pending literals */
+	struct lzom_sg_cursor mc; /* match candidates */
+	struct lzom_sg_cursor oc; /* output */
+};
+
+static __always_inline u32 lzom_in_le32(struct lzom_sg_buf *in,
+					struct lzom_sg_cursor *c,
+					struct bvec_iter in_start, size_t pos)
+{
+	const unsigned char *ptr = lzom_sg_cursor_get(in, c, pos, 4);
+
+	if (likely(ptr))
+		return get_unaligned_le32(ptr);
+
+	return le32_to_cpu(lzom_sg_read4_at(in, in_start, pos));
+}
+
+/*
+ * Loads a hash candidate. Candidates are scattered over the whole window, so
+ * a paged input resolves them through its page table instead of moving a
+ * cursor back and forth between pages.
+ */
+static __always_inline u32 lzom_in_probe(struct lzom_sg_buf *in,
+					 struct lzom_sg_cursor *c,
+					 struct bvec_iter in_start, size_t pos)
+{
+	const unsigned char *ptr;
+
+	if (!in->index.paged)
+		return lzom_in_le32(in, c, in_start, pos);
+
+	ptr = lzom_sg_index_ptr(&in->index, c->base + pos, 4);
+	if (likely(ptr))
+		return get_unaligned_le32(ptr);
+
+	return le32_to_cpu(lzom_sg_read4_at(in, in_start, pos));
+}
+
+static __always_inline u32 lzom_in_u32(struct lzom_sg_buf *in,
+				       struct lzom_sg_cursor *c,
+				       struct bvec_iter in_start, size_t pos)
+{
+	const unsigned char *ptr = lzom_sg_cursor_get(in, c, pos, 4);
+
+	if (likely(ptr))
+		return get_unaligned((const u32 *)ptr);
+
+	return lzom_sg_read4_at(in, in_start, pos);
+}
+
+static __always_inline u64 lzom_in_u64(struct lzom_sg_buf *in,
+				       struct lzom_sg_cursor *c,
+				       struct bvec_iter in_start, size_t pos)
+{
+	const unsigned char *ptr = lzom_sg_cursor_get(in, c, pos, 8);
+
+	if (likely(ptr))
+		return get_unaligned((const u64 *)ptr);
+
+	return lzom_sg_read8_at(in, in_start, pos);
+}
+
+static __always_inline unsigned char lzom_in_byte(struct lzom_sg_buf *in,
+						  struct lzom_sg_cursor *c,
+						  struct bvec_iter in_start,
+						  size_t pos)
+{
+	const unsigned char *ptr = lzom_sg_cursor_get(in, c, pos, 1);
+
+	if (likely(ptr))
+		return *ptr;
+
+	return lzom_sg_read1_at(in, in_start, pos);
+}
+
+/* position of out->iter, valid only when out is indexed */
+static __always_inline size_t lzom_out_pos(const struct lzom_sg_buf *out,
+					   const struct lzom_sg_cursor *oc)
+{
+	return out->index.size - out->iter.bi_size - oc->base;
+}
+
+static __always_inline void lzom_out_write(struct lzom_sg_buf *out,
+					   struct lzom_sg_cursor *oc,
+					   const void *data, size_t len)
+{
+	unsigned char *op = lzom_sg_cursor_get(out, oc, lzom_out_pos(out, oc),
+					       len);
+
+	if (likely(op && len <= out->iter.bi_size)) {
+		memcpy(op, data, len);
+		bvec_iter_advance(out->bvec, &out->iter, len);
+		return;
+	}
+
+	sg_write_bytes(out, data, len);
+}
+
+static __always_inline void lzom_out_byte(struct lzom_sg_buf *out,
+					  struct lzom_sg_cursor *oc,
+					  unsigned char value)
+{
+	lzom_out_write(out, oc, &value, 1);
+}
+
+/* ORs @bits into the byte written @back bytes ago */
+static __always_inline void lzom_out_or_back(struct lzom_sg_buf *out,
+					     struct lzom_sg_cursor *oc,
+					     size_t back, unsigned char bits)
+{
+	unsigned char *op =
+		lzom_sg_cursor_get(out, oc, lzom_out_pos(out, oc) - back, 1);
+	unsigned char prev_byte;
+
+	if (likely(op)) {
+		*op |= bits;
+		return;
+	}
+
+	prev_byte = lzom_sg_read_back(out, back);
+	lzom_sg_write_back(out, prev_byte | bits, back);
+}
+
+static int lzom_copy_literals(struct lzom_sg_buf *out, struct lzom_sg_buf *in,
+			      struct lzom_compress_cursors *cur,
+			      struct bvec_iter in_start, size_t ii, size_t t)
+{
+	unsigned char tmp[16];
+
+	while (t) {
+		size_t op = lzom_out_pos(out, &cur->oc);
+		const unsigned char *src = lzom_sg_cursor_get(in, &cur->ic, ii, 1);
+		unsigned char *dst = lzom_sg_cursor_get(out, &cur->oc, op, 1);
+		size_t n;
+
+		if (!src || !dst)
+			break;
+
+		n = min3(t, cur->ic.end - ii, cur->oc.end - op);
+		if (unlikely(n > out->iter.bi_size))
+			return LZO_E_OUTPUT_OVERRUN;
+
+		memcpy(dst, src, n);
+		bvec_iter_advance(out->bvec, &out->iter, n);
+		ii += n;
+		t -= n;
+	}
+
+	if (!t)
+		return LZO_E_OK;
+
+	lzom_sg_seek(in, in_start, ii);
+	while (t) {
+		size_t n = min_t(size_t, t, sizeof(tmp));
+
+		if (lzom_sg_copy(out, in, tmp, n) < 0)
+			return LZO_E_OUTPUT_OVERRUN;
+		t -= n;
+	}
+
+	return LZO_E_OK;
+}
+
+#define IN_LE32(pos) lzom_in_le32(in, &cur->ic, in_start, pos)
+#define IN_U32(c, pos) lzom_in_u32(in, &cur->c, in_start, pos)
+#define IN_U64(c, pos) lzom_in_u64(in, &cur->c, in_start, pos)
+#define IN_BYTE(c, pos) lzom_in_byte(in, &cur->c, in_start, pos)
+#define OUT_BYTE(value) lzom_out_byte(out, &cur->oc, value)
+
 static noinline int
-LZO_SAFE(lzo1x_1_do_compress)(struct lzom_sg_buf *in, size_t in_len,
-			      struct lzom_sg_buf *out, size_t *tp, void *wrkmem,
-			      signed char *state_offset,
+LZO_SAFE(lzo1x_1_do_compress)(struct lzom_sg_buf *in, struct bvec_iter in_start,
+			      size_t in_pos, size_t in_len,
+			      struct lzom_sg_buf *out,
+			      struct lzom_compress_cursors *cur, size_t *tp,
+			      void *wrkmem, signed char *state_offset,
 			      const unsigned char bitstream_version)
 {
-	struct bvec_iter block_start = in->iter;
-	struct bvec_iter ii_iter = in->iter;
-	size_t ip_offset = 0;
-	size_t ii_offset = 0;
-	const size_t ip_end = in_len - 20;
+	/* all positions are byte offsets from in_start */
+	const size_t in_end = in_pos + in_len;
+	const size_t ip_end = in_end - 20;
 	lzo_dict_t *const dict = (lzo_dict_t *)wrkmem;
+	size_t ip = in_pos;
+	size_t ii = in_pos;
 	size_t ti = *tp;
 
-	if (ti < 4) {
-		size_t skip = 4 - ti;
-		sg_skip_bytes(in, skip);
-		ip_offset += skip;
-	}
+	ip += ti < 4 ? 4 - ti : 0;
 
 	for (;;) {
-		size_t m_offset = 0;
+		size_t m_pos = 0;
 		size_t t, m_len, m_off;
 		u32 dv;
 		u32 run_length = 0;
 
 	literal:
-		size_t advance = 1 + ((ip_offset - ii_offset) >> 5);
-		sg_skip_bytes(in, advance);
-		ip_offset += advance;
+		ip += 1 + ((ip - ii) >> 5);
 	next:
-		if (unlikely(ip_offset >= ip_end))
+		if (unlikely(ip >= ip_end))
 			break;
 
-		dv = le32_to_cpu(lzom_sg_read4_at(in, block_start, ip_offset));
-#ifndef TODO_IMPLEMENT
+		dv = IN_LE32(ip);
 		if (dv == 0 && bitstream_version) {
-			const unsigned char *ir = ip + 4;
-			const unsigned char *limit =
-				min(ip_end, ip + MAX_ZERO_RUN_LENGTH + 1);
+			size_t ir = ip + 4;
+			const size_t limit =
+				min_t(size_t, ip_end, ip + MAX_ZERO_RUN_LENGTH + 1);
 #if defined(CONFIG_HAVE_EFFICIENT_UNALIGNED_ACCESS) && \
 	defined(LZO_FAST_64BIT_MEMORY_ACCESS)
 			u64 dv64;
 
 			for (; (ir + 32) <= limit; ir += 32) {
-				dv64 = get_unaligned((u64 *)ir);
-				dv64 |= get_unaligned((u64 *)ir + 1);
-				dv64 |= get_unaligned((u64 *)ir + 2);
-				dv64 |= get_unaligned((u64 *)ir + 3);
+				dv64 = IN_U64(ic, ir);
+				dv64 |= IN_U64(ic, ir + 8);
+				dv64 |= IN_U64(ic, ir + 16);
+				dv64 |= IN_U64(ic, ir + 24);
 				if (dv64)
 					break;
 			}
 			for (; (ir + 8) <= limit; ir += 8) {
-				dv64 = get_unaligned((u64 *)ir);
+				dv64 = IN_U64(ic, ir);
 				if (dv64) {
 #if defined(__LITTLE_ENDIAN)
 					ir += __builtin_ctzll(dv64) >> 3;
@@ -103,143 +272,86 @@ LZO_SAFE(lzo1x_1_do_compress)(struct lzom_sg_buf *in, size_t in_len,
 				}
 			}
 #else
-			while ((ir < (const unsigned char *)ALIGN((uintptr_t)ir,
-								  4)) &&
-			       (ir < limit) && (*ir == 0))
-				ir++;
-			if (IS_ALIGNED((uintptr_t)ir, 4)) {
-				for (; (ir + 4) <= limit; ir += 4) {
-					dv = *((u32 *)ir);
-					if (dv) {
+			for (; (ir + 4) <= limit; ir += 4) {
+				dv = IN_U32(ic, ir);
+				if (dv) {
 #if defined(__LITTLE_ENDIAN)
-						ir += __builtin_ctz(dv) >> 3;
+					ir += __builtin_ctz(dv) >> 3;
 #elif defined(__BIG_ENDIAN)
-						ir += __builtin_clz(dv) >> 3;
+					ir += __builtin_clz(dv) >> 3;
 #else
 #error "missing endian definition"
 #endif
-						break;
-					}
+					break;
 				}
 			}
 #endif
-			while (likely(ir < limit) && unlikely(*ir == 0))
+			while (likely(ir < limit) && unlikely(IN_BYTE(ic, ir) == 0))
 				ir++;
 			run_length = ir - ip;
 			if (run_length > MAX_ZERO_RUN_LENGTH)
 				run_length = MAX_ZERO_RUN_LENGTH;
-		} else
-		// {
-#endif
+		} else {
 			t = ((dv * 0x1824429d) >> (32 - D_BITS)) & D_MASK;
-		m_offset = dict[t];
-		dict[t] = (lzo_dict_t)ip_offset;
+			m_pos = in_pos + dict[t];
+			dict[t] = (lzo_dict_t)(ip - in_pos);
 
-		u32 dv_match = le32_to_cpu(
-			lzom_sg_read4_at(in, block_start, m_offset));
-		if (unlikely(dv != dv_match))
-			goto literal;
-		// }  TODO_IMPLEMENT
+			if (unlikely(dv != lzom_in_probe(in, &cur->mc, in_start,
+							 m_pos)))
+				goto literal;
+		}
 
-		ii_offset -= ti;
+		ii -= ti;
 		ti = 0;
-		t = ip_offset - ii_offset;
+		t = ip - ii;
 
 		if (t != 0) {
-			struct bvec_iter saved_ip = in->iter;
-			struct bvec_iter saved_ii = ii_iter;
-			in->iter = ii_iter;
-
 			if (t <= 3) {
-				unsigned char prev_byte = lzom_sg_read_back(
-					out, -(*state_offset));
-				prev_byte |= t;
-				lzom_sg_write_back(out, prev_byte,
-						   -(*state_offset));
-
-				unsigned char tmp[4];
-				if (lzom_sg_copy(out, in, tmp, t) < 0)
-					goto output_overrun;
-			} else if (t <= 16) {
-				lzom_sg_write1(out, t - 3);
-
-				size_t remaining = t;
-				while (remaining >= 8) {
-					LZOM_COPY8(out, in);
-					remaining -= 8;
-				}
-				if (remaining > 0) {
-					unsigned char tmp[8];
-					if (lzom_sg_copy(out, in, tmp,
-							 remaining) < 0)
-						goto output_overrun;
-				}
+				lzom_out_or_back(out, &cur->oc, -(*state_offset),
+						 t);
+			} else if (t <= 18) {
+				OUT_BYTE(t - 3);
 			} else {
-				if (t <= 18) {
-					lzom_sg_write1(out, t - 3);
-				} else {
-					size_t tt = t - 18;
-					lzom_sg_write1(out, 0);
-
-					while (unlikely(tt > 255)) {
-						tt -= 255;
-						lzom_sg_write1(out, 0);
-					}
-
-					lzom_sg_write1(out, (unsigned char)tt);
-				}
-				do {
-					LZOM_COPY8(out, in);
-					LZOM_COPY8(out, in);
-					t -= 16;
-				} while (t >= 16);
-				if (t > 0) {
-					unsigned char tmp[16];
-					if (lzom_sg_copy(out, in, tmp, t) < 0)
-						goto output_overrun;
+				size_t tt = t - 18;
+
+				OUT_BYTE(0);
+				while (unlikely(tt > 255)) {
+					tt -= 255;
+					OUT_BYTE(0);
 				}
-				saved_ii = in->iter;
+				OUT_BYTE((unsigned char)tt);
 			}
-			ii_iter = saved_ii;
-			in->iter = saved_ip;
+
+			if (lzom_copy_literals(out, in, cur, in_start, ii, t) !=
+			    LZO_E_OK)
+				goto output_overrun;
 		}
 
-#ifndef TODO_IMPLEMENT
 		if (unlikely(run_length)) {
+			unsigned char op[4];
+
 			ip += run_length;
 			run_length -= MIN_ZERO_RUN_LENGTH;
-			NEED_OP(4);
 			put_unaligned_le32((run_length << 21) | 0xfffc18 |
 						   (run_length & 0x7),
 					   op);
-			op += 4;
+			lzom_out_write(out, &cur->oc, op, sizeof(op));
 			run_length = 0;
 			*state_offset = -3;
 			goto finished_writing_instruction;
 		}
-#endif
 
 		m_len = 4;
 		{
 #if defined(CONFIG_HAVE_EFFICIENT_UNALIGNED_ACCESS) && defined(LZO_USE_CTZ64)
-			u64 v = le64_to_cpu(lzom_sg_read8_at(
-					in, block_start, ip_offset + m_len)) ^
-				le64_to_cpu(lzom_sg_read8_at(in, block_start,
-							     m_offset + m_len));
+			u64 v = IN_U64(ic, ip + m_len) ^ IN_U64(mc, m_pos + m_len);
 
 			if (unlikely(v == 0)) {
 				do {
 					m_len += 8;
-
-					v = le64_to_cpu(lzom_sg_read8_at(
-						    in, block_start,
-						    ip_offset + m_len)) ^
-					    le64_to_cpu(lzom_sg_read8_at(
-						    in, block_start,
-						    m_offset + m_len));
-
-					if (unlikely(ip_offset + m_len >=
-						     ip_end))
+					v = IN_U64(ic, ip + m_len) ^
+					    IN_U64(mc, m_pos + m_len);
+					if (unlikely(ip + m_len >= ip_end))
 						goto m_len_done;
 				} while (v == 0);
 			}
@@ -251,36 +363,19 @@ LZO_SAFE(lzo1x_1_do_compress)(struct lzom_sg_buf *in, size_t in_len,
 #error "missing endian definition"
 #endif
 #elif defined(CONFIG_HAVE_EFFICIENT_UNALIGNED_ACCESS) && defined(LZO_USE_CTZ32)
-			u32 v = le32_to_cpu(lzom_sg_read4_at(
-					in, block_start, ip_offset + m_len)) ^
-				le32_to_cpu(lzom_sg_read4_at(in, block_start,
-							     m_offset + m_len));
+			u32 v = IN_U32(ic, ip + m_len) ^ IN_U32(mc, m_pos + m_len);
 
 			if (unlikely(v == 0)) {
 				do {
 					m_len += 4;
-
-					v = le32_to_cpu(lzom_sg_read4_at(
-						    in, block_start,
-						    ip_offset + m_len)) ^
-					    le32_to_cpu(lzom_sg_read4_at(
-						    in, block_start,
-						    m_offset + m_len));
-
+					v = IN_U32(ic, ip + m_len) ^
+					    IN_U32(mc, m_pos + m_len);
 					if (v != 0)
 						break;
-
 					m_len += 4;
-
-					v = le32_to_cpu(lzom_sg_read4_at(
-						    in, block_start,
-						    ip_offset + m_len)) ^
-					    le32_to_cpu(lzom_sg_read4_at(
-						    in, block_start,
-						    m_offset + m_len));
-
-					if (unlikely(ip_offset + m_len >=
-						     ip_end))
+					v = IN_U32(ic, ip + m_len) ^
+					    IN_U32(mc, m_pos + m_len);
+					if (unlikely(ip + m_len >= ip_end))
 						goto m_len_done;
 				} while (v == 0);
 			}
@@ -292,117 +387,49 @@ LZO_SAFE(lzo1x_1_do_compress)(struct lzom_sg_buf *in, size_t in_len,
 #error "missing endian definition"
 #endif
 #else
-			if (unlikely(lzom_sg_read1_at(in, block_start,
-						      ip_offset + m_len) ==
-				     lzom_sg_read1_at(in, block_start,
-						      m_offset + m_len))) {
+			if (unlikely(IN_BYTE(ic, ip + m_len) ==
+				     IN_BYTE(mc, m_pos + m_len))) {
 				do {
 					m_len += 1;
-					if (lzom_sg_read1_at(in, block_start,
-							     ip_offset +
-								     m_len) !=
-					    lzom_sg_read1_at(in, block_start,
-							     m_offset + m_len))
-						break;
-
-					m_len += 1;
-					if (lzom_sg_read1_at(in, block_start,
-							     ip_offset +
-								     m_len) !=
-					    lzom_sg_read1_at(in, block_start,
-							     m_offset + m_len))
-						break;
-
-					m_len += 1;
-					if (lzom_sg_read1_at(in, block_start,
-							     ip_offset +
-								     m_len) !=
-					    lzom_sg_read1_at(in, block_start,
-							     m_offset + m_len))
-						break;
-
-					m_len += 1;
-					if (lzom_sg_read1_at(in, block_start,
-							     ip_offset +
-								     m_len) !=
-					    lzom_sg_read1_at(in, block_start,
-							     m_offset + m_len))
-						break;
-
-					m_len += 1;
-					if (lzom_sg_read1_at(in, block_start,
-							     ip_offset +
-								     m_len) !=
-					    lzom_sg_read1_at(in, block_start,
-							     m_offset + m_len))
-						break;
-
-					m_len += 1;
-					if (lzom_sg_read1_at(in, block_start,
-							     ip_offset +
-								     m_len) !=
-					    lzom_sg_read1_at(in, block_start,
-							     m_offset + m_len))
-						break;
-
-					m_len += 1;
-					if (lzom_sg_read1_at(in, block_start,
-							     ip_offset +
-								     m_len) !=
-					    lzom_sg_read1_at(in, block_start,
-							     m_offset + m_len))
-						break;
-
-					m_len += 1;
-					if (unlikely(ip_offset + m_len >=
-						     ip_end))
+					if (unlikely(ip + m_len >= ip_end))
 						goto m_len_done;
-				} while (lzom_sg_read1_at(in, block_start,
-							  ip_offset + m_len) ==
-					 lzom_sg_read1_at(in, block_start,
-							  m_offset + m_len));
+				} while (IN_BYTE(ic, ip + m_len) ==
+					 IN_BYTE(mc, m_pos + m_len));
 			}
 #endif
 		}
 	m_len_done:
-		m_off = ip_offset - m_offset;
-		ip_offset += m_len;
-
-		in->iter = block_start;
-		sg_skip_bytes(in, ip_offset);
+		m_off = ip - m_pos;
+		ip += m_len;
 
 		if (m_len <= M2_MAX_LEN && m_off <= M2_MAX_OFFSET) {
 			m_off -= 1;
-			lzom_sg_write1(out, (unsigned char)((m_len - 1) << 5) |
-						    ((m_off & 7) << 2));
-			lzom_sg_write1(out, (unsigned char)(m_off >> 3));
+			OUT_BYTE((unsigned char)(((m_len - 1) << 5) |
+						 ((m_off & 7) << 2)));
+			OUT_BYTE((unsigned char)(m_off >> 3));
 		} else if (m_off <= M3_MAX_OFFSET) {
 			m_off -= 1;
 			if (m_len <= M3_MAX_LEN)
-				lzom_sg_write1(out,
-					       (unsigned char)(M3_MARKER |
-							       (m_len - 2)));
+				OUT_BYTE((unsigned char)(M3_MARKER |
+							 (m_len - 2)));
 			else {
 				m_len -= M3_MAX_LEN;
-				lzom_sg_write1(out,
-					       (unsigned char)(M3_MARKER | 0));
+				OUT_BYTE((unsigned char)(M3_MARKER | 0));
 
 				while (unlikely(m_len > 255)) {
 					m_len -= 255;
-					lzom_sg_write1(out, 0);
+					OUT_BYTE(0);
 				}
-				lzom_sg_write1(out, (unsigned char)m_len);
+				OUT_BYTE((unsigned char)m_len);
 			}
-			lzom_sg_write1(out, (unsigned char)(m_off << 2));
-			lzom_sg_write1(out, (unsigned char)(m_off >> 6));
+			OUT_BYTE((unsigned char)(m_off << 2));
+			OUT_BYTE((unsigned char)(m_off >> 6));
 		} else {
 			m_off -= 0x4000;
 			if (m_len <= M4_MAX_LEN)
-				lzom_sg_write1(
-					out,
-					(unsigned char)(M4_MARKER |
-							((m_off >> 11) & 8) |
-							(m_len - 2)));
+				OUT_BYTE((unsigned char)(M4_MARKER |
+							 ((m_off >> 11) & 8) |
+							 (m_len - 2)));
 			else {
 				if (unlikely(((m_off & 0x403f) == 0x403f) &&
 					     (m_len >= 261) &&
@@ -414,34 +441,28 @@ LZO_SAFE(lzo1x_1_do_compress)(struct lzom_sg_buf *in, size_t in_len,
 					// can result in ambiguous
 					// output. Adjust length
 					// to 260 to prevent ambiguity.
-					ip_offset -= m_len - 260;
+					ip -= m_len - 260;
 					m_len = 260;
-
-					in->iter = block_start;
-					sg_skip_bytes(in, ip_offset);
 				}
 				m_len -= M4_MAX_LEN;
-				lzom_sg_write1(
-					out,
-					(unsigned char)(M4_MARKER |
-							((m_off >> 11) & 8)));
+				OUT_BYTE((unsigned char)(M4_MARKER |
+							 ((m_off >> 11) & 8)));
 
 				while (unlikely(m_len > 255)) {
 					m_len -= 255;
-					lzom_sg_write1(out, 0);
+					OUT_BYTE(0);
 				}
-				lzom_sg_write1(out, (unsigned char)m_len);
+				OUT_BYTE((unsigned char)m_len);
 			}
-			lzom_sg_write1(out, (unsigned char)(m_off << 2));
-			lzom_sg_write1(out, (unsigned char)(m_off >> 6));
+			OUT_BYTE((unsigned char)(m_off << 2));
+			OUT_BYTE((unsigned char)(m_off >> 6));
 		}
 		*state_offset = -2;
 	finished_writing_instruction:
-		ii_offset = ip_offset;
-		ii_iter = in->iter;
+		ii = ip;
 		goto next;
 	}
-	*tp = in_len - (ii_offset - ti);
+	*tp = in_end - (ii - ti);
 
 	return LZO_E_OK;
 
@@ -458,6 +479,8 @@ LZO_SAFE(lzogeneric1x_1_compress)(struct lzom_sg_buf *in,
 
 	struct bvec_iter in_iter = in->iter;
 	struct bvec_iter out_iter = out->iter;
+	struct lzom_compress_cursors cursors;
+	struct lzom_compress_cursors *cur = &cursors;
 
 	if (in_len == 0)
 		return LZO_E_OK;
@@ -466,6 +489,11 @@ LZO_SAFE(lzogeneric1x_1_compress)(struct lzom_sg_buf *in,
 	size_t t = 0;
 	signed char state_offset = -2;
 	unsigned int m4_max_offset;
+	unsigned int data_start;
+
+	lzom_sg_cursor_init(in, &cur->ic, in_iter);
+	lzom_sg_cursor_init(in, &cur->mc, in_iter);
+	lzom_sg_cursor_init(out, &cur->oc, out_iter);
 
 	// LZO v0 will never write 17 as first byte (except for zero-length
 	// input), so this is used to version the bitstream
@@ -478,6 +506,8 @@ LZO_SAFE(lzogeneric1x_1_compress)(struct lzom_sg_buf *in,
 		m4_max_offset = M4_MAX_OFFSET_V0;
 	}
 
+	data_start = out->iter.bi_size;
+
 	while (l > 20) {
 		size_t ll = min_t(size_t, l, m4_max_offset + 1);
 		uintptr_t ll_end = (uintptr_t)(in_len - l) + ll;
@@ -490,7 +520,8 @@ LZO_SAFE(lzogeneric1x_1_compress)(struct lzom_sg_buf *in,
 			     LZO1X_1_MEM_COMPRESS);
 		memset(wrkmem, 0, D_SIZE * sizeof(lzo_dict_t));
 
-		err = LZO_SAFE(lzo1x_1_do_compress)(in, ll, out, &t, wrkmem,
+		err = LZO_SAFE(lzo1x_1_do_compress)(in, in_iter, in_len - l, ll,
+						    out, cur, &t, wrkmem,
 						    &state_offset,
 						    bitstream_version);
 
@@ -502,38 +533,27 @@ LZO_SAFE(lzogeneric1x_1_compress)(struct lzom_sg_buf *in,
 	t += l;
 
 	if (t > 0) {
-		if (out_iter.bi_size == out->iter.bi_size && t <= 238) {
-			lzom_sg_write1(out, 17 + t);
+		if (out->iter.bi_size == data_start && t <= 238) {
+			OUT_BYTE(17 + t);
 		} else if (t <= 3) {
-			unsigned char prev_byte =
-				lzom_sg_read_back(out, -state_offset);
-			prev_byte |= t;
-			lzom_sg_write_back(out, prev_byte, -state_offset);
+			lzom_out_or_back(out, &cur->oc, -state_offset, t);
 		} else if (t <= 18) {
-			lzom_sg_write1(out, t - 3);
+			OUT_BYTE(t - 3);
 		} else {
 			size_t tt = t - 18;
-			lzom_sg_write1(out, 0);
+			OUT_BYTE(0);
 
 			while (tt > 255) {
 				tt -= 255;
-				lzom_sg_write1(out, 0);
+				OUT_BYTE(0);
 			}
 
-			lzom_sg_write1(out, (unsigned char)tt);
+			OUT_BYTE((unsigned char)tt);
 		}
 
-		if (t >= 16)
-			do {
-				LZOM_COPY8(out, in);
-				LZOM_COPY8(out, in);
-				t -= 16;
-			} while (t >= 16);
-		if (t > 0) {
-			unsigned char tmp[16];
-			if (lzom_sg_copy(out, in, tmp, t) < 0)
-				return LZO_E_OUTPUT_OVERRUN;
-		}
+		if (lzom_copy_literals(out, in, cur, in_iter, in_len - t, t) !=
+		    LZO_E_OK)
+			return LZO_E_OUTPUT_OVERRUN;
 	}
 
 	unsigned char eof[3] = { M4_MARKER | 1, 0, 0 };
@@ -545,6 +565,8 @@ LZO_SAFE(lzogeneric1x_1_compress)(struct lzom_sg_buf *in,
 	in->iter = in_iter;
 	out->iter = out_iter;
 	out->iter.bi_size = out_len;
+	if (out->index.segs)
+		out->index.size = out_len;
 
 	return LZO_E_OK;
 
@@ -558,6 +580,13 @@ int lzom_compress(struct lzom_sg_buf *src, struct lzom_sg_buf *dst,
 	return LZO_SAFE(lzogeneric1x_1_compress)(src, dst, wrkmem, 0);
 }
 
+int lzom_rle_compress(struct lzom_sg_buf *src, struct lzom_sg_buf *dst,
+		      void *wrkmem)
+{
+	return LZO_SAFE(lzogeneric1x_1_compress)(src, dst, wrkmem,
+						 LZO_VERSION);
+}
+
 #ifndef LZO_UNSAFE
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("LZO1X-1 Compressor");
@@ -0,0 +1,371 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ *  LZO1X Decompressor from LZO, scatter-gather input and output
+ *
+ *  Copyright (C) 1996-2012 Markus F.X.J. Oberhumer <markus@oberhumer.com>
+ *
+ *  The full LZO package can be found at:
+ *  http://www.oberhumer.com/opensource/lzo/
+ *
+ *  Changed for Linux kernel use by:
+ *  Nitin Gupta <nitingupta910@gmail.com>
+ *  Richard Purdie <rpurdie@openedhand.com>
+ *
+ *  Modified by:
+ *  julickononov <julickkria@gmail.com>
+ */
+
+#include <linux/kernel.h>
+#include <linux/unaligned.h>
+
+#include "include/lzom_extend.h"
+#include "include/lzom_sg_helpers.h"
+#include "include/lzomdefs.h"
+
+/*
+ * Same state machine as lzom_decompress_safe(), with ip, op and m_pos kept as
+ * byte offsets into the input and output buffers. Every access first tries
+ * the flat window of a cursor and only falls back to the sg helpers when it
+ * crosses a bvec boundary.
+ */
+#define HAVE_IP(x) ((size_t)(in_len - ip) >= (size_t)(x))
+#define HAVE_OP(x) ((size_t)(out_cap - op) >= (size_t)(x))
+#define NEED_IP(x)                 \
+	if (unlikely(!HAVE_IP(x))) \
+	goto input_overrun
+#define NEED_OP(x)                 \
+	if (unlikely(!HAVE_OP(x))) \
+	goto output_overrun
+#define TEST_LB(m_dist)              \
+	if (unlikely((m_dist) > op)) \
+	goto lookbehind_overrun
+
+/* See lzom_decompress_safe.c */
+#define MAX_255_COUNT ((((size_t)~0) / 255) - 2)
+
+struct lzom_decompress_ctx {
+	struct lzom_sg_buf *in;
+	struct lzom_sg_buf *out;
+	struct bvec_iter in_start;
+	struct bvec_iter out_start;
+	size_t in_len;
+	struct lzom_sg_cursor ic; /* input */
+	struct lzom_sg_cursor oc; /* output at op */
+	struct lzom_sg_cursor mc; /* lookbehind at m_pos */
+};
+
+static __always_inline unsigned char lzom_dec_byte(struct lzom_decompress_ctx *c,
+						   size_t pos)
+{
+	const unsigned char *ptr = lzom_sg_cursor_get(c->in, &c->ic, pos, 1);
+
+	if (likely(ptr))
+		return *ptr;
+
+	/* never read past the input, callers check the bounds afterwards */
+	if (pos >= c->in_len)
+		return 0;
+
+	return lzom_sg_read1_at(c->in, c->in_start, pos);
+}
+
+static __always_inline size_t lzom_dec_le16(struct lzom_decompress_ctx *c,
+					    size_t pos)
+{
+	const unsigned char *ptr = lzom_sg_cursor_get(c->in, &c->ic, pos, 2);
+
+	if (likely(ptr))
+		return get_unaligned_le16(ptr);
+
+	return lzom_dec_byte(c, pos) | (lzom_dec_byte(c, pos + 1) << 8);
+}
+
+static void lzom_dec_copy_literals(struct lzom_decompress_ctx *c, size_t ip,
+				   size_t op, size_t len)
+{
+	const unsigned char *src = lzom_sg_cursor_get(c->in, &c->ic, ip, len);
+	unsigned char *dst = lzom_sg_cursor_get(c->out, &c->oc, op, len);
+
+	if (likely(src && dst)) {
+		memcpy(dst, src, len);
+		return;
+	}
+
+	while (len) {
+		unsigned char tmp[16];
+		size_t n;
+
+		src = lzom_sg_cursor_get(c->in, &c->ic, ip, 1);
+		dst = lzom_sg_cursor_get(c->out, &c->oc, op, 1);
+
+		if (likely(src && dst)) {
+			n = min3(len, c->ic.end - ip, c->oc.end - op);
+			memcpy(dst, src, n);
+		} else {
+			n = min_t(size_t, len, sizeof(tmp));
+			lzom_sg_read_at(c->in, c->in_start, ip, tmp, n);
+			lzom_sg_write_at(c->out, c->out_start, op, tmp, n);
+		}
+
+		ip += n;
+		op += n;
+		len -= n;
+	}
+}
+
+/* overlapping forward copy of @len bytes from @m_pos to @op */
+static void lzom_dec_copy_match(struct lzom_decompress_ctx *c, size_t m_pos,
+				size_t op, size_t len)
+{
+	const size_t m_dist = op - m_pos;
+
+	while (len) {
+		const unsigned char *src =
+			lzom_sg_cursor_get(c->out, &c->mc, m_pos, 1);
+		unsigned char *dst = lzom_sg_cursor_get(c->out, &c->oc, op, 1);
+		unsigned char tmp[16];
+		size_t n;
+
+		if (likely(src && dst)) {
+			n = min3(len, c->mc.end - m_pos, c->oc.end - op);
+
+			if (m_dist >= n) {
+				memcpy(dst, src, n);
+			} else if (m_dist >= 8) {
+				size_t i;
+
+				for (i = 0; i + 8 <= n; i += 8)
+					COPY8(dst + i, src + i);
+				for (; i < n; i++)
+					dst[i] = src[i];
+			} else {
+				size_t i;
+
+				for (i = 0; i < n; i++)
+					dst[i] = src[i];
+			}
+		} else {
+			n = min3(len, sizeof(tmp), m_dist);
+			lzom_sg_read_at(c->out, c->out_start, m_pos, tmp, n);
+			lzom_sg_write_at(c->out, c->out_start, op, tmp, n);
+		}
+
+		m_pos += n;
+		op += n;
+		len -= n;
+	}
+}
+
+static void lzom_dec_zero(struct lzom_decompress_ctx *c, size_t op, size_t len)
+{
+	static const unsigned char zeros[64];
+
+	while (len) {
+		unsigned char *dst = lzom_sg_cursor_get(c->out, &c->oc, op, 1);
+		size_t n;
+
+		if (likely(dst)) {
+			n = min_t(size_t, len, c->oc.end - op);
+			memset(dst, 0, n);
+		} else {
+			n = min_t(size_t, len, sizeof(zeros));
+			lzom_sg_write_at(c->out, c->out_start, op, zeros, n);
+		}
+
+		op += n;
+		len -= n;
+	}
+}
+
+int lzom_decompress_sg(struct lzom_sg_buf *src, struct lzom_sg_buf *dst,
+		       size_t *out_len)
+{
+	struct lzom_decompress_ctx ctx = {
+		.in = src,
+		.out = dst,
+		.in_start = src->iter,
+		.out_start = dst->iter,
+		.in_len = src->iter.bi_size,
+	};
+	struct lzom_decompress_ctx *c = &ctx;
+	const size_t in_len = src->iter.bi_size;
+	const size_t out_cap = dst->iter.bi_size;
+	size_t ip = 0, op = 0;
+	size_t t, next;
+	size_t state = 0;
+	size_t m_dist;
+	unsigned char bitstream_version;
+
+	lzom_sg_cursor_init(src, &ctx.ic, ctx.in_start);
+	lzom_sg_cursor_init(dst, &ctx.oc, ctx.out_start);
+	lzom_sg_cursor_init(dst, &ctx.mc, ctx.out_start);
+
+	if (unlikely(in_len < 3))
+		goto input_overrun;
+
+	if (likely(in_len >= 5) && likely(lzom_dec_byte(c, 0) == 17)) {
+		bitstream_version = lzom_dec_byte(c, 1);
+		ip += 2;
+	} else {
+		bitstream_version = 0;
+	}
+
+	if (lzom_dec_byte(c, ip) > 17) {
+		t = lzom_dec_byte(c, ip++) - 17;
+		if (t < 4) {
+			next = t;
+			goto match_next;
+		}
+		goto copy_literal_run;
+	}
+
+	for (;;) {
+		t = lzom_dec_byte(c, ip++);
+		if (t < 16) {
+			if (likely(state == 0)) {
+				if (unlikely(t == 0)) {
+					size_t offset;
+					const size_t ip_last = ip;
+
+					while (unlikely(lzom_dec_byte(c, ip) ==
+							0)) {
+						ip++;
+						NEED_IP(1);
+					}
+					offset = ip - ip_last;
+					if (unlikely(offset > MAX_255_COUNT))
+						return LZO_E_ERROR;
+
+					offset = (offset << 8) - offset;
+					t += offset + 15 + lzom_dec_byte(c, ip++);
+				}
+				t += 3;
+copy_literal_run:
+				NEED_OP(t);
+				NEED_IP(t + 3);
+				lzom_dec_copy_literals(c, ip, op, t);
+				ip += t;
+				op += t;
+				state = 4;
+				continue;
+			} else if (state != 4) {
+				next = t & 3;
+				m_dist = 1 + (t >> 2);
+				m_dist += lzom_dec_byte(c, ip++) << 2;
+				TEST_LB(m_dist);
+				NEED_OP(2);
+				lzom_dec_copy_match(c, op - m_dist, op, 2);
+				op += 2;
+				goto match_next;
+			} else {
+				next = t & 3;
+				m_dist = 1 + M2_MAX_OFFSET + (t >> 2);
+				m_dist += lzom_dec_byte(c, ip++) << 2;
+				t = 3;
+			}
+		} else if (t >= 64) {
+			next = t & 3;
+			m_dist = 1 + ((t >> 2) & 7);
+			m_dist += lzom_dec_byte(c, ip++) << 3;
+			t = (t >> 5) - 1 + (3 - 1);
+		} else if (t >= 32) {
+			t = (t & 31) + (3 - 1);
+			if (unlikely(t == 2)) {
+				size_t offset;
+				const size_t ip_last = ip;
+
+				while (unlikely(lzom_dec_byte(c, ip) == 0)) {
+					ip++;
+					NEED_IP(1);
+				}
+				offset = ip - ip_last;
+				if (unlikely(offset > MAX_255_COUNT))
+					return LZO_E_ERROR;
+
+				offset = (offset << 8) - offset;
+				t += offset + 31 + lzom_dec_byte(c, ip++);
+				NEED_IP(2);
+			}
+			next = lzom_dec_le16(c, ip);
+			ip += 2;
+			m_dist = 1 + (next >> 2);
+			next &= 3;
+		} else {
+			NEED_IP(2);
+			next = lzom_dec_le16(c, ip);
+			if (((next & 0xfffc) == 0xfffc) &&
+			    ((t & 0xf8) == 0x18) &&
+			    likely(bitstream_version)) {
+				NEED_IP(3);
+				t &= 7;
+				t |= lzom_dec_byte(c, ip + 2) << 3;
+				t += MIN_ZERO_RUN_LENGTH;
+				NEED_OP(t);
+				lzom_dec_zero(c, op, t);
+				op += t;
+				next &= 3;
+				ip += 3;
+				goto match_next;
+			} else {
+				m_dist = (t & 8) << 11;
+				t = (t & 7) + (3 - 1);
+				if (unlikely(t == 2)) {
+					size_t offset;
+					const size_t ip_last = ip;
+
+					while (unlikely(lzom_dec_byte(c, ip) ==
+							0)) {
+						ip++;
+						NEED_IP(1);
+					}
+					offset = ip - ip_last;
+					if (unlikely(offset > MAX_255_COUNT))
+						return LZO_E_ERROR;
+
+					offset = (offset << 8) - offset;
+					t += offset + 7 + lzom_dec_byte(c, ip++);
+					NEED_IP(2);
+					next = lzom_dec_le16(c, ip);
+				}
+				ip += 2;
+				m_dist += next >> 2;
+				next &= 3;
+				if (m_dist == 0)
+					goto eof_found;
+				m_dist += 0x4000;
+			}
+		}
+		TEST_LB(m_dist);
+		NEED_OP(t);
+		lzom_dec_copy_match(c, op - m_dist, op, t);
+		op += t;
+match_next:
+		state = next;
+		t = next;
+		NEED_IP(t + 3);
+		NEED_OP(t);
+		if (t) {
+			lzom_dec_copy_literals(c, ip, op, t);
+			ip += t;
+			op += t;
+		}
+	}
+
+eof_found:
+	*out_len = op;
+	return (t != 3       ? LZO_E_ERROR :
+		ip == in_len ? LZO_E_OK :
+		ip <  in_len ? LZO_E_INPUT_NOT_CONSUMED : LZO_E_INPUT_OVERRUN);
+
+input_overrun:
+	*out_len = op;
+	return LZO_E_INPUT_OVERRUN;
+
+output_overrun:
+	*out_len = op;
+	return LZO_E_OUTPUT_OVERRUN;
+
+lookbehind_overrun:
+	*out_len = op;
+	return LZO_E_LOOKBEHIND_OVERRUN;
+}
@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: GPL-2.0-only
 
 #include <linux/bvec.h>
+#include <linux/highmem.h>
 #include <linux/kernel.h>
 
 #include "include/lzom_sg_helpers.h"
@@ -65,51 +66,324 @@ void sg_skip_bytes(struct lzom_sg_buf *buf, size_t len)
 	BUG_ON(!res);
 }
 
+unsigned int lzom_sg_index_count(const struct lzom_sg_buf *buf)
+{
+	struct bvec_iter iter;
+	struct bio_vec bv;
+	unsigned int nr_segs = 0;
+
+	for_each_bvec (bv, buf->bvec, iter, buf->iter)
+		nr_segs++;
+
+	return nr_segs;
+}
+
+void lzom_sg_index_build(struct lzom_sg_buf *buf, struct lzom_sg_seg *segs,
+			 unsigned int nr_segs)
+{
+	struct lzom_sg_index *index = &buf->index;
+	struct bvec_iter iter;
+	struct bio_vec bv;
+	size_t start = 0;
+	unsigned int i = 0;
+
+	for_each_bvec (bv, buf->bvec, iter, buf->iter) {
+		BUG_ON(i >= nr_segs);
+
+		segs[i].start = start;
+		segs[i].len = bv.bv_len;
+		segs[i].bv_idx = iter.bi_idx;
+		segs[i].bv_done = iter.bi_bvec_done;
+		segs[i].offset = bv.bv_offset;
+		segs[i].page = bv.bv_page;
+		segs[i].addr = PageHighMem(bv.bv_page) ?
+				       NULL :
+				       (unsigned char *)page_address(bv.bv_page) +
+					       bv.bv_offset;
+
+		start += bv.bv_len;
+		i++;
+	}
+
+	index->segs = segs;
+	index->nr_segs = i;
+	index->hint = 0;
+	index->size = buf->iter.bi_size;
+
+	index->pgoff = i ? PAGE_SIZE - segs[0].len : 0;
+	index->paged = true;
+	for (i = 1; i + 1 < index->nr_segs; i++) {
+		if (segs[i].len != PAGE_SIZE) {
+			index->paged = false;
+			break;
+		}
+	}
+
+	/* link chunks whose mappings follow each other into flat runs */
+	for (i = 0; i < index->nr_segs; i++) {
+		struct lzom_sg_seg *prev = i ? &segs[i - 1] : NULL;
+
+		if (prev && prev->addr && segs[i].addr &&
+		    prev->addr + prev->len == segs[i].addr)
+			segs[i].run_start = prev->run_start;
+		else
+			segs[i].run_start = segs[i].start;
+	}
+
+	for (i = index->nr_segs; i-- > 0;) {
+		struct lzom_sg_seg *next =
+			i + 1 < index->nr_segs ? &segs[i + 1] : NULL;
+
+		if (next && next->run_start == segs[i].run_start)
+			segs[i].run_end = next->run_end;
+		else
+			segs[i].run_end = segs[i].start + segs[i].len;
+	}
+}
+
+static inline size_t lzom_sg_index_pos(const struct lzom_sg_index *index,
+				       struct bvec_iter iter)
+{
+	return index->size - iter.bi_size;
+}
+
+/*
+ * @pos must be below index->size. Paged layouts are resolved arithmetically,
+ * the rest through @hint, the last segment hit by the caller, and a binary
+ * search. Callers walking the buffer independently keep separate hints.
+ */
+static struct lzom_sg_seg *lzom_sg_index_find(struct lzom_sg_index *index,
+					      size_t pos, unsigned int *hint)
+{
+	struct lzom_sg_seg *seg = &index->segs[*hint];
+	unsigned int lo = 0, hi = index->nr_segs;
+
+	if (likely(index->paged))
+		return lzom_sg_index_page(index, pos);
+
+	if (pos - seg->start < seg->len)
+		return seg;
+
+	/* sequential access usually lands in the next segment */
+	if (*hint + 1 < index->nr_segs && pos - seg[1].start < seg[1].len) {
+		(*hint)++;
+		return seg + 1;
+	}
+
+	while (hi - lo > 1) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (index->segs[mid].start <= pos)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	*hint = lo;
+	return &index->segs[lo];
+}
+
+static struct bvec_iter lzom_sg_index_iter(struct lzom_sg_index *index,
+					   struct bvec_iter iter, size_t pos)
+{
+	struct lzom_sg_seg *seg;
+
+	iter.bi_size = index->size - pos;
+
+	if (unlikely(pos == index->size)) {
+		seg = &index->segs[index->nr_segs - 1];
+		iter.bi_idx = seg->bv_idx;
+		iter.bi_bvec_done = seg->bv_done + seg->len;
+		return iter;
+	}
+
+	seg = lzom_sg_index_find(index, pos, &index->hint);
+	iter.bi_idx = seg->bv_idx;
+	iter.bi_bvec_done = seg->bv_done + (pos - seg->start);
+
+	return iter;
+}
+
+struct bvec_iter lzom_sg_iter_at(struct lzom_sg_buf *buf,
+				 struct bvec_iter start, size_t offset)
+{
+	struct lzom_sg_index *index = &buf->index;
+	size_t pos;
+
+	if (!index->segs) {
+		struct lzom_sg_buf tmp = { .bvec = buf->bvec, .iter = start };
+
+		sg_skip_bytes(&tmp, offset);
+		return tmp.iter;
+	}
+
+	pos = lzom_sg_index_pos(index, start) + offset;
+	BUG_ON(pos > index->size);
+
+	return lzom_sg_index_iter(index, start, pos);
+}
+
+void lzom_sg_seek(struct lzom_sg_buf *buf, struct bvec_iter start,
+		  size_t offset)
+{
+	buf->iter = lzom_sg_iter_at(buf, start, offset);
+}
+
+int lzom_sg_read_at(struct lzom_sg_buf *buf, struct bvec_iter start,
+		    size_t offset, unsigned char *data, size_t len)
+{
+	struct lzom_sg_index *index = &buf->index;
+	struct lzom_sg_seg *seg;
+	size_t pos, seg_off;
+
+	if (!index->segs) {
+		struct bvec_iter saved = buf->iter;
+		int ret;
+
+		buf->iter = start;
+		sg_skip_bytes(buf, offset);
+		ret = sg_read_bytes(buf, data, len);
+		buf->iter = saved;
+
+		return ret;
+	}
+
+	pos = lzom_sg_index_pos(index, start) + offset;
+	if (unlikely(pos + len > index->size))
+		return -EINVAL;
+
+	seg = lzom_sg_index_find(index, pos, &index->hint);
+	seg_off = pos - seg->start;
+
+	if (likely(seg->addr && seg_off + len <= seg->len)) {
+		memcpy(data, seg->addr + seg_off, len);
+		return 0;
+	}
+
+	while (len) {
+		size_t to_read = min_t(size_t, seg->len - seg_off, len);
+
+		memcpy_from_page((char *)data, seg->page,
+				 seg->offset + seg_off, to_read);
+
+		data += to_read;
+		len -= to_read;
+		seg++;
+		seg_off = 0;
+	}
+
+	return 0;
+}
+
+void lzom_sg_cursor_init(struct lzom_sg_buf *buf, struct lzom_sg_cursor *c,
+			 struct bvec_iter start)
+{
+	c->addr = NULL;
+	c->base = buf->index.segs ? lzom_sg_index_pos(&buf->index, start) : 0;
+	c->start = 0;
+	c->end = 0;
+	c->hint = 0;
+}
+
+unsigned char *lzom_sg_cursor_map(struct lzom_sg_buf *buf,
+				  struct lzom_sg_cursor *c, size_t pos,
+				  size_t len)
+{
+	struct lzom_sg_index *index = &buf->index;
+	size_t ipos = c->base + pos;
+
+	if (!index->segs || ipos >= index->size || len > index->size - ipos)
+		return NULL;
+
+	return lzom_sg_cursor_set(c, lzom_sg_index_find(index, ipos, &c->hint),
+				  pos, len);
+}
+
+int lzom_sg_write_at(struct lzom_sg_buf *buf, struct bvec_iter start,
+		     size_t offset, const unsigned char *data, size_t len)
+{
+	struct lzom_sg_index *index = &buf->index;
+	struct lzom_sg_seg *seg;
+	size_t pos, seg_off;
+
+	if (!index->segs) {
+		struct bvec_iter saved = buf->iter;
+		int ret;
+
+		buf->iter = start;
+		sg_skip_bytes(buf, offset);
+		ret = sg_write_bytes(buf, data, len);
+		buf->iter = saved;
+
+		return ret;
+	}
+
+	pos = lzom_sg_index_pos(index, start) + offset;
+	if (unlikely(pos + len > index->size))
+		return -EINVAL;
+
+	seg = lzom_sg_index_find(index, pos, &index->hint);
+	seg_off = pos - seg->start;
+
+	while (len) {
+		size_t to_write = min_t(size_t, seg->len - seg_off, len);
+
+		memcpy_to_page(seg->page, seg->offset + seg_off,
+			       (const char *)data, to_write);
+
+		data += to_write;
+		len -= to_write;
+		seg++;
+		seg_off = 0;
+	}
+
+	return 0;
+}
+
 unsigned char lzom_sg_read1_at(struct lzom_sg_buf *buf, struct bvec_iter start,
 			       size_t offset)
 {
-	struct bvec_iter saved = buf->iter;
-	unsigned char value;
-
-	buf->iter = start;
-	sg_skip_bytes(buf, offset);
-	value = lzom_sg_read1(buf);
-	buf->iter = saved;
+	unsigned char value = 0;
 
+	lzom_sg_read_at(buf, start, offset, &value, sizeof(value));
 	return value;
 }
 
 u32 lzom_sg_read4_at(struct lzom_sg_buf *buf, struct bvec_iter start,
 		     size_t offset)
 {
-	struct bvec_iter saved = buf->iter;
-	u32 value;
-
-	buf->iter = start;
-	sg_skip_bytes(buf, offset);
-	value = lzom_sg_read4(buf);
-	buf->iter = saved;
+	u32 value = 0;
 
+	lzom_sg_read_at(buf, start, offset, (unsigned char *)&value,
+			sizeof(value));
 	return value;
 }
 
 u64 lzom_sg_read8_at(struct lzom_sg_buf *buf, struct bvec_iter start,
 		     size_t offset)
 {
-	struct bvec_iter saved = buf->iter;
-	u64 value;
-
-	buf->iter = start;
-	sg_skip_bytes(buf, offset);
-	value = lzom_sg_read8(buf);
-	buf->iter = saved;
+	u64 value = 0;
 
+	lzom_sg_read_at(buf, start, offset, (unsigned char *)&value,
+			sizeof(value));
 	return value;
 }
 
 int lzom_sg_move_back(struct lzom_sg_buf *buf, struct bvec_iter *iter,
 		      size_t offset)
 {
+	struct lzom_sg_index *index = &buf->index;
+
+	if (index->segs) {
+		size_t pos = lzom_sg_index_pos(index, *iter);
+
+		if (offset > pos)
+			return -EINVAL;
+
+		*iter = lzom_sg_index_iter(index, *iter, pos - offset);
+		return 0;
+	}
+
 	while (offset > 0) {
 		if (iter->bi_bvec_done >= offset) {
 			iter->bi_bvec_done -= offset;
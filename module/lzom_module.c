@@ -1,398 +1,3441 @@
 // SPDX-License-Identifier: GPL-2.0-only
 
+#include <linux/blk-mq.h>
 #include <linux/blk_types.h>
 #include <linux/blkdev.h>
 #include <linux/bvec.h>
+#include <linux/completion.h>
 #include <linux/highmem.h>
+#include <linux/log2.h>
+#include <linux/mempool.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/overflow.h>
+#include <linux/percpu.h>
+#include <linux/random.h>
+#include <linux/rcupdate.h>
+#include <linux/sched/clock.h>
+#include <linux/shrinker.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
+#include <linux/xxhash.h>
+
+#include "lzom_extend.h"
+#include "lzom_sg_helpers.h"
 
 #include "lzom_module.h"
 
-#include "lzom_extend.h"
+#define CREATE_TRACE_POINTS
+#include "lzom_trace.h"
+
+#define LZOM_INIT_MINOR 0
+#define POOL_SIZE 512
+#define LZOM_QUEUE_DEPTH 128
+/* 1 GiB, bounds the time one discard spends walking the map */
+#define LZOM_UNMAP_MAX_SECTORS (1U << 21)
+/* what one lower bio of full pages holds, larger bios are split */
+#define LZOM_IO_MAX_SECTORS (BIO_MAX_VECS << (PAGE_SHIFT - SECTOR_SHIFT))
+/* in ms, how long a request short of memory waits before it is retried */
+#define LZOM_REQUEUE_DELAY 10
+
+static struct lzom_module_g lzom = {
+	.free_minor = LZOM_INIT_MINOR,
+	.queue_depth = LZOM_QUEUE_DEPTH,
+	.dedup_entries = LZOM_DEDUP_ENTRIES_DEFAULT,
+};
+
+static bool lzom_is_exist(void)
+{
+	return lzom.dev_path;
+}
+
+/* ----------------- stats -----------------*/
+static void lzom_stat_add(struct lzom_dev *ldev, enum lzom_stat_item item,
+			  u64 val)
+{
+	this_cpu_add(ldev->stats->items[item], val);
+}
+
+static void lzom_stat_inc(struct lzom_dev *ldev, enum lzom_stat_item item)
+{
+	lzom_stat_add(ldev, item, 1);
+}
+
+static u64 lzom_stat_read(struct lzom_dev *ldev, enum lzom_stat_item item)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu (cpu)
+		sum += per_cpu_ptr(ldev->stats, cpu)->items[item];
+
+	return sum;
+}
+
+/* a timestamp for lzom_lat_end(), 0 while the histograms are off */
+static u64 lzom_lat_start(struct lzom_dev *ldev)
+{
+	return READ_ONCE(ldev->latency) ? local_clock() : 0;
+}
+
+static void lzom_lat_add(struct lzom_dev *ldev, enum lzom_lat_stage stage,
+			 u64 ns)
+{
+	unsigned int bucket = min_t(unsigned int, ilog2(ns | 1),
+				    LZOM_LAT_BUCKETS - 1);
+
+	if (READ_ONCE(ldev->latency))
+		this_cpu_inc(ldev->stats->lat[stage][bucket]);
+}
+
+static void lzom_lat_end(struct lzom_dev *ldev, enum lzom_lat_stage stage,
+			 u64 start)
+{
+	if (start)
+		lzom_lat_add(ldev, stage, local_clock() - start);
+}
+
+/* ----------------- requests -----------------*/
+static void lzom_bio_free_pages(struct lzom_dev *ldev, struct bio *bio)
+{
+	struct bio_vec *bv;
+	struct bvec_iter_all iter_all;
+
+	bio_for_each_segment_all (bv, bio, iter_all)
+		mempool_free(bv->bv_page, &ldev->page_pool);
+}
+
+/*
+ * Fills @bio with @size bytes of pages from the device page pool. As in
+ * dm-crypt, only one bio at a time may wait on the pool, so that several
+ * bios holding part of the reserve cannot starve each other.
+ */
+static void lzom_bio_alloc_pages(struct lzom_dev *ldev, struct bio *bio,
+				 size_t size)
+{
+	gfp_t gfp = GFP_NOWAIT | __GFP_NOWARN;
+	unsigned int nr_pages = DIV_ROUND_UP(size, PAGE_SIZE);
+	unsigned int i;
+	bool locked = false;
+
+retry:
+	for (i = 0; i < nr_pages; i++) {
+		unsigned int len = min_t(size_t, size - i * PAGE_SIZE,
+					 PAGE_SIZE);
+		struct page *page = mempool_alloc(&ldev->page_pool, gfp);
+
+		if (!page) {
+			lzom_bio_free_pages(ldev, bio);
+			bio_reset(bio, bio->bi_bdev, bio->bi_opf);
+			mutex_lock(&ldev->page_pool_lock);
+			locked = true;
+			gfp = GFP_NOIO;
+			goto retry;
+		}
+
+		__bio_add_page(bio, page, len, 0);
+	}
+
+	if (locked)
+		mutex_unlock(&ldev->page_pool_lock);
+}
+
+/*
+ * Completes @rq. A request that ran short of memory is not failed but
+ * requeued and retried as a whole a little later: writing its blocks or
+ * reading them again is harmless.
+ */
+static void lzom_rq_end(struct request *rq, blk_status_t status)
+{
+	struct lzom_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	struct lzom_dev *ldev = rq->q->queuedata;
+
+	kfree(cmd->bvec);
+	cmd->bvec = NULL;
+
+	if (status == BLK_STS_RESOURCE) {
+		lzom_stat_inc(ldev, LZOM_STAT_REQUEUED);
+		blk_mq_requeue_request(rq, false);
+		blk_mq_delay_kick_requeue_list(rq->q, LZOM_REQUEUE_DELAY);
+		return;
+	}
+
+	lzom_stat_inc(ldev, LZOM_STAT_COMPLETED);
+	blk_mq_end_request(rq, status);
+}
+
+/*
+ * Queues @rq for the next map sync. Everything acknowledged before is in
+ * the map by then, so one sync completes all flushes and FUA writes that
+ * piled up while the previous one ran.
+ */
+static void lzom_flush_queue(struct lzom_dev *ldev, struct request *rq)
+{
+	struct lzom_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	unsigned long flags;
+
+	atomic64_inc(&ldev->flush_stat.requests);
+
+	spin_lock_irqsave(&ldev->flush_lock, flags);
+	list_add_tail(&cmd->node, &ldev->flush_cmds);
+	spin_unlock_irqrestore(&ldev->flush_lock, flags);
+
+	queue_work(ldev->io_wq, &ldev->flush_work);
+}
+
+static blk_status_t lzom_stage_flush(struct lzom_dev *ldev);
+
+static void lzom_flush_work_fn(struct work_struct *work)
+{
+	struct lzom_dev *ldev = container_of(work, struct lzom_dev, flush_work);
+	struct lzom_cmd *cmd, *next;
+	blk_status_t ret, err;
+	LIST_HEAD(cmds);
+
+	spin_lock_irq(&ldev->flush_lock);
+	list_splice_init(&ldev->flush_cmds, &cmds);
+	spin_unlock_irq(&ldev->flush_lock);
+
+	if (list_empty(&cmds))
+		return;
+
+	/* staged writes were acknowledged before the flush */
+	ret = lzom_stage_flush(ldev);
+	err = errno_to_blk_status(lzom_store_sync(&ldev->store));
+	if (!ret)
+		ret = err;
+	atomic64_inc(&ldev->flush_stat.commits);
+
+	list_for_each_entry_safe (cmd, next, &cmds, node) {
+		list_del_init(&cmd->node);
+		lzom_rq_end(blk_mq_rq_from_pdu(cmd), ret);
+	}
+}
+
+/*
+ * Drops one block of @rq, the last one ends the request. A FUA write is
+ * durable only once the map points at its blocks on disk, so it waits for
+ * the next map sync instead.
+ */
+static void lzom_cmd_put(struct request *rq, blk_status_t status)
+{
+	struct lzom_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	if (status)
+		WRITE_ONCE(cmd->status, status);
+
+	if (!atomic_dec_and_test(&cmd->remaining))
+		return;
+
+	status = READ_ONCE(cmd->status);
+	if (status == BLK_STS_OK && rq->cmd_flags & REQ_FUA)
+		lzom_flush_queue(rq->q->queuedata, rq);
+	else
+		lzom_rq_end(rq, status);
+}
+
+/* lower bios are written back, durability comes from lzom_flush_queue() */
+static blk_opf_t lzom_rq_opf(struct request *rq)
+{
+	return rq->cmd_flags & ~(REQ_FUA | REQ_PREFLUSH);
+}
+
+/*
+ * The payload of @rq as one sg buffer. A request made of several bios
+ * gets its bvecs collected into cmd->bvec, as the loop driver does.
+ */
+static int lzom_rq_payload(struct request *rq, struct lzom_sg_buf *payload)
+{
+	struct lzom_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	struct req_iterator rq_iter;
+	struct bio_vec tmp;
+	unsigned int nr_bvec = 0;
+
+	if (rq->bio == rq->biotail) {
+		*payload = lzom_sg_buf_create(rq->bio->bi_iter,
+					      rq->bio->bi_io_vec);
+		return 0;
+	}
+
+	rq_for_each_bvec (tmp, rq, rq_iter)
+		nr_bvec++;
+
+	cmd->bvec = kmalloc_array(nr_bvec, sizeof(*cmd->bvec), GFP_NOIO);
+	if (!cmd->bvec)
+		return -ENOMEM;
+
+	nr_bvec = 0;
+	rq_for_each_bvec (tmp, rq, rq_iter)
+		cmd->bvec[nr_bvec++] = tmp;
+
+	*payload = lzom_sg_buf_create(
+		(struct bvec_iter){ .bi_size = blk_rq_bytes(rq) }, cmd->bvec);
+	return 0;
+}
+
+/* @len bytes of @payload starting at @off */
+static struct lzom_sg_buf lzom_payload_slice(struct lzom_sg_buf *payload,
+					     unsigned int off, unsigned int len)
+{
+	struct bvec_iter iter = payload->iter;
+
+	bvec_iter_advance(payload->bvec, &iter, off);
+	iter.bi_size = len;
+
+	return lzom_sg_buf_create(iter, payload->bvec);
+}
+
+/* memchr_inv() compares a word at a time */
+static bool lzom_payload_is_zero(struct lzom_sg_buf *slice)
+{
+	struct bvec_iter iter;
+	struct bio_vec bv;
+
+	for_each_bvec (bv, slice->bvec, iter, slice->iter) {
+		const char *ptr = bvec_kmap_local(&bv);
+		bool zero = !memchr_inv(ptr, 0, bv.bv_len);
+
+		kunmap_local(ptr);
+		if (!zero)
+			return false;
+	}
+
+	return true;
+}
+
+static void lzom_payload_zero(struct lzom_sg_buf *slice)
+{
+	struct bvec_iter iter;
+	struct bio_vec bv;
+
+	for_each_bvec (bv, slice->bvec, iter, slice->iter)
+		memzero_bvec(&bv);
+}
+
+/*
+ * A lower bio over the pages of @payload, max_segments keeps a request
+ * and so any part of it within one bio.
+ */
+static struct bio *lzom_bio_map(struct lzom_dev *ldev,
+				struct lzom_sg_buf *payload, blk_opf_t opf)
+{
+	unsigned int nr_segs = lzom_sg_index_count(payload);
+	struct bvec_iter iter;
+	struct bio_vec bv;
+	struct bio *bio;
+
+	if (WARN_ON_ONCE(nr_segs > BIO_MAX_VECS))
+		return NULL;
+
+	bio = bio_alloc_bioset(ldev->under_dev.bdev, nr_segs, opf, GFP_NOIO,
+			       ldev->under_dev.bset);
+	if (!bio)
+		return NULL;
+
+	for_each_bvec (bv, payload->bvec, iter, payload->iter)
+		__bio_add_page(bio, bv.bv_page, bv.bv_len, bv.bv_offset);
+
+	return bio;
+}
+
+static void lzom_init_bvec_array(struct bio_vec *bvec, size_t vec_cnt,
+				 char *data_ptr, size_t data_len)
+{
+	size_t i;
+	size_t remaining = data_len;
+	char *cur_ptr = data_ptr;
+
+	for (i = 0; i < vec_cnt && remaining > 0; i++) {
+		size_t page_offset = offset_in_page(cur_ptr);
+		size_t chunk_len =
+			min_t(size_t, remaining, PAGE_SIZE - page_offset);
+
+		bvec[i].bv_page = virt_to_page(cur_ptr);
+		bvec[i].bv_offset = page_offset;
+		bvec[i].bv_len = chunk_len;
+
+		cur_ptr += chunk_len;
+		remaining -= chunk_len;
+	}
+}
+
+/* ----------------- workspace -----------------*/
+static void lzom_ws_destroy(struct lzom_ws *ws)
+{
+	kfree(ws->verify);
+	kfree(ws->src_segs);
+	kfree(ws->out_segs);
+	kfree(ws->out_bvec);
+	kfree(ws->out);
+	kfree(ws->wrkmem);
+	memset(ws, 0, sizeof(*ws));
+}
+
+static int lzom_ws_init(struct lzom_ws *ws, size_t unit_size,
+			unsigned int nr_src_segs, gfp_t gfp, int node)
+{
+	ws->unit_size = unit_size;
+	ws->out_len = lzo_worst_compress(unit_size);
+	ws->out_vecs = DIV_ROUND_UP(ws->out_len, PAGE_SIZE) + 1;
+	ws->nr_src_segs = nr_src_segs;
+
+	ws->wrkmem = kmalloc_node(LZO1X_1_MEM_COMPRESS, gfp, node);
+	ws->out = kmalloc_node(ws->out_len, gfp, node);
+	ws->out_bvec = kmalloc_array_node(ws->out_vecs, sizeof(*ws->out_bvec),
+					  gfp, node);
+	ws->out_segs = kmalloc_array_node(ws->out_vecs, sizeof(*ws->out_segs),
+					  gfp, node);
+	ws->src_segs = kmalloc_array_node(nr_src_segs, sizeof(*ws->src_segs),
+					  gfp, node);
+	ws->verify = kmalloc_node(unit_size, gfp, node);
+	if (!ws->wrkmem || !ws->out || !ws->out_bvec || !ws->out_segs ||
+	    !ws->src_segs || !ws->verify) {
+		lzom_ws_destroy(ws);
+		return -ENOMEM;
+	}
+
+	lzom_init_bvec_array(ws->out_bvec, ws->out_vecs, ws->out, ws->out_len);
+	return 0;
+}
+
+static void lzom_dev_ws_free(struct lzom_dev *ldev)
+{
+	int cpu;
+
+	if (!ldev->ws)
+		return;
+
+	for_each_possible_cpu (cpu)
+		lzom_ws_destroy(per_cpu_ptr(ldev->ws, cpu));
+
+	free_percpu(ldev->ws);
+	ldev->ws = NULL;
+}
+
+static int lzom_dev_ws_alloc(struct lzom_dev *ldev, size_t unit_size)
+{
+	/* every bvec may add one more chunk on top of the page count */
+	unsigned int nr_src_segs = DIV_ROUND_UP(unit_size, PAGE_SIZE) +
+				   BIO_MAX_VECS;
+	int cpu, ret;
+
+	ldev->ws = alloc_percpu(struct lzom_ws);
+	if (!ldev->ws)
+		return -ENOMEM;
+
+	for_each_possible_cpu (cpu) {
+		ret = lzom_ws_init(per_cpu_ptr(ldev->ws, cpu), unit_size,
+				   nr_src_segs, GFP_KERNEL, cpu_to_node(cpu));
+		if (ret) {
+			lzom_dev_ws_free(ldev);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Returns this CPU's workspace with preemption disabled, or falls back to
+ * a one-off workspace in @tmp when the unit does not fit into it.
+ */
+static struct lzom_ws *lzom_ws_get(struct lzom_dev *ldev, struct lzom_ws *tmp,
+				   size_t unit_size, unsigned int nr_src_segs)
+{
+	struct lzom_ws *ws = get_cpu_ptr(ldev->ws);
+
+	if (likely(unit_size <= ws->unit_size &&
+		   nr_src_segs <= ws->nr_src_segs))
+		return ws;
+
+	put_cpu_ptr(ldev->ws);
+
+	if (lzom_ws_init(tmp, unit_size, nr_src_segs, GFP_NOIO, NUMA_NO_NODE))
+		return NULL;
+
+	return tmp;
+}
+
+static void lzom_ws_put(struct lzom_dev *ldev, struct lzom_ws *ws,
+			struct lzom_ws *tmp)
+{
+	if (ws == tmp)
+		lzom_ws_destroy(tmp);
+	else
+		put_cpu_ptr(ldev->ws);
+}
+
+static bool lzom_verify_wanted(struct lzom_dev *ldev)
+{
+	switch (READ_ONCE(ldev->verify_mode)) {
+	case LZOM_VERIFY_ALWAYS:
+		return true;
+	case LZOM_VERIFY_SAMPLE:
+		return !get_random_u32_below(READ_ONCE(ldev->verify_sample));
+	default:
+		return false;
+	}
+}
+
+/* compares @slice with the flat buffer @data */
+static bool lzom_payload_equal(struct lzom_sg_buf *slice, const char *data)
+{
+	struct bio_vec bv;
+	struct bvec_iter iter;
+	bool equal = true;
+
+	for_each_bvec (bv, slice->bvec, iter, slice->iter) {
+		const char *ptr = bvec_kmap_local(&bv);
+
+		equal = !memcmp(ptr, data, bv.bv_len);
+		kunmap_local(ptr);
+		if (!equal)
+			break;
+
+		data += bv.bv_len;
+	}
+
+	return equal;
+}
+
+/*
+ * Compresses @slice, the data of block @lba on, with this CPU's
+ * workspace. The result is copied to @out when it fits, *@out_len is set
+ * to the compressed size either way. With @verify, a copied result is
+ * decompressed again and compared with @slice.
+ */
+static blk_status_t lzom_compress_slice(struct lzom_dev *ldev, u64 lba,
+					struct lzom_sg_buf *slice,
+					struct lzom_sg_buf *out,
+					size_t *out_len, bool verify,
+					bool *mismatch)
+{
+	unsigned int len = slice->iter.bi_size;
+	struct lzom_sg_buf src = *slice, dst, copy = *out;
+	struct lzom_ws tmp_ws = {};
+	struct lzom_ws *ws;
+	unsigned int nr_segs;
+	size_t decomp_len;
+	u64 start, ns;
+	int lzo_ret;
+
+	nr_segs = lzom_sg_index_count(&src);
+
+	start = lzom_lat_start(ldev);
+	ws = lzom_ws_get(ldev, &tmp_ws, len, nr_segs);
+	lzom_lat_end(ldev, LZOM_LAT_WRITE_ALLOC, start);
+	if (!ws) {
+		LZOM_ERRLOG("failed to alloc workspace");
+		lzom_stat_inc(ldev, LZOM_STAT_ALLOC_FAILS);
+		return BLK_STS_RESOURCE;
+	}
+
+	lzom_sg_index_build(&src, ws->src_segs, nr_segs);
+
+	dst = lzom_sg_buf_create(
+		(struct bvec_iter){ .bi_size = lzo_worst_compress(len) },
+		ws->out_bvec);
+	lzom_sg_index_build(&dst, ws->out_segs, ws->out_vecs);
+
+	start = local_clock();
+	if (READ_ONCE(ldev->bitstream_version))
+		lzo_ret = lzom_rle_compress(&src, &dst, ws->wrkmem);
+	else
+		lzo_ret = lzom_compress(&src, &dst, ws->wrkmem);
+	ns = local_clock() - start;
+	lzom_stat_add(ldev, LZOM_STAT_COMPRESS_NS, ns);
+	lzom_lat_add(ldev, LZOM_LAT_WRITE_COMPRESS, ns);
+	trace_lzom_compress(lba, len, dst.iter.bi_size, ns);
+
+	if (lzo_ret != LZOM_E_OK) {
+		lzom_ws_put(ldev, ws, &tmp_ws);
+		LZOM_ERRLOG("lzom compress failed: %d", lzo_ret);
+		return BLK_STS_IOERR;
+	}
+
+	*out_len = dst.iter.bi_size;
+	if (sg_write_bytes(&copy, ws->out, *out_len)) {
+		lzom_ws_put(ldev, ws, &tmp_ws);
+		return BLK_STS_OK;
+	}
+
+	if (verify) {
+		decomp_len = len;
+		start = local_clock();
+		lzo_ret = lzom_decompress_safe(ws->out, *out_len, ws->verify,
+					       &decomp_len);
+		ns = local_clock() - start;
+		lzom_stat_add(ldev, LZOM_STAT_DECOMPRESS_NS, ns);
+		lzom_lat_add(ldev, LZOM_LAT_WRITE_VERIFY, ns);
+		if (lzo_ret != LZOM_E_OK || decomp_len != len ||
+		    !lzom_payload_equal(slice, ws->verify))
+			*mismatch = true;
+	}
+
+	lzom_ws_put(ldev, ws, &tmp_ws);
+	return BLK_STS_OK;
+}
+
+/*
+ * Decompresses the block or unit at @entry, read into the pool pages of
+ * @bio, into @slice. The sector padding behind the lzo stream is not
+ * part of it.
+ */
+static int lzom_decompress_slice(struct lzom_dev *ldev, struct bio *bio,
+				 u64 entry, struct lzom_sg_buf *slice)
+{
+	unsigned int len = lzom_map_len(entry) << SECTOR_SHIFT;
+	struct lzom_sg_buf src, dst = *slice;
+	struct lzom_ws tmp_ws = {};
+	struct lzom_ws *ws;
+	unsigned int nr_segs;
+	size_t out_len;
+	u64 start, ns;
+	int lzo_ret;
+
+	src = lzom_sg_buf_create((struct bvec_iter){ .bi_size = len },
+				 bio->bi_io_vec);
+	nr_segs = lzom_sg_index_count(&dst);
+
+	ws = lzom_ws_get(ldev, &tmp_ws, dst.iter.bi_size, nr_segs);
+	if (!ws) {
+		lzom_stat_inc(ldev, LZOM_STAT_ALLOC_FAILS);
+		return -ENOMEM;
+	}
+
+	lzom_sg_index_build(&src, ws->out_segs, ws->out_vecs);
+	lzom_sg_index_build(&dst, ws->src_segs, nr_segs);
+
+	start = local_clock();
+	lzo_ret = lzom_decompress_sg(&src, &dst, &out_len);
+	ns = local_clock() - start;
+	lzom_stat_add(ldev, LZOM_STAT_DECOMPRESS_NS, ns);
+	lzom_lat_add(ldev, LZOM_LAT_READ_DECOMPRESS, ns);
+	trace_lzom_decompress(lzom_map_sector(entry), len, out_len, ns,
+			      lzo_ret);
+	lzom_ws_put(ldev, ws, &tmp_ws);
+
+	if ((lzo_ret != LZOM_E_OK && lzo_ret != LZO_E_INPUT_NOT_CONSUMED) ||
+	    out_len != slice->iter.bi_size) {
+		LZOM_ERRLOG("lzom decompress failed: %d", lzo_ret);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/* ----------------- cache -----------------*/
+static void lzom_cache_ent_free(struct rcu_head *rcu)
+{
+	struct lzom_cache_ent *ent =
+		container_of(rcu, struct lzom_cache_ent, rcu);
+
+	__free_page(ent->page);
+	kfree(ent);
+}
+
+/* unlinks @ent, which is no longer in the xarray, under the xarray lock */
+static void lzom_cache_unlink(struct lzom_cache *cache,
+			      struct lzom_cache_ent *ent)
+{
+	list_del(&ent->lru);
+	cache->nr--;
+	call_rcu(&ent->rcu, lzom_cache_ent_free);
+}
+
+/*
+ * Frees up to @nr blocks from the cold end of the lru. Blocks read since
+ * they were last looked at get a second chance.
+ */
+static unsigned long lzom_cache_evict(struct lzom_cache *cache,
+				      unsigned long nr)
+{
+	/* two rounds free everything nobody reads meanwhile */
+	unsigned long budget = 2 * cache->nr;
+	unsigned long freed = 0;
+
+	while (freed < nr && budget-- && !list_empty(&cache->lru)) {
+		struct lzom_cache_ent *ent =
+			list_last_entry(&cache->lru, struct lzom_cache_ent, lru);
+
+		if (READ_ONCE(ent->referenced)) {
+			WRITE_ONCE(ent->referenced, false);
+			list_move(&ent->lru, &cache->lru);
+			continue;
+		}
+
+		__xa_erase(&cache->blocks, ent->lba);
+		lzom_cache_unlink(cache, ent);
+		freed++;
+	}
+
+	return freed;
+}
+
+static void lzom_cache_trim(struct lzom_cache *cache)
+{
+	unsigned long max = READ_ONCE(cache->max);
+
+	xa_lock(&cache->blocks);
+	if (cache->nr > max)
+		lzom_cache_evict(cache, cache->nr - max);
+	xa_unlock(&cache->blocks);
+}
+
+/* takes over @page, which holds block @lba as stored at @entry */
+static void lzom_cache_add(struct lzom_dev *ldev, u64 lba, u64 entry,
+			   u32 gen, struct page *page)
+{
+	struct lzom_cache *cache = &ldev->cache;
+	struct lzom_cache_ent *ent, *old;
+
+	ent = kmalloc(sizeof(*ent), GFP_NOIO | __GFP_NOWARN);
+	if (!ent) {
+		__free_page(page);
+		return;
+	}
+
+	ent->page = page;
+	ent->lba = lba;
+	ent->entry = entry;
+	ent->gen = gen;
+	ent->referenced = false;
+
+	xa_lock(&cache->blocks);
+	old = __xa_store(&cache->blocks, lba, ent, GFP_NOIO | __GFP_NOWARN);
+	if (xa_is_err(old)) {
+		xa_unlock(&cache->blocks);
+		__free_page(ent->page);
+		kfree(ent);
+		return;
+	}
+
+	if (old)
+		lzom_cache_unlink(cache, old);
+	list_add(&ent->lru, &cache->lru);
+	cache->nr++;
+	xa_unlock(&cache->blocks);
+
+	lzom_cache_trim(cache);
+}
+
+/*
+ * Keeps a copy of @slice as block @lba stored at @entry. Called where
+ * sleeping is fine, reads of raw blocks that complete in irq context are
+ * not cached.
+ */
+static void lzom_cache_insert(struct lzom_dev *ldev, u64 lba, u64 entry,
+			      u32 gen, struct lzom_sg_buf *slice)
+{
+	struct lzom_sg_buf src = *slice;
+	struct page *page;
+
+	if (!READ_ONCE(ldev->cache.max))
+		return;
+
+	page = alloc_page(GFP_NOIO | __GFP_NOWARN | __GFP_NORETRY);
+	if (!page)
+		return;
+
+	sg_read_bytes(&src, page_address(page), LZOM_BLOCK_SIZE);
+	lzom_cache_add(ldev, lba, entry, gen, page);
+}
+
+/* the copy of block @lba as stored at @entry, under rcu_read_lock() */
+static struct lzom_cache_ent *lzom_cache_lookup(struct lzom_dev *ldev, u64 lba,
+						u64 entry)
+{
+	struct lzom_cache_ent *ent = xa_load(&ldev->cache.blocks, lba);
+
+	/* the generation is read after the entry it belongs to */
+	smp_rmb();
+	if (ent && ent->entry == entry &&
+	    ent->gen == lzom_store_gen(&ldev->store, entry))
+		return ent;
+
+	return NULL;
+}
+
+/* fills @slice from the cache if it has block @lba as stored at @entry */
+static bool lzom_cache_read(struct lzom_dev *ldev, u64 lba, u64 entry,
+			    struct lzom_sg_buf *slice)
+{
+	struct lzom_cache *cache = &ldev->cache;
+	struct lzom_sg_buf dst = *slice;
+	struct lzom_cache_ent *ent;
+	bool hit = false;
+
+	rcu_read_lock();
+	ent = lzom_cache_lookup(ldev, lba, entry);
+	if (ent) {
+		sg_write_bytes(&dst, page_address(ent->page), LZOM_BLOCK_SIZE);
+		WRITE_ONCE(ent->referenced, true);
+		hit = true;
+	}
+	rcu_read_unlock();
+
+	if (hit)
+		lzom_stat_inc(ldev, LZOM_STAT_CACHE_HITS);
+	else if (READ_ONCE(cache->max))
+		lzom_stat_inc(ldev, LZOM_STAT_CACHE_MISSES);
+
+	return hit;
+}
+
+static unsigned long lzom_cache_count(struct shrinker *shrinker,
+				      struct shrink_control *sc)
+{
+	struct lzom_cache *cache = shrinker->private_data;
+
+	return READ_ONCE(cache->nr) ?: SHRINK_EMPTY;
+}
+
+static unsigned long lzom_cache_scan(struct shrinker *shrinker,
+				     struct shrink_control *sc)
+{
+	struct lzom_cache *cache = shrinker->private_data;
+	unsigned long freed;
+
+	xa_lock(&cache->blocks);
+	freed = lzom_cache_evict(cache, sc->nr_to_scan);
+	xa_unlock(&cache->blocks);
+
+	return freed;
+}
+
+static void lzom_dev_cache_free(struct lzom_dev *ldev)
+{
+	struct lzom_cache *cache = &ldev->cache;
+
+	if (!cache->shrinker)
+		return;
+
+	shrinker_free(cache->shrinker);
+	cache->shrinker = NULL;
+
+	xa_lock(&cache->blocks);
+	lzom_cache_evict(cache, ULONG_MAX);
+	xa_unlock(&cache->blocks);
+
+	/* the copies are freed by rcu callbacks */
+	rcu_barrier();
+	xa_destroy(&cache->blocks);
+}
+
+static int lzom_dev_cache_alloc(struct lzom_dev *ldev)
+{
+	struct lzom_cache *cache = &ldev->cache;
+
+	xa_init(&cache->blocks);
+	INIT_LIST_HEAD(&cache->lru);
+	cache->max = LZOM_CACHE_SIZE_DEFAULT >> LZOM_BLOCK_SHIFT;
+
+	cache->shrinker = shrinker_alloc(0, "lzom-cache");
+	if (!cache->shrinker)
+		return -ENOMEM;
+
+	cache->shrinker->count_objects = lzom_cache_count;
+	cache->shrinker->scan_objects = lzom_cache_scan;
+	cache->shrinker->private_data = cache;
+	shrinker_register(cache->shrinker);
+
+	return 0;
+}
+
+/* ----------------- dedup -----------------*/
+/* xxh64 of @slice, never 0 so that 0 can stand for no hash */
+static u64 lzom_payload_hash(struct lzom_sg_buf *slice)
+{
+	struct xxh64_state state;
+	struct bvec_iter iter;
+	struct bio_vec bv;
+
+	xxh64_reset(&state, 0);
+
+	for_each_bvec (bv, slice->bvec, iter, slice->iter) {
+		const char *ptr = bvec_kmap_local(&bv);
+
+		xxh64_update(&state, ptr, bv.bv_len);
+		kunmap_local(ptr);
+	}
+
+	return xxh64_digest(&state) ?: 1;
+}
+
+static struct lzom_dedup_bucket *lzom_dedup_bucket(struct lzom_dev *ldev,
+						   u64 hash)
+{
+	return &ldev->dedup_index[hash & (ldev->dedup_buckets - 1)];
+}
+
+/* moves slot @i of @bucket to the front, as the most recently used */
+static void lzom_dedup_touch(struct lzom_dedup_bucket *bucket, unsigned int i)
+{
+	struct lzom_dedup_slot slot = bucket->slots[i];
+
+	memmove(&bucket->slots[1], &bucket->slots[0], i * sizeof(slot));
+	bucket->slots[0] = slot;
+}
+
+static bool lzom_dedup_lookup(struct lzom_dev *ldev, u64 hash,
+			      struct lzom_dedup_slot *found)
+{
+	struct lzom_dedup_bucket *bucket = lzom_dedup_bucket(ldev, hash);
+	unsigned long flags;
+	bool ret = false;
+	unsigned int i;
+
+	spin_lock_irqsave(&bucket->lock, flags);
+	for (i = 0; i < LZOM_DEDUP_WAYS; i++) {
+		if (bucket->slots[i].hash == hash) {
+			*found = bucket->slots[i];
+			lzom_dedup_touch(bucket, i);
+			ret = true;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&bucket->lock, flags);
+
+	return ret;
+}
+
+/* remembers @lba as a stored copy of @hash, evicting the oldest slot */
+static void lzom_dedup_insert(struct lzom_dev *ldev, u64 hash, u64 lba,
+			      u64 entry)
+{
+	struct lzom_dedup_bucket *bucket = lzom_dedup_bucket(ldev, hash);
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&bucket->lock, flags);
+	for (i = 0; i < LZOM_DEDUP_WAYS - 1; i++)
+		if (bucket->slots[i].hash == hash)
+			break;
+
+	bucket->slots[i].hash = hash;
+	bucket->slots[i].lba = lba;
+	bucket->slots[i].entry = entry;
+	lzom_dedup_touch(bucket, i);
+	spin_unlock_irqrestore(&bucket->lock, flags);
+}
+
+/*
+ * Compares @slice with the cached copy of block @lba as stored at @entry:
+ * 1 if they match, 0 if not and -ENOENT if it is not cached.
+ */
+static int lzom_dedup_cached_same(struct lzom_dev *ldev, u64 lba, u64 entry,
+				  struct lzom_sg_buf *slice)
+{
+	struct lzom_cache_ent *ent;
+	int ret = -ENOENT;
+
+	rcu_read_lock();
+	ent = lzom_cache_lookup(ldev, lba, entry);
+	if (ent) {
+		ret = lzom_payload_equal(slice, page_address(ent->page));
+		WRITE_ONCE(ent->referenced, true);
+	}
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/* reads block @lba as stored at @entry into @buf, from the cache if it can */
+static bool lzom_dedup_load(struct lzom_dev *ldev, u64 lba, u64 entry,
+			    void *buf)
+{
+	unsigned int len = lzom_map_len(entry) << SECTOR_SHIFT;
+	struct lzom_cache_ent *ent;
+	size_t out_len = LZOM_BLOCK_SIZE;
+	const unsigned char *data;
+	struct bio *bio;
+	bool ok = false;
+	int lzo_ret;
+
+	rcu_read_lock();
+	ent = lzom_cache_lookup(ldev, lba, entry);
+	if (ent)
+		memcpy(buf, page_address(ent->page), LZOM_BLOCK_SIZE);
+	rcu_read_unlock();
+	if (ent)
+		return true;
+
+	bio = bio_alloc_bioset(ldev->under_dev.bdev, 1, REQ_OP_READ, GFP_NOIO,
+			       ldev->under_dev.bset);
+	if (!bio)
+		return false;
+
+	lzom_bio_alloc_pages(ldev, bio, len);
+	bio->bi_iter.bi_sector = lzom_map_sector(entry);
+
+	if (submit_bio_wait(bio))
+		goto out;
+
+	data = page_address(bio_first_page_all(bio));
+
+	if (entry & LZOM_MAP_RAW) {
+		memcpy(buf, data, LZOM_BLOCK_SIZE);
+		ok = true;
+		goto out;
+	}
+
+	lzo_ret = lzom_decompress_safe(data, len, buf, &out_len);
+	ok = (lzo_ret == LZO_E_OK || lzo_ret == LZO_E_INPUT_NOT_CONSUMED) &&
+	     out_len == LZOM_BLOCK_SIZE;
+
+out:
+	lzom_bio_free_pages(ldev, bio);
+	bio_put(bio);
+	return ok;
+}
+
+/*
+ * Maps block @lba, stored at @entry after the index found a copy that was
+ * not cached, at that copy if both match and @lba was not rewritten
+ * meanwhile. The sectors it was written to are left to the cleaner.
+ */
+static void lzom_dedup_work_fn(struct work_struct *work)
+{
+	struct lzom_dedup_job *job =
+		container_of(work, struct lzom_dedup_job, work);
+	struct lzom_dev *ldev = job->ldev;
+	struct lzom_store *store = &ldev->store;
+	void *buf;
+	bool same;
+
+	buf = kmalloc(2 * LZOM_BLOCK_SIZE, GFP_NOIO | __GFP_NOWARN);
+	if (!buf) {
+		lzom_stat_inc(ldev, LZOM_STAT_ALLOC_FAILS);
+		goto out;
+	}
+
+	/* the copy is referenced before it is read back, as in the write */
+	if (!lzom_store_ref(store, job->found.lba, job->found.entry)) {
+		lzom_stat_inc(ldev, LZOM_STAT_DEDUP_MISSES);
+		goto out;
+	}
+
+	if (!lzom_dedup_load(ldev, job->lba, job->entry, buf) ||
+	    !lzom_dedup_load(ldev, job->found.lba, job->found.entry,
+			     buf + LZOM_BLOCK_SIZE)) {
+		lzom_store_unref(store, job->found.entry);
+		goto out;
+	}
+
+	same = !memcmp(buf, buf + LZOM_BLOCK_SIZE, LZOM_BLOCK_SIZE);
+	if (same && lzom_store_relink(store, job->lba, job->entry,
+				      job->found.entry)) {
+		lzom_stat_inc(ldev, LZOM_STAT_DEDUP_HITS);
+		goto out;
+	}
+
+	lzom_store_unref(store, job->found.entry);
+	if (!same) {
+		lzom_stat_inc(ldev, LZOM_STAT_DEDUP_COLLISIONS);
+		lzom_dedup_insert(ldev, job->found.hash, job->lba, job->entry);
+	}
+
+out:
+	kfree(buf);
+	kfree(job);
+}
+
+/* the check of block @lba at @entry against @found, NULL without memory */
+static struct lzom_dedup_job *lzom_dedup_defer(struct lzom_dev *ldev, u64 lba,
+					       u64 entry,
+					       struct lzom_dedup_slot *found)
+{
+	struct lzom_dedup_job *job;
+
+	job = kmalloc(sizeof(*job), GFP_NOIO | __GFP_NOWARN);
+	if (!job)
+		return NULL;
+
+	INIT_WORK(&job->work, lzom_dedup_work_fn);
+	job->ldev = ldev;
+	job->lba = lba;
+	job->entry = entry;
+	job->found = *found;
+	return job;
+}
+
+/*
+ * Maps @lba at a stored copy of @slice if the index knows one and the
+ * cache confirms it, so that a hash collision can never map a block at
+ * foreign data. The copy is referenced before the comparison, so it cannot
+ * be reclaimed under it. A copy that is not cached is left in @found for
+ * lzom_dedup_work_fn(), the write then goes ahead.
+ */
+static bool lzom_dedup_write(struct lzom_dev *ldev, struct lzom_sg_buf *slice,
+			     u64 lba, u64 hash, struct lzom_dedup_slot *found)
+{
+	int same;
+
+	if (!lzom_dedup_lookup(ldev, hash, found) ||
+	    !lzom_store_ref(&ldev->store, found->lba, found->entry)) {
+		lzom_stat_inc(ldev, LZOM_STAT_DEDUP_MISSES);
+		found->hash = 0;
+		return false;
+	}
+
+	same = lzom_dedup_cached_same(ldev, found->lba, found->entry, slice);
+	if (same <= 0) {
+		lzom_store_unref(&ldev->store, found->entry);
+		if (!same) {
+			lzom_stat_inc(ldev, LZOM_STAT_DEDUP_COLLISIONS);
+			found->hash = 0;
+		}
+		return false;
+	}
+
+	lzom_store_link(&ldev->store, lba, found->entry);
+	lzom_stat_inc(ldev, LZOM_STAT_DEDUP_HITS);
+	return true;
+}
+
+static void lzom_dev_dedup_free(struct lzom_dev *ldev)
+{
+	kvfree(ldev->dedup_index);
+	ldev->dedup_index = NULL;
+}
+
+static int lzom_dev_dedup_alloc(struct lzom_dev *ldev, unsigned int entries)
+{
+	unsigned int i;
+
+	if (!entries)
+		return 0;
+
+	ldev->dedup_buckets = rounddown_pow_of_two(
+		max_t(unsigned int, entries / LZOM_DEDUP_WAYS, 1));
+	ldev->dedup_index = kvcalloc(ldev->dedup_buckets,
+				     sizeof(*ldev->dedup_index), GFP_KERNEL);
+	if (!ldev->dedup_index)
+		return -ENOMEM;
+
+	for (i = 0; i < ldev->dedup_buckets; i++)
+		spin_lock_init(&ldev->dedup_index[i].lock);
+
+	return 0;
+}
+
+/* ----------------- write -----------------*/
+static void lzom_write_block_endio(struct bio *bio)
+{
+	struct lzom_req *lreq = container_of(bio, struct lzom_req, bio);
+	struct lzom_dev *ldev = lreq->ldev;
+
+	trace_lzom_bio_endio(bio, lreq->lba);
+	lzom_lat_end(ldev, LZOM_LAT_WRITE_LOWER, lreq->start);
+
+	if (!bio->bi_status) {
+		lzom_store_install(&ldev->store, lreq->lba, lreq->entry);
+		if (lreq->hash)
+			lzom_dedup_insert(ldev, lreq->hash, lreq->lba,
+					  lreq->entry);
+		if (lreq->dedup)
+			queue_work(ldev->chunk_wq, &lreq->dedup->work);
+	} else {
+		lzom_store_release(&ldev->store, lreq->entry);
+		kfree(lreq->dedup);
+	}
+
+	if (!(lreq->entry & LZOM_MAP_RAW))
+		lzom_bio_free_pages(ldev, bio);
+
+	lzom_cmd_put(lreq->rq, bio->bi_status);
+	bio_put(bio);
+}
+
+/*
+ * Compresses block @idx of @rq and appends it to the log. Blocks that do
+ * not save a sector are written raw from the request's own pages, all-zero
+ * blocks are unmapped without any I/O and, with dedup on, blocks stored
+ * before are mapped at the existing copy, right away if it is cached and
+ * by lzom_dedup_work_fn() after the write otherwise.
+ */
+static blk_status_t lzom_write_block(struct lzom_dev *ldev, struct request *rq,
+				     unsigned int idx, bool verify)
+{
+	struct lzom_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	u64 lba = (blk_rq_pos(rq) >> (LZOM_BLOCK_SHIFT - SECTOR_SHIFT)) + idx;
+	sector_t sector;
+	size_t out_len = LZOM_BLOCK_SIZE - SECTOR_SIZE;
+	struct lzom_sg_buf slice, out;
+	struct lzom_req *lreq;
+	struct bio *bio;
+	unsigned int nr_sectors;
+	bool mismatch = false;
+	blk_status_t ret;
+	struct lzom_dedup_slot found = {};
+	u64 entry, hash = 0;
+	u64 start;
+
+	slice = lzom_payload_slice(&cmd->payload, idx << LZOM_BLOCK_SHIFT,
+				   LZOM_BLOCK_SIZE);
+	lzom_stat_add(ldev, LZOM_STAT_BYTES_IN, LZOM_BLOCK_SIZE);
+
+	if (lzom_payload_is_zero(&slice)) {
+		lzom_store_install(&ldev->store, lba, 0);
+		return BLK_STS_OK;
+	}
+
+	if (ldev->dedup_index && READ_ONCE(ldev->dedup)) {
+		hash = lzom_payload_hash(&slice);
+		if (lzom_dedup_write(ldev, &slice, lba, hash, &found))
+			return BLK_STS_OK;
+	}
+
+	start = lzom_lat_start(ldev);
+	bio = bio_alloc_bioset(ldev->under_dev.bdev, 1, lzom_rq_opf(rq),
+			       GFP_NOIO, ldev->under_dev.bset);
+	if (!bio) {
+		lzom_stat_inc(ldev, LZOM_STAT_ALLOC_FAILS);
+		return BLK_STS_RESOURCE;
+	}
+
+	lzom_bio_alloc_pages(ldev, bio, out_len);
+	lzom_lat_end(ldev, LZOM_LAT_WRITE_ALLOC, start);
+	out = lzom_sg_buf_create((struct bvec_iter){ .bi_size = out_len },
+				 bio->bi_io_vec);
+
+	ret = lzom_compress_slice(ldev, lba, &slice, &out, &out_len, verify,
+				  &mismatch);
+	if (ret)
+		goto err_out;
+
+	start = lzom_lat_start(ldev);
+
+	if (out_len > LZOM_BLOCK_SIZE - SECTOR_SIZE) {
+		lzom_bio_free_pages(ldev, bio);
+		bio_put(bio);
+
+		bio = lzom_bio_map(ldev, &slice, lzom_rq_opf(rq));
+		if (!bio) {
+			lzom_stat_inc(ldev, LZOM_STAT_ALLOC_FAILS);
+			return BLK_STS_RESOURCE;
+		}
+
+		if (lzom_store_alloc(&ldev->store, LZOM_BLOCK_SECTORS, lba, 1,
+				     &sector)) {
+			bio_put(bio);
+			return BLK_STS_NOSPC;
+		}
+
+		entry = lzom_map_entry(sector, LZOM_BLOCK_SECTORS,
+				       LZOM_MAP_RAW);
+		lzom_stat_inc(ldev, LZOM_STAT_RAW);
+		lzom_stat_add(ldev, LZOM_STAT_BYTES_OUT, LZOM_BLOCK_SIZE);
+		goto submit;
+	}
+
+	if (verify) {
+		lzom_stat_inc(ldev, LZOM_STAT_VERIFY_CHECKED);
+
+		if (mismatch) {
+			lzom_stat_inc(ldev, LZOM_STAT_VERIFY_MISMATCHED);
+			ret = BLK_STS_IOERR;
+			goto err_out;
+		}
+	}
+
+	/* only the sectors the compressed block occupies go down */
+	nr_sectors = DIV_ROUND_UP(out_len, SECTOR_SIZE);
+	memset(page_address(bio_first_page_all(bio)) + out_len, 0,
+	       (nr_sectors << SECTOR_SHIFT) - out_len);
+	bio->bi_io_vec[0].bv_len = nr_sectors << SECTOR_SHIFT;
+	bio->bi_iter.bi_size = nr_sectors << SECTOR_SHIFT;
+
+	if (lzom_store_alloc(&ldev->store, nr_sectors, lba, 1, &sector)) {
+		ret = BLK_STS_NOSPC;
+		goto err_out;
+	}
+
+	entry = lzom_map_entry(sector, nr_sectors, 0);
+	lzom_stat_inc(ldev, LZOM_STAT_COMPRESSED);
+	lzom_stat_add(ldev, LZOM_STAT_BYTES_OUT, nr_sectors << SECTOR_SHIFT);
+
+submit:
+	lzom_cache_insert(ldev, lba, entry, lzom_store_gen(&ldev->store, entry),
+			  &slice);
+
+	lreq = container_of(bio, struct lzom_req, bio);
+	lreq->rq = rq;
+	lreq->ldev = ldev;
+	lreq->lba = lba;
+	lreq->entry = entry;
+	lreq->hash = hash;
+	lreq->dedup = NULL;
+	if (found.hash) {
+		lreq->dedup = lzom_dedup_defer(ldev, lba, entry, &found);
+		/* the index keeps the copy, the job adds this one if they differ */
+		if (lreq->dedup)
+			lreq->hash = 0;
+	}
+
+	bio->bi_end_io = lzom_write_block_endio;
+	bio->bi_iter.bi_sector = sector;
+
+	atomic_inc(&cmd->remaining);
+	lreq->start = lzom_lat_start(ldev);
+	trace_lzom_bio_submit(bio, lba);
+	submit_bio_noacct(bio);
+	lzom_lat_end(ldev, LZOM_LAT_WRITE_SUBMIT, start);
+	return BLK_STS_OK;
+
+err_out:
+	lzom_bio_free_pages(ldev, bio);
+	bio_put(bio);
+	return ret;
+}
+
+static blk_status_t lzom_write_blocks(struct lzom_dev *ldev,
+				      struct request *rq, unsigned int first,
+				      unsigned int nr_blocks, bool verify)
+{
+	blk_status_t ret = BLK_STS_OK;
+	unsigned int i;
+
+	for (i = first; i < first + nr_blocks && ret == BLK_STS_OK; i++)
+		ret = lzom_write_block(ldev, rq, i, verify);
+
+	return ret;
+}
+
+static void lzom_write_unit_endio(struct bio *bio)
+{
+	struct lzom_req *lreq = container_of(bio, struct lzom_req, bio);
+	struct lzom_dev *ldev = lreq->ldev;
+
+	trace_lzom_bio_endio(bio, lreq->lba);
+	lzom_lat_end(ldev, LZOM_LAT_WRITE_LOWER, lreq->start);
+
+	if (!bio->bi_status)
+		lzom_store_install_unit(&ldev->store, lreq->lba, lreq->nr,
+					lreq->entry);
+	else
+		lzom_store_release(&ldev->store, lreq->entry);
+
+	if (!(lreq->entry & LZOM_MAP_RAW))
+		lzom_bio_free_pages(ldev, bio);
+
+	lzom_cmd_put(lreq->rq, bio->bi_status);
+	bio_put(bio);
+}
+
+/* cuts @bio down to the @nr_sectors its @len bytes take, zero padded */
+static void lzom_bio_trim_pages(struct lzom_dev *ldev, struct bio *bio,
+				size_t len, unsigned int nr_sectors)
+{
+	unsigned int size = nr_sectors << SECTOR_SHIFT;
+	unsigned int nr_pages = DIV_ROUND_UP(size, PAGE_SIZE);
+
+	/* sectors never straddle a page */
+	if (len & (SECTOR_SIZE - 1))
+		memzero_page(bio->bi_io_vec[len >> PAGE_SHIFT].bv_page,
+			     offset_in_page(len), size - len);
+
+	while (bio->bi_vcnt > nr_pages)
+		mempool_free(bio->bi_io_vec[--bio->bi_vcnt].bv_page,
+			     &ldev->page_pool);
+
+	bio->bi_io_vec[nr_pages - 1].bv_len = size - (nr_pages - 1) * PAGE_SIZE;
+	bio->bi_iter.bi_size = size;
+}
+
+/*
+ * Compresses the @nr_blocks blocks of @rq from @first together as one unit
+ * and appends it to the log, the map points at it on completion. A unit
+ * that does not save a sector is written raw from the request's own pages,
+ * a unit of zeros is unmapped. Dedup works on single blocks, with it on
+ * the blocks are stored one by one.
+ */
+static blk_status_t lzom_write_unit(struct lzom_dev *ldev, struct request *rq,
+				    unsigned int first, unsigned int nr_blocks,
+				    bool verify)
+{
+	struct lzom_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	u64 lba = (blk_rq_pos(rq) >> (LZOM_BLOCK_SHIFT - SECTOR_SHIFT)) + first;
+	unsigned int size = nr_blocks << LZOM_BLOCK_SHIFT;
+	size_t out_len = size - SECTOR_SIZE;
+	u64 flags = lzom_map_unit_flags(nr_blocks);
+	struct lzom_sg_buf slice, out;
+	unsigned int nr_sectors, i;
+	struct lzom_req *lreq;
+	bool mismatch = false;
+	sector_t sector;
+	struct bio *bio;
+	blk_status_t ret;
+	u64 entry, start;
+
+	if (nr_blocks == 1 || (ldev->dedup_index && READ_ONCE(ldev->dedup)))
+		return lzom_write_blocks(ldev, rq, first, nr_blocks, verify);
+
+	slice = lzom_payload_slice(&cmd->payload, first << LZOM_BLOCK_SHIFT,
+				   size);
+	lzom_stat_add(ldev, LZOM_STAT_BYTES_IN, size);
+
+	if (lzom_payload_is_zero(&slice)) {
+		for (i = 0; i < nr_blocks; i++)
+			lzom_store_install(&ldev->store, lba + i, 0);
+		return BLK_STS_OK;
+	}
+
+	start = lzom_lat_start(ldev);
+	bio = bio_alloc_bioset(ldev->under_dev.bdev,
+			       DIV_ROUND_UP(out_len, PAGE_SIZE), lzom_rq_opf(rq),
+			       GFP_NOIO, ldev->under_dev.bset);
+	if (!bio) {
+		lzom_stat_inc(ldev, LZOM_STAT_ALLOC_FAILS);
+		return BLK_STS_RESOURCE;
+	}
+
+	lzom_bio_alloc_pages(ldev, bio, out_len);
+	lzom_lat_end(ldev, LZOM_LAT_WRITE_ALLOC, start);
+	out = lzom_sg_buf_create((struct bvec_iter){ .bi_size = out_len },
+				 bio->bi_io_vec);
+
+	ret = lzom_compress_slice(ldev, lba, &slice, &out, &out_len, verify,
+				  &mismatch);
+	if (ret)
+		goto err_out;
+
+	start = lzom_lat_start(ldev);
+
+	if (out_len > size - SECTOR_SIZE) {
+		lzom_bio_free_pages(ldev, bio);
+		bio_put(bio);
+
+		bio = lzom_bio_map(ldev, &slice, lzom_rq_opf(rq));
+		if (!bio) {
+			lzom_stat_inc(ldev, LZOM_STAT_ALLOC_FAILS);
+			return BLK_STS_RESOURCE;
+		}
+
+		nr_sectors = nr_blocks * LZOM_BLOCK_SECTORS;
+		if (lzom_store_alloc(&ldev->store, nr_sectors, lba, nr_blocks,
+				     &sector)) {
+			bio_put(bio);
+			return BLK_STS_NOSPC;
+		}
+
+		flags |= LZOM_MAP_RAW;
+		lzom_stat_add(ldev, LZOM_STAT_RAW, nr_blocks);
+	} else {
+		if (verify) {
+			lzom_stat_inc(ldev, LZOM_STAT_VERIFY_CHECKED);
+
+			if (mismatch) {
+				lzom_stat_inc(ldev, LZOM_STAT_VERIFY_MISMATCHED);
+				ret = BLK_STS_IOERR;
+				goto err_out;
+			}
+		}
+
+		/* only the sectors the compressed unit occupies go down */
+		nr_sectors = DIV_ROUND_UP(out_len, SECTOR_SIZE);
+		lzom_bio_trim_pages(ldev, bio, out_len, nr_sectors);
+
+		if (lzom_store_alloc(&ldev->store, nr_sectors, lba, nr_blocks,
+				     &sector)) {
+			ret = BLK_STS_NOSPC;
+			goto err_out;
+		}
+
+		lzom_stat_add(ldev, LZOM_STAT_COMPRESSED, nr_blocks);
+	}
+
+	entry = lzom_map_entry(sector, nr_sectors, flags);
+	lzom_stat_add(ldev, LZOM_STAT_BYTES_OUT, nr_sectors << SECTOR_SHIFT);
+
+	for (i = 0; i < nr_blocks; i++) {
+		struct lzom_sg_buf block = lzom_payload_slice(&slice,
+			i << LZOM_BLOCK_SHIFT, LZOM_BLOCK_SIZE);
+		u64 member = lzom_map_member(entry, i);
+
+		lzom_cache_insert(ldev, lba + i, member,
+				  lzom_store_gen(&ldev->store, member), &block);
+	}
+
+	lreq = container_of(bio, struct lzom_req, bio);
+	lreq->rq = rq;
+	lreq->ldev = ldev;
+	lreq->lba = lba;
+	lreq->entry = entry;
+	lreq->nr = nr_blocks;
+
+	bio->bi_end_io = lzom_write_unit_endio;
+	bio->bi_iter.bi_sector = sector;
+
+	atomic_inc(&cmd->remaining);
+	lreq->start = lzom_lat_start(ldev);
+	trace_lzom_bio_submit(bio, lba);
+	submit_bio_noacct(bio);
+	lzom_lat_end(ldev, LZOM_LAT_WRITE_SUBMIT, start);
+	return BLK_STS_OK;
+
+err_out:
+	lzom_bio_free_pages(ldev, bio);
+	bio_put(bio);
+	return ret;
+}
+
+/* ----------------- chunked compression -----------------*/
+static void lzom_chunk_run(struct lzom_chunked *chunked, unsigned int idx)
+{
+	unsigned int nr_blocks = blk_rq_bytes(chunked->rq) >> LZOM_BLOCK_SHIFT;
+	unsigned int first = 0, end = chunked->head;
+	blk_status_t ret;
+
+	if (idx) {
+		first = chunked->head + (idx - 1) * chunked->chunk_blocks;
+		end = first + chunked->chunk_blocks;
+	}
+
+	ret = lzom_write_unit(chunked->ldev, chunked->rq, first,
+			      min(end, nr_blocks) - first, chunked->verify);
+	if (ret)
+		WRITE_ONCE(chunked->status, ret);
+
+	if (atomic_dec_and_test(&chunked->remaining))
+		complete(&chunked->done);
+}
+
+static void lzom_chunk_work_fn(struct work_struct *work)
+{
+	struct lzom_chunk_job *job =
+		container_of(work, struct lzom_chunk_job, work);
+
+	lzom_chunk_run(job->chunked, job - job->chunked->jobs);
+}
+
+/*
+ * Splits the blocks of @rq at multiples of chunk_size on the device into
+ * units that are compressed independently, each stored as an extent of
+ * its own. The units go to the chunk workqueue, the submitter takes the
+ * first one itself.
+ */
+static blk_status_t lzom_write_chunked(struct lzom_dev *ldev,
+				       struct request *rq,
+				       unsigned int chunk_size, bool verify)
+{
+	unsigned int chunk_blocks = chunk_size >> LZOM_BLOCK_SHIFT;
+	unsigned int nr_blocks = blk_rq_bytes(rq) >> LZOM_BLOCK_SHIFT;
+	u64 lba = blk_rq_pos(rq) >> (LZOM_BLOCK_SHIFT - SECTOR_SHIFT);
+	unsigned int head = chunk_blocks - (lba & (chunk_blocks - 1));
+	unsigned int nr_chunks;
+	struct lzom_chunked *chunked;
+	blk_status_t ret;
+	unsigned int i;
+
+	if (nr_blocks <= head)
+		return lzom_write_unit(ldev, rq, 0, nr_blocks, verify);
+
+	nr_chunks = 1 + DIV_ROUND_UP(nr_blocks - head, chunk_blocks);
+
+	chunked = kzalloc(struct_size(chunked, jobs, nr_chunks), GFP_NOIO);
+	if (!chunked) {
+		lzom_stat_inc(ldev, LZOM_STAT_ALLOC_FAILS);
+		return BLK_STS_RESOURCE;
+	}
+
+	chunked->ldev = ldev;
+	chunked->rq = rq;
+	chunked->verify = verify;
+	chunked->chunk_blocks = chunk_blocks;
+	chunked->head = head;
+	chunked->nr_chunks = nr_chunks;
+	atomic_set(&chunked->remaining, nr_chunks);
+	init_completion(&chunked->done);
+
+	for (i = 1; i < nr_chunks; i++) {
+		chunked->jobs[i].chunked = chunked;
+		INIT_WORK(&chunked->jobs[i].work, lzom_chunk_work_fn);
+		queue_work(ldev->chunk_wq, &chunked->jobs[i].work);
+	}
+	lzom_chunk_run(chunked, 0);
+
+	wait_for_completion(&chunked->done);
+
+	ret = chunked->status;
+	kfree(chunked);
+	return ret;
+}
+
+/* ----------------- coalescing -----------------*/
+static bool lzom_stage_overlaps(struct lzom_stage *stage,
+				struct lzom_stage_buf *buf, u64 lba,
+				unsigned int nr)
+{
+	return buf && !bitmap_empty(buf->present, LZOM_UNIT_MAX_BLOCKS) &&
+	       lba < buf->base + stage->nr_blocks && buf->base < lba + nr;
+}
+
+/*
+ * The staged copy of block @lba, from the open unit before the one being
+ * committed, or NULL. Called with stage->read_lock held.
+ */
+static struct page *lzom_stage_page(struct lzom_stage *stage, u64 lba)
+{
+	struct lzom_stage_buf *bufs[] = { stage->open, stage->busy };
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(bufs); i++)
+		if (lzom_stage_overlaps(stage, bufs[i], lba, 1) &&
+		    test_bit(lba - bufs[i]->base, bufs[i]->present))
+			return bufs[i]->pages[lba - bufs[i]->base];
+
+	return NULL;
+}
+
+/* whether block @lba is staged, the map does not have it yet */
+static bool lzom_stage_has(struct lzom_dev *ldev, u64 lba)
+{
+	struct lzom_stage *stage = &ldev->stage;
+	bool has;
+
+	if (!READ_ONCE(stage->nr_blocks))
+		return false;
+
+	spin_lock(&stage->read_lock);
+	has = lzom_stage_page(stage, lba);
+	spin_unlock(&stage->read_lock);
+
+	return has;
+}
+
+/* fills @slice with block @lba if it is staged */
+static bool lzom_stage_read(struct lzom_dev *ldev, u64 lba,
+			    struct lzom_sg_buf *slice)
+{
+	struct lzom_stage *stage = &ldev->stage;
+	struct lzom_sg_buf dst = *slice;
+	struct page *page;
+
+	if (!READ_ONCE(stage->nr_blocks))
+		return false;
+
+	spin_lock(&stage->read_lock);
+	page = lzom_stage_page(stage, lba);
+	if (page)
+		sg_write_bytes(&dst, page_address(page), LZOM_BLOCK_SIZE);
+	spin_unlock(&stage->read_lock);
+
+	return page;
+}
+
+/* waits until the commits up to @seq are in the map */
+static void lzom_stage_wait(struct lzom_stage *stage, u64 seq)
+{
+	wait_var_event(&stage->done, READ_ONCE(stage->done) >= seq);
+}
+
+static void lzom_stage_error(struct lzom_stage *stage, blk_status_t ret)
+{
+	spin_lock(&stage->read_lock);
+	if (!stage->busy_status)
+		stage->busy_status = ret;
+	spin_unlock(&stage->read_lock);
+}
+
+/*
+ * Drops a reference to the busy unit. The last one completes the writes
+ * waiting for it and frees its buffer for the next commit. A failure is
+ * kept for the next flush when those were acknowledged already.
+ */
+static void lzom_stage_put(struct lzom_dev *ldev, blk_status_t ret)
+{
+	struct lzom_stage *stage = &ldev->stage;
+	struct lzom_stage_buf *buf = stage->busy;
+	unsigned int i;
+
+	if (ret)
+		lzom_stage_error(stage, ret);
+	if (!atomic_dec_and_test(&stage->pending))
+		return;
+
+	ret = stage->busy_status;
+	if (ret) {
+		LZOM_ERRLOG("failed to commit staged blocks: %d", ret);
+		atomic64_inc(&stage->stat.errors);
+	}
+
+	for (i = 0; i < buf->nr_rqs; i++)
+		lzom_cmd_put(buf->rqs[i], ret);
+	buf->nr_rqs = 0;
+
+	spin_lock(&stage->read_lock);
+	bitmap_zero(buf->present, LZOM_UNIT_MAX_BLOCKS);
+	stage->busy = NULL;
+	/* acknowledged data is lost, a retried flush cannot bring it back */
+	if (ret && !stage->status)
+		stage->status = ret == BLK_STS_RESOURCE ? BLK_STS_IOERR : ret;
+	WRITE_ONCE(stage->done, stage->done + 1);
+	spin_unlock(&stage->read_lock);
+
+	wake_up_var(&stage->done);
+}
+
+/* points the map at a written unit, its staged copies go to the cache */
+static void lzom_stage_unit_work_fn(struct work_struct *work)
+{
+	struct lzom_req *lreq = container_of(work, struct lzom_req, work);
+	struct lzom_dev *ldev = lreq->ldev;
+	struct lzom_stage *stage = &ldev->stage;
+	unsigned int nr_blocks = lreq->nr, nr_sectors, i;
+	blk_status_t ret = lreq->bio.bi_status;
+	u64 entry = lreq->entry, lba = lreq->lba;
+	struct lzom_sg_buf src;
+
+	bio_put(&lreq->bio);
+
+	if (ret) {
+		lzom_store_release(&ldev->store, entry);
+		lzom_stage_put(ldev, ret);
+		return;
+	}
+
+	lzom_store_install_unit(&ldev->store, lba, nr_blocks, entry);
+
+	src = lzom_sg_buf_create(
+		(struct bvec_iter){ .bi_size = nr_blocks << LZOM_BLOCK_SHIFT },
+		stage->src_bvec + lreq->off);
+	for (i = 0; i < nr_blocks; i++) {
+		struct lzom_sg_buf slice = lzom_payload_slice(&src,
+			i << LZOM_BLOCK_SHIFT, LZOM_BLOCK_SIZE);
+		u64 member = lzom_map_member(entry, i);
+
+		lzom_cache_insert(ldev, lba + i, member,
+				  lzom_store_gen(&ldev->store, member), &slice);
+	}
+
+	nr_sectors = lzom_map_len(entry);
+	lzom_stat_add(ldev, LZOM_STAT_BYTES_IN, nr_blocks << LZOM_BLOCK_SHIFT);
+	lzom_stat_add(ldev, LZOM_STAT_BYTES_OUT, nr_sectors << SECTOR_SHIFT);
+	lzom_stat_add(ldev, entry & LZOM_MAP_RAW ? LZOM_STAT_RAW :
+			    LZOM_STAT_COMPRESSED, nr_blocks);
+	atomic64_inc(&stage->stat.units);
+	atomic64_add(nr_blocks, &stage->stat.blocks);
+	atomic64_add(nr_sectors, &stage->stat.sectors);
+
+	lzom_stage_put(ldev, BLK_STS_OK);
+}
+
+static void lzom_stage_endio(struct bio *bio)
+{
+	struct lzom_req *lreq = container_of(bio, struct lzom_req, bio);
+
+	trace_lzom_bio_endio(bio, lreq->lba);
+	lzom_lat_end(lreq->ldev, LZOM_LAT_WRITE_LOWER, lreq->start);
+
+	/* the map and the cache are not for irq context */
+	INIT_WORK(&lreq->work, lzom_stage_unit_work_fn);
+	queue_work(lreq->ldev->io_wq, &lreq->work);
+}
+
+/*
+ * Compresses the @nr_blocks blocks of the busy unit from @first into one
+ * extent and submits it, the map points at it on completion. A unit that
+ * does not save a sector is stored raw, its members one after another.
+ * Every run compresses into the vectors and pages at its own index, so
+ * the runs of one commit can be in flight together.
+ */
+static blk_status_t lzom_stage_write_unit(struct lzom_dev *ldev,
+					  struct lzom_stage_buf *buf,
+					  unsigned int first,
+					  unsigned int nr_blocks)
+{
+	struct lzom_stage *stage = &ldev->stage;
+	struct bio_vec *src_bvec = stage->src_bvec + first;
+	struct bio_vec *out_bvec = stage->out_bvec + first;
+	unsigned int size = nr_blocks << LZOM_BLOCK_SHIFT;
+	size_t out_len = size - SECTOR_SIZE;
+	u64 lba = buf->base + first;
+	u64 flags = lzom_map_unit_flags(nr_blocks);
+	bool verify = lzom_verify_wanted(ldev);
+	struct lzom_sg_buf src, out;
+	unsigned int nr_sectors, i;
+	struct lzom_req *lreq;
+	struct page **pages;
+	bool mismatch = false;
+	sector_t sector;
+	struct bio *bio;
+	blk_status_t ret;
+	u64 start;
+
+	for (i = 0; i < nr_blocks; i++) {
+		bvec_set_page(&src_bvec[i], buf->pages[first + i],
+			      LZOM_BLOCK_SIZE, 0);
+		bvec_set_page(&out_bvec[i], stage->out[first + i],
+			      LZOM_BLOCK_SIZE, 0);
+	}
+
+	src = lzom_sg_buf_create((struct bvec_iter){ .bi_size = size },
+				 src_bvec);
+	out = lzom_sg_buf_create((struct bvec_iter){ .bi_size = out_len },
+				 out_bvec);
+
+	ret = lzom_compress_slice(ldev, lba, &src, &out, &out_len, verify,
+				  &mismatch);
+	if (ret)
+		return ret;
+
+	if (out_len > size - SECTOR_SIZE) {
+		pages = buf->pages + first;
+		nr_sectors = nr_blocks * LZOM_BLOCK_SECTORS;
+		flags |= LZOM_MAP_RAW;
+	} else {
+		if (verify) {
+			lzom_stat_inc(ldev, LZOM_STAT_VERIFY_CHECKED);
+
+			if (mismatch) {
+				lzom_stat_inc(ldev, LZOM_STAT_VERIFY_MISMATCHED);
+				return BLK_STS_IOERR;
+			}
+		}
+
+		pages = stage->out + first;
+		nr_sectors = DIV_ROUND_UP(out_len, SECTOR_SIZE);
+		/* sectors never straddle a page */
+		if (out_len & (SECTOR_SIZE - 1))
+			memzero_page(pages[out_len >> PAGE_SHIFT],
+				     offset_in_page(out_len),
+				     (nr_sectors << SECTOR_SHIFT) - out_len);
+	}
+
+	size = nr_sectors << SECTOR_SHIFT;
+	start = lzom_lat_start(ldev);
+	bio = bio_alloc_bioset(ldev->under_dev.bdev,
+			       DIV_ROUND_UP(size, PAGE_SIZE), REQ_OP_WRITE,
+			       GFP_NOIO, ldev->under_dev.bset);
+	lzom_lat_end(ldev, LZOM_LAT_WRITE_ALLOC, start);
+	if (!bio) {
+		lzom_stat_inc(ldev, LZOM_STAT_ALLOC_FAILS);
+		return BLK_STS_RESOURCE;
+	}
+
+	for (i = 0; i < size; i += PAGE_SIZE)
+		__bio_add_page(bio, pages[i >> PAGE_SHIFT],
+			       min_t(unsigned int, size - i, PAGE_SIZE), 0);
+
+	if (lzom_store_alloc(&ldev->store, nr_sectors, lba, nr_blocks,
+			     &sector)) {
+		bio_put(bio);
+		return BLK_STS_NOSPC;
+	}
+
+	lreq = container_of(bio, struct lzom_req, bio);
+	lreq->rq = NULL;
+	lreq->ldev = ldev;
+	lreq->lba = lba;
+	lreq->entry = lzom_map_entry(sector, nr_sectors, flags);
+	lreq->off = first;
+	lreq->nr = nr_blocks;
+
+	bio->bi_iter.bi_sector = sector;
+	bio->bi_end_io = lzom_stage_endio;
+
+	atomic_inc(&stage->pending);
+	lreq->start = lzom_lat_start(ldev);
+	trace_lzom_bio_submit(bio, lba);
+	submit_bio_noacct(bio);
+	return BLK_STS_OK;
+}
+
+/* writes the busy unit out, each run of adjacent staged blocks as one extent */
+static void lzom_stage_commit_work_fn(struct work_struct *work)
+{
+	struct lzom_stage *stage =
+		container_of(work, struct lzom_stage, commit_work);
+	struct lzom_dev *ldev = container_of(stage, struct lzom_dev, stage);
+	struct lzom_stage_buf *buf = stage->busy;
+	unsigned int start, end;
+	blk_status_t ret;
+
+	for_each_set_bitrange (start, end, buf->present, LZOM_UNIT_MAX_BLOCKS) {
+		ret = lzom_stage_write_unit(ldev, buf, start, end - start);
+		if (ret)
+			lzom_stage_error(stage, ret);
+	}
+
+	lzom_stage_put(ldev, BLK_STS_OK);
+}
+
+/*
+ * Hands the open unit over to be written out in the background and opens
+ * the other buffer, once the commit before is in the map. Returns the
+ * number to wait for with lzom_stage_wait(). Called with stage->lock held.
+ */
+static u64 lzom_stage_commit(struct lzom_dev *ldev)
+{
+	struct lzom_stage *stage = &ldev->stage;
+	struct lzom_stage_buf *buf = stage->open;
+
+	lockdep_assert_held(&stage->lock);
+
+	if (bitmap_empty(buf->present, LZOM_UNIT_MAX_BLOCKS))
+		return stage->seq;
+
+	lzom_stage_wait(stage, stage->seq);
+
+	spin_lock(&stage->read_lock);
+	stage->busy = buf;
+	stage->open = buf == &stage->bufs[0] ? &stage->bufs[1] :
+					       &stage->bufs[0];
+	stage->busy_status = BLK_STS_OK;
+	spin_unlock(&stage->read_lock);
+
+	atomic_set(&stage->pending, 1);
+	queue_work(ldev->chunk_wq, &stage->commit_work);
+	return ++stage->seq;
+}
+
+static void lzom_stage_work_fn(struct work_struct *work)
+{
+	struct lzom_stage *stage =
+		container_of(to_delayed_work(work), struct lzom_stage, work);
+
+	mutex_lock(&stage->lock);
+	lzom_stage_commit(container_of(stage, struct lzom_dev, stage));
+	mutex_unlock(&stage->lock);
+}
+
+/*
+ * Commits what is staged and waits for it, returns the first commit error
+ * since the last flush.
+ */
+static blk_status_t lzom_stage_flush(struct lzom_dev *ldev)
+{
+	struct lzom_stage *stage = &ldev->stage;
+	blk_status_t ret;
+	u64 seq;
+
+	if (!READ_ONCE(stage->nr_blocks) && !READ_ONCE(stage->status))
+		return BLK_STS_OK;
+
+	mutex_lock(&stage->lock);
+	seq = lzom_stage_commit(ldev);
+	mutex_unlock(&stage->lock);
+
+	lzom_stage_wait(stage, seq);
+
+	spin_lock(&stage->read_lock);
+	ret = stage->status;
+	stage->status = BLK_STS_OK;
+	spin_unlock(&stage->read_lock);
+
+	return ret;
+}
+
+/*
+ * A write that goes down directly commits the staged blocks it overlaps
+ * first and waits for them, so that they cannot land on top of it later.
+ */
+static void lzom_stage_forget(struct lzom_dev *ldev, u64 lba, unsigned int nr)
+{
+	struct lzom_stage *stage = &ldev->stage;
+	bool overlaps;
+	u64 seq = 0;
+
+	if (!READ_ONCE(stage->nr_blocks))
+		return;
+
+	mutex_lock(&stage->lock);
+	spin_lock(&stage->read_lock);
+	overlaps = lzom_stage_overlaps(stage, stage->open, lba, nr) ||
+		   lzom_stage_overlaps(stage, stage->busy, lba, nr);
+	spin_unlock(&stage->read_lock);
+	if (overlaps)
+		seq = lzom_stage_commit(ldev);
+	mutex_unlock(&stage->lock);
+
+	lzom_stage_wait(stage, seq);
+}
+
+/*
+ * Copies the blocks of @rq into the open unit, committing it whenever it
+ * fills up or the write moves on to another one. Returns false when
+ * coalescing is off, the write then goes down directly.
+ */
+static bool lzom_stage_write(struct lzom_dev *ldev, struct request *rq)
+{
+	struct lzom_stage *stage = &ldev->stage;
+	struct lzom_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	u64 lba = blk_rq_pos(rq) >> (LZOM_BLOCK_SHIFT - SECTOR_SHIFT);
+	unsigned int nr_blocks = blk_rq_bytes(rq) >> LZOM_BLOCK_SHIFT;
+	struct lzom_stage_buf *buf;
+	unsigned int i, idx;
+
+	if (!READ_ONCE(stage->nr_blocks))
+		return false;
+
+	mutex_lock(&stage->lock);
+	if (!stage->nr_blocks) {
+		mutex_unlock(&stage->lock);
+		return false;
+	}
+
+	for (i = 0; i < nr_blocks; i++, lba++) {
+		struct lzom_sg_buf slice = lzom_payload_slice(
+			&cmd->payload, i << LZOM_BLOCK_SHIFT, LZOM_BLOCK_SIZE);
+
+		buf = stage->open;
+		if (!lzom_stage_overlaps(stage, buf, lba, 1) ||
+		    buf->nr_rqs == LZOM_UNIT_MAX_BLOCKS) {
+			lzom_stage_commit(ldev);
+			buf = stage->open;
+			buf->base = round_down(lba, stage->nr_blocks);
+		}
+
+		idx = lba - buf->base;
+		spin_lock(&stage->read_lock);
+		sg_read_bytes(&slice, page_address(buf->pages[idx]),
+			      LZOM_BLOCK_SIZE);
+		__set_bit(idx, buf->present);
+		spin_unlock(&stage->read_lock);
+
+		if (stage->ack == LZOM_STAGE_ACK_COMMIT &&
+		    (!buf->nr_rqs || buf->rqs[buf->nr_rqs - 1] != rq)) {
+			atomic_inc(&cmd->remaining);
+			buf->rqs[buf->nr_rqs++] = rq;
+		}
+
+		if (bitmap_full(buf->present, stage->nr_blocks))
+			lzom_stage_commit(ldev);
+		else
+			queue_delayed_work(ldev->io_wq, &stage->work,
+					   LZOM_STAGE_TIMEOUT);
+	}
+	mutex_unlock(&stage->lock);
+
+	return true;
+}
+
+static void lzom_dev_stage_init(struct lzom_dev *ldev)
+{
+	struct lzom_stage *stage = &ldev->stage;
+
+	mutex_init(&stage->lock);
+	spin_lock_init(&stage->read_lock);
+	stage->open = &stage->bufs[0];
+	INIT_WORK(&stage->commit_work, lzom_stage_commit_work_fn);
+	INIT_DELAYED_WORK(&stage->work, lzom_stage_work_fn);
+}
+
+static void lzom_dev_stage_free(struct lzom_dev *ldev)
+{
+	struct lzom_stage *stage = &ldev->stage;
+	unsigned int i, j;
+	u64 seq;
+
+	cancel_delayed_work_sync(&stage->work);
+
+	mutex_lock(&stage->lock);
+	seq = lzom_stage_commit(ldev);
+	mutex_unlock(&stage->lock);
+	lzom_stage_wait(stage, seq);
+
+	for (i = 0; i < LZOM_UNIT_MAX_BLOCKS; i++) {
+		for (j = 0; j < ARRAY_SIZE(stage->bufs); j++) {
+			if (stage->bufs[j].pages[i])
+				__free_page(stage->bufs[j].pages[i]);
+			stage->bufs[j].pages[i] = NULL;
+		}
+		if (stage->out[i])
+			__free_page(stage->out[i]);
+		stage->out[i] = NULL;
+	}
+}
+
+static int lzom_dev_stage_alloc(struct lzom_dev *ldev)
+{
+	struct lzom_stage *stage = &ldev->stage;
+	unsigned int i, j;
+
+	for (i = 0; i < LZOM_UNIT_MAX_BLOCKS; i++) {
+		for (j = 0; j < ARRAY_SIZE(stage->bufs); j++) {
+			stage->bufs[j].pages[i] = alloc_page(GFP_KERNEL);
+			if (!stage->bufs[j].pages[i])
+				return -ENOMEM;
+		}
+		stage->out[i] = alloc_page(GFP_KERNEL);
+		if (!stage->out[i])
+			return -ENOMEM;
+	}
+
+	stage->ack = LZOM_STAGE_ACK_IMMEDIATE;
+	return 0;
+}
+
+static blk_status_t lzom_write_req_submit(struct request *rq,
+					  struct lzom_dev *ldev)
+{
+	struct lzom_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	unsigned int bsize = blk_rq_bytes(rq);
+	unsigned int chunk_size = READ_ONCE(ldev->chunk_size);
+	bool verify;
+	blk_status_t ret;
+
+	if (lzom_rq_payload(rq, &cmd->payload)) {
+		LZOM_ERRLOG("failed to alloc request bvecs");
+		lzom_stat_inc(ldev, LZOM_STAT_ALLOC_FAILS);
+		return BLK_STS_RESOURCE;
+	}
+
+	/* FUA writes skip the stage, they are waited for anyway */
+	if (!(rq->cmd_flags & REQ_FUA) && lzom_stage_write(ldev, rq)) {
+		lzom_cmd_put(rq, BLK_STS_OK);
+		return BLK_STS_OK;
+	}
+
+	lzom_stage_forget(ldev,
+			  blk_rq_pos(rq) >> (LZOM_BLOCK_SHIFT - SECTOR_SHIFT),
+			  bsize >> LZOM_BLOCK_SHIFT);
+
+	verify = lzom_verify_wanted(ldev);
+	if (chunk_size && bsize > LZOM_BLOCK_SIZE)
+		ret = lzom_write_chunked(ldev, rq, chunk_size, verify);
+	else
+		ret = lzom_write_blocks(ldev, rq, 0, bsize >> LZOM_BLOCK_SHIFT,
+					verify);
+
+	lzom_cmd_put(rq, ret);
+	return BLK_STS_OK;
+}
+
+/* ----------------- read -----------------*/
+static blk_status_t lzom_read_block(struct lzom_dev *ldev, struct request *rq,
+				    unsigned int idx, unsigned int max,
+				    unsigned int *nr);
+
+/*
+ * The cleaner may have moved the blocks while they were read, and their
+ * old segment may even be reused by now. The map entries change in that
+ * case, or the segment generation when a reused segment got the same
+ * entries again, and the read is simply issued again.
+ */
+static bool lzom_read_block_stale(struct lzom_req *lreq)
+{
+	unsigned int idx = lzom_map_idx(lreq->entry);
+	unsigned int i;
+
+	if (lreq->gen != lzom_store_gen(&lreq->ldev->store, lreq->entry))
+		return true;
+
+	for (i = 0; i < lreq->nr; i++)
+		if (lzom_store_get(&lreq->ldev->store, lreq->lba + i) !=
+		    lzom_map_member(lreq->entry, idx + i))
+			return true;
+
+	return false;
+}
+
+/*
+ * Decompresses the unit at @entry read into @bio into one fresh page per
+ * member in @unit. Reads take the pages from the pool without waiting,
+ * they hold pool pages already and requeue on -ENOMEM, readahead leaves
+ * the reserve alone.
+ */
+static int lzom_decompress_unit(struct lzom_dev *ldev, struct bio *bio,
+				u64 entry, struct lzom_unit_pages *unit,
+				bool reserve)
+{
+	unsigned int nr_blocks = lzom_map_unit(entry);
+	struct page **pages = unit->pages;
+	struct bio_vec *bvec = unit->bvec;
+	struct lzom_sg_buf dst;
+	unsigned int i;
+	int ret = -ENOMEM;
+
+	for (i = 0; i < nr_blocks; i++) {
+		if (reserve)
+			pages[i] = mempool_alloc(&ldev->page_pool,
+						 GFP_NOWAIT | __GFP_NOWARN);
+		else
+			pages[i] = alloc_page(GFP_NOIO | __GFP_NOWARN);
+		if (!pages[i])
+			goto err;
+
+		bvec_set_page(&bvec[i], pages[i], LZOM_BLOCK_SIZE, 0);
+	}
+
+	dst = lzom_sg_buf_create(
+		(struct bvec_iter){ .bi_size = nr_blocks << LZOM_BLOCK_SHIFT },
+		bvec);
+	ret = lzom_decompress_slice(ldev, bio, entry, &dst);
+	if (!ret)
+		return 0;
+
+err:
+	while (i--)
+		mempool_free(pages[i], &ldev->page_pool);
+	return ret;
+}
+
+/*
+ * Hands the pages of a unit decompressed from @entry, whose first member
+ * is block @lba, over to the cache. Members rewritten meanwhile are
+ * dropped. Returns how many were cached.
+ */
+static unsigned int lzom_cache_unit(struct lzom_dev *ldev, u64 lba, u64 entry,
+				    u32 gen, struct page **pages)
+{
+	unsigned int i, cached = 0;
+
+	for (i = 0; i < lzom_map_unit(entry); i++) {
+		u64 member = lzom_map_member(entry, i);
+
+		if (READ_ONCE(ldev->cache.max) &&
+		    lzom_store_get(&ldev->store, lba + i) == member) {
+			lzom_cache_add(ldev, lba + i, member, gen, pages[i]);
+			cached++;
+		} else {
+			mempool_free(pages[i], &ldev->page_pool);
+		}
+	}
+
+	return cached;
+}
+
+/*
+ * Fills the request from a unit: all of it is decompressed, the blocks
+ * the request wants are copied out and the rest goes to the cache for
+ * the reads that usually follow.
+ */
+static int lzom_read_unit(struct lzom_req *lreq, struct lzom_sg_buf *slice)
+{
+	struct lzom_dev *ldev = lreq->ldev;
+	unsigned int idx = lzom_map_idx(lreq->entry);
+	struct lzom_sg_buf dst = *slice;
+	struct lzom_unit_pages *unit;
+	unsigned int i;
+	int ret;
+
+	unit = mempool_alloc(&ldev->unit_pool, GFP_NOIO);
+	ret = lzom_decompress_unit(ldev, &lreq->bio, lreq->entry, unit, true);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < lreq->nr; i++)
+		sg_write_bytes(&dst, page_address(unit->pages[idx + i]),
+			       LZOM_BLOCK_SIZE);
+
+	lzom_cache_unit(ldev, lreq->lba - idx, lreq->entry, lreq->gen,
+			unit->pages);
+out:
+	mempool_free(unit, &ldev->unit_pool);
+	return ret;
+}
+
+/* drops the lower bio of a read along with its pool pages */
+static void lzom_read_block_put(struct lzom_req *lreq)
+{
+	if (!(lreq->entry & LZOM_MAP_RAW))
+		lzom_bio_free_pages(lreq->ldev, &lreq->bio);
+	bio_put(&lreq->bio);
+}
+
+static void lzom_read_block_work_fn(struct work_struct *work)
+{
+	struct lzom_req *lreq = container_of(work, struct lzom_req, work);
+	struct lzom_cmd *cmd = blk_mq_rq_to_pdu(lreq->rq);
+	unsigned int idx = lreq->off >> LZOM_BLOCK_SHIFT;
+	struct lzom_dev *ldev = lreq->ldev;
+	struct request *rq = lreq->rq;
+	struct bio *bio = &lreq->bio;
+	struct lzom_sg_buf slice;
+	blk_status_t ret = bio->bi_status;
+	unsigned int i, nr, nr_blocks;
+	int err;
+
+	if (lzom_read_block_stale(lreq)) {
+		/* the pages go back before the new reads may wait for them */
+		nr_blocks = lreq->nr;
+		lzom_read_block_put(lreq);
+
+		ret = BLK_STS_OK;
+		for (i = 0; i < nr_blocks && ret == BLK_STS_OK; i += nr)
+			ret = lzom_read_block(ldev, rq, idx + i, nr_blocks - i,
+					      &nr);
+		lzom_cmd_put(rq, ret);
+		return;
+	}
+
+	if (ret == BLK_STS_OK && !(lreq->entry & LZOM_MAP_RAW)) {
+		slice = lzom_payload_slice(&cmd->payload, lreq->off,
+					   lreq->nr << LZOM_BLOCK_SHIFT);
+
+		if (lzom_map_unit(lreq->entry) > 1)
+			err = lzom_read_unit(lreq, &slice);
+		else
+			err = lzom_decompress_slice(ldev, bio, lreq->entry,
+						    &slice);
+
+		/* out of memory is not the data's fault, try again later */
+		if (err == -ENOMEM)
+			ret = BLK_STS_RESOURCE;
+		else if (err)
+			ret = BLK_STS_IOERR;
+		else if (lzom_map_unit(lreq->entry) == 1)
+			lzom_cache_insert(ldev, lreq->lba, lreq->entry,
+					  lreq->gen, &slice);
+	}
+
+	lzom_read_block_put(lreq);
+	lzom_cmd_put(rq, ret);
+}
+
+static void lzom_read_block_endio(struct bio *bio)
+{
+	struct lzom_req *lreq = container_of(bio, struct lzom_req, bio);
+
+	trace_lzom_bio_endio(bio, lreq->lba);
+	lzom_lat_end(lreq->ldev, LZOM_LAT_READ_LOWER, lreq->start);
+
+	if (lreq->entry & LZOM_MAP_RAW && !lzom_read_block_stale(lreq)) {
+		lzom_cmd_put(lreq->rq, bio->bi_status);
+		bio_put(bio);
+		return;
+	}
+
+	/* decompression needs a workspace, which is not for irq context */
+	INIT_WORK(&lreq->work, lzom_read_block_work_fn);
+	queue_work(lreq->ldev->io_wq, &lreq->work);
+}
+
+/*
+ * How many of the @max blocks from @lba map the members of the unit at
+ * @entry that follow each other, so that one read of the unit serves
+ * them all.
+ */
+static unsigned int lzom_read_run(struct lzom_dev *ldev, u64 lba, u64 entry,
+				  unsigned int max)
+{
+	unsigned int idx = lzom_map_idx(entry);
+	unsigned int nr = 1;
+
+	while (nr < max && idx + nr < lzom_map_unit(entry) &&
+	       lzom_store_get(&ldev->store, lba + nr) ==
+		       lzom_map_member(entry, idx + nr) &&
+	       !lzom_stage_has(ldev, lba + nr))
+		nr++;
+
+	return nr;
+}
+
+/*
+ * Reads block @idx of @rq from where the map says it is, together with
+ * up to @max - 1 following blocks stored in the same unit, and sets *@nr
+ * to how many it took. Raw blocks go straight into the request's pages,
+ * compressed ones into pool pages to be decompressed on completion and
+ * unmapped ones are zero filled.
+ */
+static blk_status_t lzom_read_block(struct lzom_dev *ldev, struct request *rq,
+				    unsigned int idx, unsigned int max,
+				    unsigned int *nr)
+{
+	struct lzom_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	u64 lba = (blk_rq_pos(rq) >> (LZOM_BLOCK_SHIFT - SECTOR_SHIFT)) + idx;
+	unsigned int off = idx << LZOM_BLOCK_SHIFT;
+	struct lzom_sg_buf slice;
+	struct lzom_req *lreq;
+	struct bio *bio;
+	u64 entry, start;
+
+	*nr = 1;
+	slice = lzom_payload_slice(&cmd->payload, off, LZOM_BLOCK_SIZE);
+
+	/* staged blocks are newer than the map */
+	if (lzom_stage_read(ldev, lba, &slice))
+		return BLK_STS_OK;
+
+	entry = lzom_store_get(&ldev->store, lba);
+	if (!entry) {
+		lzom_payload_zero(&slice);
+		return BLK_STS_OK;
+	}
+
+	if (lzom_cache_read(ldev, lba, entry, &slice))
+		return BLK_STS_OK;
+
+	*nr = lzom_read_run(ldev, lba, entry, max);
+	slice = lzom_payload_slice(&cmd->payload, off,
+				   *nr << LZOM_BLOCK_SHIFT);
+
+	start = lzom_lat_start(ldev);
+	if (entry & LZOM_MAP_RAW) {
+		bio = lzom_bio_map(ldev, &slice, lzom_rq_opf(rq));
+		if (!bio) {
+			lzom_stat_inc(ldev, LZOM_STAT_ALLOC_FAILS);
+			return BLK_STS_RESOURCE;
+		}
+
+		bio->bi_iter.bi_sector = lzom_map_raw_sector(entry);
+	} else {
+		unsigned int size = lzom_map_len(entry) << SECTOR_SHIFT;
+
+		bio = bio_alloc_bioset(ldev->under_dev.bdev,
+				       DIV_ROUND_UP(size, PAGE_SIZE),
+				       lzom_rq_opf(rq), GFP_NOIO,
+				       ldev->under_dev.bset);
+		if (!bio) {
+			lzom_stat_inc(ldev, LZOM_STAT_ALLOC_FAILS);
+			return BLK_STS_RESOURCE;
+		}
+
+		lzom_bio_alloc_pages(ldev, bio, size);
+		bio->bi_iter.bi_sector = lzom_map_sector(entry);
+	}
+	lzom_lat_end(ldev, LZOM_LAT_READ_ALLOC, start);
+
+	lreq = container_of(bio, struct lzom_req, bio);
+	lreq->rq = rq;
+	lreq->ldev = ldev;
+	lreq->lba = lba;
+	lreq->entry = entry;
+	lreq->gen = lzom_store_gen(&ldev->store, entry);
+	lreq->off = off;
+	lreq->nr = *nr;
+
+	bio->bi_end_io = lzom_read_block_endio;
+
+	atomic_inc(&cmd->remaining);
+	lreq->start = lzom_lat_start(ldev);
+	trace_lzom_bio_submit(bio, lba);
+	submit_bio_noacct(bio);
+	return BLK_STS_OK;
+}
+
+/* ----------------- readahead -----------------*/
+static void lzom_ra_work_fn(struct work_struct *work)
+{
+	struct lzom_req *lreq = container_of(work, struct lzom_req, work);
+	struct lzom_dev *ldev = lreq->ldev;
+	struct bio *bio = &lreq->bio;
+	struct lzom_unit_pages *unit;
+	struct bvec_iter_all iter_all;
+	struct bio_vec *bv;
+
+	if (bio->bi_status || lzom_read_block_stale(lreq))
+		goto out;
+
+	if (lreq->entry & LZOM_MAP_RAW) {
+		lzom_cache_add(ldev, lreq->lba, lreq->entry, lreq->gen,
+			       bio_first_page_all(bio));
+		lzom_stat_inc(ldev, LZOM_STAT_RA_BLOCKS);
+		goto done;
+	}
+
+	/* readahead leaves the reserve to the reads */
+	unit = mempool_alloc(&ldev->unit_pool, GFP_NOWAIT);
+	if (!unit)
+		goto out;
+
+	if (!lzom_decompress_unit(ldev, bio, lreq->entry, unit, false))
+		lzom_stat_add(ldev, LZOM_STAT_RA_BLOCKS,
+			      lzom_cache_unit(ldev,
+					      lreq->lba -
+						      lzom_map_idx(lreq->entry),
+					      lreq->entry, lreq->gen,
+					      unit->pages));
+	mempool_free(unit, &ldev->unit_pool);
+
+out:
+	bio_for_each_segment_all (bv, bio, iter_all)
+		__free_page(bv->bv_page);
+done:
+	bio_put(bio);
+
+	if (atomic_dec_and_test(&ldev->ra.inflight))
+		wake_up_var(&ldev->ra.inflight);
+}
+
+static void lzom_ra_endio(struct bio *bio)
+{
+	struct lzom_req *lreq = container_of(bio, struct lzom_req, bio);
+
+	trace_lzom_bio_endio(bio, lreq->lba);
+
+	INIT_WORK(&lreq->work, lzom_ra_work_fn);
+	queue_work(lreq->ldev->io_wq, &lreq->work);
+}
+
+/*
+ * Reads block @lba into the cache, a compressed unit as a whole unless
+ * *@last says it is already on its way. Readahead never waits for memory
+ * and leaves the page pool to the requests, it gives up instead.
+ */
+static int lzom_ra_block(struct lzom_dev *ldev, u64 lba, unsigned int max,
+			 u64 *last)
+{
+	u64 entry = lzom_store_get(&ldev->store, lba);
+	struct lzom_req *lreq;
+	unsigned int size, i;
+	sector_t sector;
+	struct bio *bio;
+	bool cached;
+
+	if (!entry || lzom_stage_has(ldev, lba))
+		return 0;
+
+	rcu_read_lock();
+	cached = lzom_cache_lookup(ldev, lba, entry);
+	rcu_read_unlock();
+	if (cached)
+		return 0;
+
+	if (entry & LZOM_MAP_RAW) {
+		sector = lzom_map_raw_sector(entry);
+		size = LZOM_BLOCK_SIZE;
+	} else {
+		if (lzom_map_member(entry, 0) == *last)
+			return 0;
+
+		sector = lzom_map_sector(entry);
+		size = lzom_map_len(entry) << SECTOR_SHIFT;
+	}
+
+	if (atomic_inc_return(&ldev->ra.inflight) > max)
+		goto busy;
+
+	bio = bio_alloc_bioset(ldev->under_dev.bdev,
+			       DIV_ROUND_UP(size, PAGE_SIZE),
+			       REQ_OP_READ | REQ_RAHEAD, GFP_NOWAIT,
+			       ldev->under_dev.bset);
+	if (!bio)
+		goto busy;
+
+	for (i = 0; i < size; i += PAGE_SIZE) {
+		struct page *page = alloc_page(GFP_NOWAIT | __GFP_NOWARN);
+
+		if (!page) {
+			struct bvec_iter_all iter_all;
+			struct bio_vec *bv;
+
+			bio_for_each_segment_all (bv, bio, iter_all)
+				__free_page(bv->bv_page);
+			bio_put(bio);
+			goto busy;
+		}
+
+		__bio_add_page(bio, page, min_t(unsigned int, size - i,
+						PAGE_SIZE), 0);
+	}
+
+	lreq = container_of(bio, struct lzom_req, bio);
+	lreq->rq = NULL;
+	lreq->ldev = ldev;
+	lreq->lba = lba;
+	lreq->entry = entry;
+	lreq->gen = lzom_store_gen(&ldev->store, entry);
+	lreq->nr = 1;
+
+	bio->bi_end_io = lzom_ra_endio;
+	bio->bi_iter.bi_sector = sector;
+
+	*last = lzom_map_member(entry, 0);
+	trace_lzom_bio_submit(bio, lba);
+	submit_bio_noacct(bio);
+	return 0;
+
+busy:
+	if (atomic_dec_and_test(&ldev->ra.inflight))
+		wake_up_var(&ldev->ra.inflight);
+	return -EBUSY;
+}
+
+/*
+ * Feeds the read of @nr blocks at @lba to the stream detector and tops
+ * the prefetched run up to a window ahead once half of it was consumed.
+ * Upper layer readahead counts as sequential.
+ */
+static void lzom_readahead(struct lzom_dev *ldev, u64 lba, unsigned int nr,
+			   bool rahead)
+{
+	struct lzom_ra *ra = &ldev->ra;
+	unsigned int max = READ_ONCE(ra->max);
+	u64 start, end, last = 0;
+	bool seq;
+
+	/* the cache is the staging area */
+	if (!max || !READ_ONCE(ldev->cache.max))
+		return;
+
+	spin_lock(&ra->lock);
+	seq = lba == ra->next || rahead;
+	if (seq) {
+		ra->window = min(max(ra->window * 2, LZOM_RA_MIN_BLOCKS), max);
+	} else {
+		ra->window /= 2;
+		ra->end = 0;
+	}
+
+	ra->next = lba + nr;
+	start = max(ra->next, ra->end);
+	end = min(ra->next + ra->window, ldev->store.nr_blocks);
+
+	if (!seq || start >= end || start - ra->next > ra->window / 2)
+		start = end;
+	else
+		ra->end = end;
+	spin_unlock(&ra->lock);
+
+	for (lba = start; lba < end; lba++)
+		if (lzom_ra_block(ldev, lba, max, &last))
+			break;
+}
+
+static void lzom_dev_ra_init(struct lzom_dev *ldev)
+{
+	spin_lock_init(&ldev->ra.lock);
+	ldev->ra.max = LZOM_RA_SIZE_DEFAULT >> LZOM_BLOCK_SHIFT;
+}
+
+/* prefetches complete on ldev->io_wq, which must outlive them */
+static void lzom_dev_ra_drain(struct lzom_dev *ldev)
+{
+	wait_var_event(&ldev->ra.inflight, !atomic_read(&ldev->ra.inflight));
+}
+
+static blk_status_t lzom_read_req_submit(struct request *rq,
+					 struct lzom_dev *ldev)
+{
+	struct lzom_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	unsigned int nr_blocks = blk_rq_bytes(rq) >> LZOM_BLOCK_SHIFT;
+	blk_status_t ret = BLK_STS_OK;
+	unsigned int i, nr;
+
+	if (lzom_rq_payload(rq, &cmd->payload)) {
+		LZOM_ERRLOG("failed to alloc request bvecs");
+		lzom_stat_inc(ldev, LZOM_STAT_ALLOC_FAILS);
+		return BLK_STS_RESOURCE;
+	}
+
+	for (i = 0; i < nr_blocks && ret == BLK_STS_OK; i += nr)
+		ret = lzom_read_block(ldev, rq, i, nr_blocks - i, &nr);
+
+	if (ret == BLK_STS_OK)
+		lzom_readahead(ldev,
+			       blk_rq_pos(rq) >>
+				       (LZOM_BLOCK_SHIFT - SECTOR_SHIFT),
+			       nr_blocks, rq->cmd_flags & REQ_RAHEAD);
+
+	lzom_cmd_put(rq, ret);
+	return BLK_STS_OK;
+}
+
+/* ----------------- discard -----------------*/
+/*
+ * Discard and write zeroes both unmap the range, so that it reads as zeros
+ * and its space is dead for the cleaner. The lower device sees discards
+ * when the cleaner frees whole segments.
+ */
+static blk_status_t lzom_unmap_req_submit(struct request *rq,
+					  struct lzom_dev *ldev)
+{
+	u64 lba = blk_rq_pos(rq) >> (LZOM_BLOCK_SHIFT - SECTOR_SHIFT);
+	u64 end = lba + (blk_rq_bytes(rq) >> LZOM_BLOCK_SHIFT);
+
+	lzom_stage_forget(ldev, lba, end - lba);
+
+	for (; lba < end; lba++) {
+		if (lzom_store_get(&ldev->store, lba))
+			lzom_store_install(&ldev->store, lba, 0);
+		cond_resched();
+	}
+
+	lzom_cmd_put(rq, BLK_STS_OK);
+	return BLK_STS_OK;
+}
+
+static void lzom_handle_rq(struct lzom_dev *ldev, struct request *rq)
+{
+	struct lzom_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	blk_status_t ret;
+
+	/* the submitter's reference */
+	atomic_set(&cmd->remaining, 1);
+	cmd->status = BLK_STS_OK;
+
+	switch (req_op(rq)) {
+	case REQ_OP_WRITE:
+		ret = lzom_write_req_submit(rq, ldev);
+		break;
+
+	case REQ_OP_READ:
+		ret = lzom_read_req_submit(rq, ldev);
+		break;
+
+	case REQ_OP_DISCARD:
+	case REQ_OP_WRITE_ZEROES:
+		ret = lzom_unmap_req_submit(rq, ldev);
+		break;
+
+	case REQ_OP_FLUSH:
+		lzom_flush_queue(ldev, rq);
+		ret = BLK_STS_OK;
+		break;
+
+	default:
+		LZOM_ERRLOG("unsupported request operation");
+		ret = BLK_STS_NOTSUPP;
+		break;
+	}
+
+	if (ret != BLK_STS_OK)
+		lzom_rq_end(rq, ret);
+}
+
+/* ----------------- pipeline -----------------*/
+static void lzom_queue_work_fn(struct work_struct *work)
+{
+	struct lzom_queue *queue = container_of(work, struct lzom_queue, work);
+	struct lzom_dev *ldev = queue->ldev;
+	struct lzom_cmd *cmd, *next;
+	struct blk_plug plug;
+	LIST_HEAD(cmds);
+
+	spin_lock_irq(&queue->lock);
+	list_splice_init(&queue->cmds, &cmds);
+	spin_unlock_irq(&queue->lock);
+
+	blk_start_plug(&plug);
+	list_for_each_entry_safe (cmd, next, &cmds, node) {
+		list_del_init(&cmd->node);
+		atomic_dec(&ldev->queued);
+		lzom_handle_rq(ldev, blk_mq_rq_from_pdu(cmd));
+	}
+	blk_finish_plug(&plug);
+}
+
+/*
+ * Hands a write over to the workers. Returns false when the pipeline is
+ * off or already holds pipeline_depth requests, the caller then
+ * compresses on the hctx CPU.
+ */
+static bool lzom_queue_rq_to_pipeline(struct lzom_dev *ldev,
+				      struct request *rq)
+{
+	unsigned int depth = READ_ONCE(ldev->pipeline_depth);
+	struct lzom_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	struct lzom_queue *queue;
+	unsigned long flags;
+
+	if (!depth || req_op(rq) != REQ_OP_WRITE)
+		return false;
+
+	if (atomic_inc_return(&ldev->queued) > depth) {
+		atomic_dec(&ldev->queued);
+		return false;
+	}
+
+	queue = get_cpu_ptr(ldev->queues);
+	spin_lock_irqsave(&queue->lock, flags);
+	list_add_tail(&cmd->node, &queue->cmds);
+	spin_unlock_irqrestore(&queue->lock, flags);
+	queue_work(ldev->wq, &queue->work);
+	put_cpu_ptr(ldev->queues);
+
+	return true;
+}
+
+static void lzom_dev_pipeline_free(struct lzom_dev *ldev)
+{
+	if (ldev->wq) {
+		destroy_workqueue(ldev->wq);
+		ldev->wq = NULL;
+	}
+
+	if (ldev->chunk_wq) {
+		destroy_workqueue(ldev->chunk_wq);
+		ldev->chunk_wq = NULL;
+	}
+
+	if (ldev->io_wq) {
+		destroy_workqueue(ldev->io_wq);
+		ldev->io_wq = NULL;
+	}
+
+	free_percpu(ldev->queues);
+	ldev->queues = NULL;
+}
+
+static int lzom_dev_pipeline_alloc(struct lzom_dev *ldev)
+{
+	int cpu;
+
+	ldev->queues = alloc_percpu(struct lzom_queue);
+	if (!ldev->queues)
+		return -ENOMEM;
+
+	for_each_possible_cpu (cpu) {
+		struct lzom_queue *queue = per_cpu_ptr(ldev->queues, cpu);
+
+		spin_lock_init(&queue->lock);
+		INIT_LIST_HEAD(&queue->cmds);
+		INIT_WORK(&queue->work, lzom_queue_work_fn);
+		queue->ldev = ldev;
+	}
 
-#define LZOM_NAME "lzom_module"
-#define LZOM_INIT_MINOR 0
-#define POOL_SIZE 512
+	ldev->pipeline_workers = num_online_cpus();
+	ldev->wq = alloc_workqueue("lzom_wq", WQ_UNBOUND | WQ_MEM_RECLAIM,
+				   ldev->pipeline_workers);
+	/*
+	 * Separate, so pipeline workers can wait for chunks and stage commits
+	 * without deadlock.
+	 */
+	ldev->chunk_wq = alloc_workqueue("lzom_chunk_wq",
+					 WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	/*
+	 * Completions give pool pages and bios back and flushes end the
+	 * writes waiting for them. Behind pipeline workers blocked on the
+	 * pool they would never run, so they do not share their max_active.
+	 */
+	ldev->io_wq = alloc_workqueue("lzom_io_wq",
+				      WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!ldev->wq || !ldev->chunk_wq || !ldev->io_wq) {
+		lzom_dev_pipeline_free(ldev);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
 
-#define LZOM_LOG(fmt, ...) \
-	pr_info("%s[inf] " fmt "\n", LZOM_NAME, ##__VA_ARGS__)
+/* ----------------- blk-mq -----------------*/
+static blk_status_t lzom_queue_rq(struct blk_mq_hw_ctx *hctx,
+				  const struct blk_mq_queue_data *bd)
+{
+	struct lzom_dev *ldev = hctx->queue->queuedata;
+	struct request *rq = bd->rq;
 
-#define LZOM_ERRLOG(fmt, ...) \
-	pr_err("%s[err] " fmt "\n", LZOM_NAME, ##__VA_ARGS__)
+	blk_mq_start_request(rq);
+	/* every request passes here, pipelined ones before they wait */
+	lzom_stat_inc(ldev, LZOM_STAT_STARTED);
+	trace_lzom_rq_start(rq);
 
-static struct lzom_module_g lzom = { .free_minor = LZOM_INIT_MINOR };
+	if (!lzom_queue_rq_to_pipeline(ldev, rq))
+		lzom_handle_rq(ldev, rq);
 
-static bool lzom_is_exist(void)
+	return BLK_STS_OK;
+}
+
+static int lzom_init_request(struct blk_mq_tag_set *set, struct request *rq,
+			     unsigned int hctx_idx, unsigned int numa_node)
 {
-	return lzom.dev_path;
+	struct lzom_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	INIT_LIST_HEAD(&cmd->node);
+	cmd->bvec = NULL;
+	return 0;
 }
 
-/* ----------------- submit bio -----------------*/
-static unsigned short lzom_bio_size_to_pages(size_t size)
+static const struct blk_mq_ops lzom_mq_ops = {
+	.queue_rq = lzom_queue_rq,
+	.init_request = lzom_init_request,
+};
+
+static const struct block_device_operations lzom_fops = {
+	.owner = THIS_MODULE,
+};
+
+/* ----------------- sysfs -----------------*/
+static ssize_t bitstream_version_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
 {
-	size_t pages_needed = DIV_ROUND_UP(size, PAGE_SIZE);
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
 
-	return (unsigned short)min_t(size_t, pages_needed, BIO_MAX_VECS);
+	return sysfs_emit(buf, "%u\n", READ_ONCE(ldev->bitstream_version));
 }
 
-static void lzom_buffer_free(struct lzom_buffer *buf)
+static ssize_t bitstream_version_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
 {
-	if (buf) {
-		kfree(buf->data);
-		kfree(buf);
-	}
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
+	u8 version;
+	int ret;
+
+	ret = kstrtou8(buf, 10, &version);
+	if (ret)
+		return ret;
+
+	/* 0: plain lzo, 1: lzo-rle */
+	if (version > 1)
+		return -EINVAL;
+
+	WRITE_ONCE(ldev->bitstream_version, version);
+	return count;
+}
+static DEVICE_ATTR_RW(bitstream_version);
+
+static const char *const lzom_verify_names[] = {
+	[LZOM_VERIFY_OFF] = "off",
+	[LZOM_VERIFY_ALWAYS] = "always",
+	[LZOM_VERIFY_SAMPLE] = "sample",
+};
+
+static ssize_t verify_show(struct device *dev, struct device_attribute *attr,
+			   char *buf)
+{
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
+
+	return sysfs_emit(buf, "%s\n",
+			  lzom_verify_names[READ_ONCE(ldev->verify_mode)]);
 }
 
-static struct lzom_buffer *lzom_buffer_alloc(size_t size)
+static ssize_t verify_store(struct device *dev, struct device_attribute *attr,
+			    const char *buf, size_t count)
 {
-	struct lzom_buffer *buf;
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
+	int mode;
 
-	buf = kzalloc(sizeof(*buf), GFP_NOIO);
-	if (!buf) {
-		LZOM_ERRLOG("failed to allocate buffer structure");
-		return NULL;
-	}
+	mode = sysfs_match_string(lzom_verify_names, buf);
+	if (mode < 0)
+		return mode;
 
-	buf->data = kzalloc(size, GFP_NOIO);
-	if (!buf->data) {
-		LZOM_ERRLOG("failed to allocate buffer data");
-		kfree(buf);
-		return NULL;
-	}
+	WRITE_ONCE(ldev->verify_mode, mode);
+	return count;
+}
+static DEVICE_ATTR_RW(verify);
+
+static ssize_t verify_sample_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
 
-	buf->buf_sz = size;
-	return buf;
+	return sysfs_emit(buf, "%u\n", READ_ONCE(ldev->verify_sample));
 }
 
-int lzom_copy_from_bio_to_buf(struct bio *bio, struct lzom_buffer *buf)
+static ssize_t verify_sample_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
 {
-	struct bio_vec bv;
-	struct bvec_iter iter;
-	char *ptr = buf->data;
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
+	u32 sample;
+	int ret;
 
-	if (!buf || !buf->data)
-		return -EINVAL;
+	ret = kstrtou32(buf, 10, &sample);
+	if (ret)
+		return ret;
 
-	if (buf->buf_sz < bio->bi_iter.bi_size)
+	/* one in @sample writes is verified */
+	if (!sample)
 		return -EINVAL;
 
-	bio_for_each_segment (bv, bio, iter) {
-		memcpy_from_bvec(ptr, &bv);
-		ptr += bv.bv_len;
-	}
+	WRITE_ONCE(ldev->verify_sample, sample);
+	return count;
+}
+static DEVICE_ATTR_RW(verify_sample);
 
-	buf->data_sz = bio->bi_iter.bi_size;
+static ssize_t verify_stat_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
 
-	return 0;
+	return sysfs_emit(buf, "%8llu %8llu\n",
+			  lzom_stat_read(ldev, LZOM_STAT_VERIFY_CHECKED),
+			  lzom_stat_read(ldev, LZOM_STAT_VERIFY_MISMATCHED));
+}
+static DEVICE_ATTR_RO(verify_stat);
+
+/*
+ * Counters are summed without stopping the CPUs, so the in-flight column
+ * may be off by the requests completing meanwhile.
+ */
+static ssize_t perf_stat_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
+	u64 completed = lzom_stat_read(ldev, LZOM_STAT_COMPLETED) +
+			lzom_stat_read(ldev, LZOM_STAT_REQUEUED);
+	u64 started = lzom_stat_read(ldev, LZOM_STAT_STARTED);
+
+	return sysfs_emit(buf,
+			  "%8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu\n",
+			  lzom_stat_read(ldev, LZOM_STAT_BYTES_IN),
+			  lzom_stat_read(ldev, LZOM_STAT_BYTES_OUT),
+			  lzom_stat_read(ldev, LZOM_STAT_COMPRESSED),
+			  lzom_stat_read(ldev, LZOM_STAT_RAW),
+			  lzom_stat_read(ldev, LZOM_STAT_VERIFY_MISMATCHED),
+			  lzom_stat_read(ldev, LZOM_STAT_ALLOC_FAILS),
+			  started > completed ? started - completed : 0,
+			  lzom_stat_read(ldev, LZOM_STAT_COMPRESS_NS),
+			  lzom_stat_read(ldev, LZOM_STAT_DECOMPRESS_NS));
+}
+static DEVICE_ATTR_RO(perf_stat);
+
+static ssize_t latency_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(ldev->latency));
 }
 
-static int lzom_add_buf_to_bio(struct lzom_buffer *buf, u32 part_to_use,
-			       struct bio *bio)
+static ssize_t latency_store(struct device *dev, struct device_attribute *attr,
+			     const char *buf, size_t count)
 {
-	char *data = buf->data;
-	unsigned int len = part_to_use;
-	unsigned int pageoff, pagelen;
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
+	bool latency;
 	int ret;
 
-	if (buf->buf_sz < part_to_use) {
-		// TODO: LZOM_ERRLOG("");
-		return -EINVAL;
-	}
+	ret = kstrtobool(buf, &latency);
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(ldev->latency, latency);
+	return count;
+}
+static DEVICE_ATTR_RW(latency);
+
+static const char *const lzom_lat_names[NR_LZOM_LAT] = {
+	[LZOM_LAT_WRITE_ALLOC] = "write_alloc",
+	[LZOM_LAT_WRITE_COMPRESS] = "write_compress",
+	[LZOM_LAT_WRITE_VERIFY] = "write_verify",
+	[LZOM_LAT_WRITE_SUBMIT] = "write_submit",
+	[LZOM_LAT_WRITE_LOWER] = "write_lower",
+	[LZOM_LAT_READ_ALLOC] = "read_alloc",
+	[LZOM_LAT_READ_LOWER] = "read_lower",
+	[LZOM_LAT_READ_DECOMPRESS] = "read_decompress",
+};
+
+/* one line per stage: its name and the counts of the log2 ns buckets */
+static ssize_t latency_hist_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
+	unsigned int stage, i;
+	int len = 0, cpu;
+
+	for (stage = 0; stage < NR_LZOM_LAT; stage++) {
+		len += sysfs_emit_at(buf, len, "%-16s", lzom_lat_names[stage]);
 
-	pageoff = offset_in_page(data);
+		for (i = 0; i < LZOM_LAT_BUCKETS; i++) {
+			u64 sum = 0;
 
-	while (len > 0) {
-		pagelen = min_t(unsigned int, len, PAGE_SIZE - pageoff);
+			for_each_possible_cpu (cpu)
+				sum += per_cpu_ptr(ldev->stats, cpu)
+					       ->lat[stage][i];
 
-		ret = bio_add_page(bio, virt_to_page(data), pagelen, pageoff);
-		if (ret != pagelen) {
-			LZOM_ERRLOG("bio_add_page failed");
-			return -EAGAIN;
+			len += sysfs_emit_at(buf, len, " %llu", sum);
 		}
 
-		len -= pagelen;
-		data += pagelen;
-		pageoff = 0;
+		len += sysfs_emit_at(buf, len, "\n");
 	}
 
-	return 0;
+	return len;
 }
 
-static void lzom_req_free(struct lzom_req *lreq)
+/* writing 0 clears the histograms */
+static ssize_t latency_hist_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
 {
-	if (!lreq)
-		return;
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
+	unsigned int val;
+	int cpu;
 
-	lzom_buffer_free(lreq->buffer);
-	kfree(lreq);
-}
+	if (kstrtouint(buf, 0, &val) || val)
+		return -EINVAL;
 
-static struct lzom_req *lzom_req_alloc(void)
-{
-	struct lzom_req *lreq;
+	for_each_possible_cpu (cpu) {
+		struct lzom_stats *stats = per_cpu_ptr(ldev->stats, cpu);
 
-	lreq = kzalloc(sizeof(*lreq), GFP_NOIO);
-	if (!lreq) {
-		LZOM_ERRLOG("failed to allocate request");
-		return NULL;
+		memset(stats->lat, 0, sizeof(stats->lat));
 	}
 
-	return lreq;
+	return count;
 }
+static DEVICE_ATTR_RW(latency_hist);
 
-static void lzom_write_req_endio(struct bio *bio)
+static ssize_t pipeline_depth_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
 {
-	struct lzom_req *lreq = bio->bi_private;
-	struct bio *original_bio = lreq->original_bio;
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
 
-	bio_endio(original_bio);
+	return sysfs_emit(buf, "%u\n", READ_ONCE(ldev->pipeline_depth));
+}
 
-	bio_put(bio);
-	lzom_req_free(lreq);
+static ssize_t pipeline_depth_store(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t count)
+{
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
+	u32 depth;
+	int ret;
+
+	/* 0 compresses in the submitter's context */
+	ret = kstrtou32(buf, 10, &depth);
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(ldev->pipeline_depth, depth);
+	return count;
 }
+static DEVICE_ATTR_RW(pipeline_depth);
 
-static void lzom_read_req_endio(struct bio *bio)
+static ssize_t pipeline_workers_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
 {
-	struct lzom_req *lreq = bio->bi_private;
-	struct bio *original_bio = lreq->original_bio;
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(ldev->pipeline_workers));
+}
 
-	bio_endio(original_bio);
+static ssize_t pipeline_workers_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
+	u32 workers;
+	int ret;
 
-	bio_put(bio);
-	lzom_req_free(lreq);
+	ret = kstrtou32(buf, 10, &workers);
+	if (ret)
+		return ret;
+
+	if (!workers || workers > WQ_MAX_ACTIVE)
+		return -EINVAL;
+
+	workqueue_set_max_active(ldev->wq, workers);
+	WRITE_ONCE(ldev->pipeline_workers, workers);
+	return count;
 }
+static DEVICE_ATTR_RW(pipeline_workers);
 
-static void lzom_init_bvec_array(struct bio_vec *bvec, size_t vec_cnt,
-				 char *data_ptr, size_t data_len)
+static ssize_t chunk_size_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
 {
-	size_t i;
-	size_t remaining = data_len;
-	char *cur_ptr = data_ptr;
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
 
-	for (i = 0; i < vec_cnt && remaining > 0; i++) {
-		size_t page_offset = offset_in_page(cur_ptr);
-		size_t chunk_len =
-			min_t(size_t, remaining, PAGE_SIZE - page_offset);
+	return sysfs_emit(buf, "%u\n", READ_ONCE(ldev->chunk_size));
+}
 
-		bvec[i].bv_page = virt_to_page(cur_ptr);
-		bvec[i].bv_offset = page_offset;
-		bvec[i].bv_len = chunk_len;
+static ssize_t chunk_size_store(struct device *dev,
+				struct device_attribute *attr, const char *buf,
+				size_t count)
+{
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
+	u32 chunk_size;
+	int ret;
 
-		cur_ptr += chunk_len;
-		remaining -= chunk_len;
-	}
+	ret = kstrtou32(buf, 10, &chunk_size);
+	if (ret)
+		return ret;
+
+	/* 0 stores the blocks of a request one by one */
+	if (chunk_size && (!is_power_of_2(chunk_size) ||
+			   chunk_size < LZOM_BLOCK_SIZE ||
+			   chunk_size > LZOM_UNIT_MAX_SIZE))
+		return -EINVAL;
+
+	WRITE_ONCE(ldev->chunk_size, chunk_size);
+	return count;
 }
+static DEVICE_ATTR_RW(chunk_size);
 
-static struct lzom_sg_buf lzom_sg_buf_create_with_buf(size_t len,
-						      char **data_ptr)
+static ssize_t gc_threshold_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
 {
-	size_t vec_cnt = DIV_ROUND_UP(len, PAGE_SIZE) + 1;
-	size_t bvec_mem_len = sizeof(struct bio_vec) * vec_cnt;
-	char *mem, *__data_ptr;
-	struct lzom_sg_buf res;
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(ldev->store.gc_threshold));
+}
 
-	BUG_ON(vec_cnt > BIO_MAX_VECS);
+static ssize_t gc_threshold_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
+	u32 threshold;
+	int ret;
 
-	mem = kzalloc(bvec_mem_len + len, GFP_NOIO);
-	BUG_ON(!mem);
+	ret = kstrtou32(buf, 10, &threshold);
+	if (ret)
+		return ret;
 
-	__data_ptr = mem + bvec_mem_len;
+	/* percent of live data below which a segment is cleaned */
+	if (threshold > 100)
+		return -EINVAL;
 
-	lzom_init_bvec_array((struct bio_vec *)mem, vec_cnt, __data_ptr, len);
+	WRITE_ONCE(ldev->store.gc_threshold, threshold);
+	return count;
+}
+static DEVICE_ATTR_RW(gc_threshold);
 
-	res.bvec = (struct bio_vec *)mem;
-	res.iter.bi_size = len;
+static ssize_t gc_stat_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
+	struct lzom_store *store = &ldev->store;
 
-	*data_ptr = __data_ptr;
-	return res;
+	return sysfs_emit(buf, "%8u %8u %8llu %8llu\n",
+			  READ_ONCE(store->nr_free), store->nr_segs,
+			  (u64)atomic64_read(&store->gc_stat.segs),
+			  (u64)atomic64_read(&store->gc_stat.blocks));
 }
+static DEVICE_ATTR_RO(gc_stat);
 
-static void lzom_sg_buf_destroy_with_buf(struct lzom_sg_buf buf)
+static ssize_t flush_stat_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
 {
-	if (buf.bvec)
-		kfree(buf.bvec);
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
 
-	memset(&buf.iter, 0, sizeof(buf.iter));
+	return sysfs_emit(buf, "%8llu %8llu\n",
+			  (u64)atomic64_read(&ldev->flush_stat.requests),
+			  (u64)atomic64_read(&ldev->flush_stat.commits));
 }
+static DEVICE_ATTR_RO(flush_stat);
 
-static blk_status_t lzom_write_req_submit(struct lzom_req *lreq,
-					  struct bio *original_bio,
-					  struct lzom_dev *ldev)
+static ssize_t dedup_show(struct device *dev, struct device_attribute *attr,
+			  char *buf)
 {
-	struct block_device *bdev = ldev->under_dev.bdev;
-	struct bio *new_bio;
-	struct lzom_sg_buf src;
-	struct lzom_sg_buf dst;
-	struct lzom_buffer *decomp;
-	char *dst_data_ptr;
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
 
-	int bsize = original_bio->bi_iter.bi_size;
-	int ret, lzo_ret;
-	size_t decomp_len;
-	void *wrkmem;
+	return sysfs_emit(buf, "%u\n", READ_ONCE(ldev->dedup));
+}
+
+static ssize_t dedup_store(struct device *dev, struct device_attribute *attr,
+			   const char *buf, size_t count)
+{
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
+	bool dedup;
+	int ret;
 
-	src = lzom_sg_buf_create(original_bio->bi_iter,
-				 original_bio->bi_io_vec);
-	dst = lzom_sg_buf_create_with_buf(lzo_worst_compress(bsize),
-					  &dst_data_ptr);
+	ret = kstrtobool(buf, &dedup);
+	if (ret)
+		return ret;
 
-	wrkmem = kzalloc(LZO1X_1_MEM_COMPRESS, GFP_NOIO);
-	if (!wrkmem) {
-		LZOM_ERRLOG("failed to alloc wrkmem");
-		ret = BLK_STS_RESOURCE;
-		goto err_out;
-	}
+	/* the index is sized by dedup_entries when the device is created */
+	if (dedup && !ldev->dedup_index)
+		return -EOPNOTSUPP;
 
-	lzo_ret = lzom_compress(&src, &dst, wrkmem);
+	WRITE_ONCE(ldev->dedup, dedup);
+	return count;
+}
+static DEVICE_ATTR_RW(dedup);
 
-	if (lzo_ret != LZOM_E_OK) {
-		LZOM_ERRLOG("lzom compress failed: %d", lzo_ret);
-		ret = BLK_STS_IOERR;
-		goto err_out;
-	}
+static ssize_t dedup_stat_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
 
-	decomp = lzom_buffer_alloc(bsize);
-	if (!decomp) {
-		LZOM_ERRLOG("failed to alloc decomp buffer");
-		ret = BLK_STS_RESOURCE;
-		goto err_out;
-	}
+	return sysfs_emit(buf, "%8llu %8llu %8llu\n",
+			  lzom_stat_read(ldev, LZOM_STAT_DEDUP_HITS),
+			  lzom_stat_read(ldev, LZOM_STAT_DEDUP_MISSES),
+			  lzom_stat_read(ldev, LZOM_STAT_DEDUP_COLLISIONS));
+}
+static DEVICE_ATTR_RO(dedup_stat);
 
-	decomp_len = decomp->buf_sz;
-	lzo_ret = lzom_decompress_safe(dst_data_ptr, dst.iter.bi_size,
-				       (unsigned char *)decomp->data,
-				       &decomp_len);
+static ssize_t cache_size_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
 
-	if (lzo_ret != LZOM_E_OK) {
-		LZOM_ERRLOG("lzom decompress failed: %d", lzo_ret);
-		ret = BLK_STS_IOERR;
-		goto err_out;
-	}
+	return sysfs_emit(buf, "%lu\n",
+			  READ_ONCE(ldev->cache.max) << LZOM_BLOCK_SHIFT);
+}
 
-	decomp->data_sz = decomp_len;
+static ssize_t cache_size_store(struct device *dev,
+				struct device_attribute *attr, const char *buf,
+				size_t count)
+{
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
+	unsigned long size;
+	int ret;
 
-	LZOM_LOG("Decompression verified successfully");
+	ret = kstrtoul(buf, 10, &size);
+	if (ret)
+		return ret;
 
-	lreq->buffer = decomp;
+	/* 0 turns the cache off */
+	WRITE_ONCE(ldev->cache.max, size >> LZOM_BLOCK_SHIFT);
+	lzom_cache_trim(&ldev->cache);
+	return count;
+}
+static DEVICE_ATTR_RW(cache_size);
 
-	lzom_sg_buf_destroy_with_buf(dst);
-	kfree(wrkmem);
-	wrkmem = NULL;
+static ssize_t cache_stat_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
 
-	new_bio = bio_alloc(bdev, lzom_bio_size_to_pages(bsize),
-			    original_bio->bi_opf, GFP_NOIO);
-	if (!new_bio) {
-		LZOM_ERRLOG("failed to alloc new bio");
-		ret = BLK_STS_RESOURCE;
-		goto err_out;
-	}
+	return sysfs_emit(buf, "%8llu %8llu %8lu\n",
+			  lzom_stat_read(ldev, LZOM_STAT_CACHE_HITS),
+			  lzom_stat_read(ldev, LZOM_STAT_CACHE_MISSES),
+			  READ_ONCE(ldev->cache.nr));
+}
+static DEVICE_ATTR_RO(cache_stat);
 
-	ret = lzom_add_buf_to_bio(lreq->buffer, bsize, new_bio);
-	if (ret != 0) {
-		LZOM_ERRLOG("failed to add buffer to bio");
-		ret = BLK_STS_IOERR;
-		goto err_out;
-	}
+static ssize_t readahead_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
 
-	new_bio->bi_end_io = lzom_write_req_endio;
-	new_bio->bi_private = lreq;
-	new_bio->bi_iter.bi_sector = original_bio->bi_iter.bi_sector;
+	return sysfs_emit(buf, "%u\n",
+			  READ_ONCE(ldev->ra.max) << LZOM_BLOCK_SHIFT);
+}
 
-	lreq->original_bio = original_bio;
-	lreq->new_bio = new_bio;
+static ssize_t readahead_store(struct device *dev,
+			       struct device_attribute *attr, const char *buf,
+			       size_t count)
+{
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
+	u32 size;
+	int ret;
 
-	submit_bio_noacct(new_bio);
-	return BLK_STS_OK;
+	ret = kstrtou32(buf, 10, &size);
+	if (ret)
+		return ret;
 
-err_out:
-	lzom_sg_buf_destroy_with_buf(dst);
+	/* 0 turns readahead off */
+	WRITE_ONCE(ldev->ra.max, size >> LZOM_BLOCK_SHIFT);
+	return count;
+}
+static DEVICE_ATTR_RW(readahead);
 
-	if (decomp)
-		lzom_buffer_free(decomp);
+static ssize_t readahead_stat_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
 
-	if (lreq->buffer) {
-		lzom_buffer_free(lreq->buffer);
-		lreq->buffer = NULL;
-	}
-	if (new_bio)
-		bio_put(new_bio);
-	if (wrkmem)
-		kfree(wrkmem);
-	return ret;
+	return sysfs_emit(buf, "%8llu %8u\n",
+			  lzom_stat_read(ldev, LZOM_STAT_RA_BLOCKS),
+			  READ_ONCE(ldev->ra.window));
 }
+static DEVICE_ATTR_RO(readahead_stat);
 
-static blk_status_t lzom_read_req_submit(struct lzom_req *lreq,
-					 struct bio *original_bio,
-					 struct lzom_dev *ldev)
+static ssize_t coalesce_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
 {
-	struct block_device *bdev = ldev->under_dev.bdev;
-	struct bio_set *bset = ldev->under_dev.bset;
-	struct bio *new_bio;
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
 
-	new_bio = bio_alloc_clone(bdev, original_bio, GFP_NOIO, bset);
-	if (!new_bio) {
-		LZOM_ERRLOG("failed to clone original bio");
-		return BLK_STS_RESOURCE;
-	}
+	return sysfs_emit(buf, "%u\n",
+			  READ_ONCE(ldev->stage.nr_blocks) << LZOM_BLOCK_SHIFT);
+}
+
+static ssize_t coalesce_store(struct device *dev,
+			      struct device_attribute *attr, const char *buf,
+			      size_t count)
+{
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
+	struct lzom_stage *stage = &ldev->stage;
+	struct request_queue *q = ldev->disk->queue;
+	struct queue_limits lim;
+	u32 size;
+	int ret;
 
-	new_bio->bi_end_io = lzom_read_req_endio;
-	new_bio->bi_private = lreq;
-	new_bio->bi_iter.bi_sector = original_bio->bi_iter.bi_sector;
+	ret = kstrtou32(buf, 10, &size);
+	if (ret)
+		return ret;
 
-	lreq->original_bio = original_bio;
-	lreq->new_bio = new_bio;
+	/* 0 turns coalescing off */
+	if (size && (!is_power_of_2(size) || size < 4 * LZOM_BLOCK_SIZE ||
+		     size > LZOM_UNIT_MAX_SIZE))
+		return -EINVAL;
 
-	submit_bio_noacct(new_bio);
+	/* the unit in flight is sized by nr_blocks too */
+	mutex_lock(&stage->lock);
+	lzom_stage_wait(stage, lzom_stage_commit(ldev));
+	WRITE_ONCE(stage->nr_blocks, size >> LZOM_BLOCK_SHIFT);
+	mutex_unlock(&stage->lock);
+
+	/* writes of whole units compress best, no request sees half of it */
+	blk_mq_freeze_queue(q);
+	lim = queue_limits_start_update(q);
+	lim.io_opt = size ?: LZOM_BLOCK_SIZE;
+	ret = queue_limits_commit_update(q, &lim);
+	blk_mq_unfreeze_queue(q);
+	if (ret)
+		return ret;
 
-	return BLK_STS_OK;
+	return count;
 }
+static DEVICE_ATTR_RW(coalesce);
 
-static void lzom_submit_bio(struct bio *original_bio)
+static const char *const lzom_stage_ack_names[] = {
+	[LZOM_STAGE_ACK_IMMEDIATE] = "immediate",
+	[LZOM_STAGE_ACK_COMMIT] = "commit",
+};
+
+static ssize_t coalesce_ack_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
 {
-	struct lzom_dev *ldev = original_bio->bi_bdev->bd_disk->private_data;
-	struct lzom_req *lreq;
-	enum req_op op_type = bio_op(original_bio);
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
 
-	if (!ldev || !ldev->under_dev.bdev) {
-		LZOM_ERRLOG("invalid device context");
-		goto submit_bio_with_err;
-	}
+	return sysfs_emit(buf, "%s\n",
+			  lzom_stage_ack_names[READ_ONCE(ldev->stage.ack)]);
+}
 
-	lreq = lzom_req_alloc();
-	if (!lreq) {
-		goto submit_bio_with_err;
-	}
+static ssize_t coalesce_ack_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
+	int ack;
 
-	switch (op_type) {
-	case REQ_OP_WRITE:
-		if (lzom_write_req_submit(lreq, original_bio, ldev) ==
-		    BLK_STS_OK)
-			return;
-		goto submit_bio_with_err_free_req;
+	ack = sysfs_match_string(lzom_stage_ack_names, buf);
+	if (ack < 0)
+		return ack;
 
-	case REQ_OP_READ:
-		if (lzom_read_req_submit(lreq, original_bio, ldev) ==
-		    BLK_STS_OK)
-			return;
-		goto submit_bio_with_err_free_req;
+	mutex_lock(&ldev->stage.lock);
+	ldev->stage.ack = ack;
+	mutex_unlock(&ldev->stage.lock);
 
-	default:
-		LZOM_ERRLOG("unsupported request operation");
-		goto submit_bio_with_err;
-	}
+	return count;
+}
+static DEVICE_ATTR_RW(coalesce_ack);
 
-submit_bio_with_err:
-	bio_io_error(original_bio);
-submit_bio_with_err_free_req:
-	lzom_req_free(lreq);
-	bio_io_error(original_bio);
+static ssize_t coalesce_stat_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct lzom_dev *ldev = dev_to_disk(dev)->private_data;
+	struct lzom_stage_stat *stat = &ldev->stage.stat;
+
+	return sysfs_emit(buf, "%8llu %8llu %8llu %8llu\n",
+			  (u64)atomic64_read(&stat->units),
+			  (u64)atomic64_read(&stat->blocks),
+			  (u64)atomic64_read(&stat->sectors),
+			  (u64)atomic64_read(&stat->errors));
 }
+static DEVICE_ATTR_RO(coalesce_stat);
+
+static struct attribute *lzom_dev_attrs[] = {
+	&dev_attr_bitstream_version.attr,
+	&dev_attr_verify.attr,
+	&dev_attr_verify_sample.attr,
+	&dev_attr_verify_stat.attr,
+	&dev_attr_perf_stat.attr,
+	&dev_attr_latency.attr,
+	&dev_attr_latency_hist.attr,
+	&dev_attr_pipeline_depth.attr,
+	&dev_attr_pipeline_workers.attr,
+	&dev_attr_chunk_size.attr,
+	&dev_attr_gc_threshold.attr,
+	&dev_attr_gc_stat.attr,
+	&dev_attr_flush_stat.attr,
+	&dev_attr_dedup.attr,
+	&dev_attr_dedup_stat.attr,
+	&dev_attr_cache_size.attr,
+	&dev_attr_cache_stat.attr,
+	&dev_attr_readahead.attr,
+	&dev_attr_readahead_stat.attr,
+	&dev_attr_coalesce.attr,
+	&dev_attr_coalesce_ack.attr,
+	&dev_attr_coalesce_stat.attr,
+	NULL,
+};
 
-static const struct block_device_operations lzom_fops = {
-	.owner = THIS_MODULE,
-	.submit_bio = lzom_submit_bio,
+static const struct attribute_group lzom_dev_attr_group = {
+	.name = "lzom",
+	.attrs = lzom_dev_attrs,
+};
+
+static const struct attribute_group *lzom_dev_attr_groups[] = {
+	&lzom_dev_attr_group,
+	NULL,
 };
 
 static int lzom_new_minor_get(void)
@@ -425,34 +3468,103 @@ static int lzom_dev_register(int major, int minor, struct lzom_dev *ldev)
 
 	disk->flags |= GENHD_FL_NO_PART;
 
-	set_capacity(disk, get_capacity(ldev->under_dev.bdev->bd_disk));
+	set_capacity(disk, ldev->store.nr_blocks << (LZOM_BLOCK_SHIFT -
+						      SECTOR_SHIFT));
 
 	snprintf(disk->disk_name, DISK_NAME_LEN, "lzom%d", disk->first_minor);
 
-	return add_disk(ldev->disk);
+	return device_add_disk(NULL, ldev->disk, lzom_dev_attr_groups);
 }
 
 static void lzom_dev_deinit(struct lzom_dev *ldev)
 {
-	if (ldev->disk)
+	lzom_dev_ra_drain(ldev);
+	lzom_dev_stage_free(ldev);
+	lzom_dev_pipeline_free(ldev);
+
+	/* also runs on a half initialized device, possibly twice */
+	if (ldev->disk) {
 		put_disk(ldev->disk);
+		ldev->disk = NULL;
+	}
+
+	if (ldev->tag_set.ops) {
+		blk_mq_free_tag_set(&ldev->tag_set);
+		ldev->tag_set.ops = NULL;
+	}
+
+	if (ldev->store.map) {
+		lzom_store_close(&ldev->store);
+	}
 
-	if (ldev->under_dev.bdev_fl)
+	if (ldev->under_dev.bdev_fl) {
 		bdev_fput(ldev->under_dev.bdev_fl);
+		ldev->under_dev.bdev_fl = NULL;
+	}
 
 	if (ldev->under_dev.bset) {
 		bioset_exit(ldev->under_dev.bset);
 		kfree(ldev->under_dev.bset);
+		ldev->under_dev.bset = NULL;
 	}
 
+	lzom_dev_ws_free(ldev);
+	lzom_dev_dedup_free(ldev);
+	lzom_dev_cache_free(ldev);
+
+	free_percpu(ldev->stats);
+	ldev->stats = NULL;
+
+	mempool_exit(&ldev->page_pool);
+	mutex_destroy(&ldev->page_pool_lock);
+	mempool_exit(&ldev->unit_pool);
+
 	LZOM_LOG("device deinitialized");
 }
 
+static int lzom_dev_tag_set_init(struct lzom_dev *ldev)
+{
+	struct blk_mq_tag_set *set = &ldev->tag_set;
+	int ret;
+
+	set->ops = &lzom_mq_ops;
+	set->nr_hw_queues = lzom.nr_hw_queues ?: num_online_cpus();
+	set->queue_depth = lzom.queue_depth;
+	set->numa_node = NUMA_NO_NODE;
+	set->cmd_size = sizeof(struct lzom_cmd);
+	/* compression may wait for pool pages and chunk workers */
+	set->flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+	set->driver_data = ldev;
+
+	ret = blk_mq_alloc_tag_set(set);
+	if (ret)
+		set->ops = NULL;
+
+	return ret;
+}
+
 static int lzom_dev_init(const char *path, struct lzom_dev *ldev)
 {
+	/*
+	 * The map works in whole blocks. Requests stay within BIO_MAX_VECS
+	 * segments so that every part of one maps onto a single lower bio.
+	 */
+	struct queue_limits lim = {
+		.logical_block_size = LZOM_BLOCK_SIZE,
+		.physical_block_size = LZOM_BLOCK_SIZE,
+		.io_min = LZOM_BLOCK_SIZE,
+		.io_opt = LZOM_BLOCK_SIZE,
+		.max_hw_sectors = LZOM_IO_MAX_SECTORS,
+		.max_segments = BIO_MAX_VECS,
+		.max_hw_discard_sectors = LZOM_UNMAP_MAX_SECTORS,
+		.discard_granularity = LZOM_BLOCK_SIZE,
+		.max_write_zeroes_sectors = LZOM_UNMAP_MAX_SECTORS,
+		.features = BLK_FEAT_WRITE_CACHE | BLK_FEAT_FUA,
+	};
 	struct file *fbdev;
 	struct block_device *bdev;
 	struct bio_set *bset;
+	int ret;
 
 	memset(ldev, 0, sizeof(*ldev));
 
@@ -467,6 +3579,20 @@ static int lzom_dev_init(const char *path, struct lzom_dev *ldev)
 
 	ldev->under_dev.bdev = bdev;
 	ldev->under_dev.bdev_fl = fbdev;
+	ldev->verify_sample = LZOM_VERIFY_SAMPLE_DEFAULT;
+	lzom_dev_ra_init(ldev);
+	lzom_dev_stage_init(ldev);
+	spin_lock_init(&ldev->flush_lock);
+	INIT_LIST_HEAD(&ldev->flush_cmds);
+	INIT_WORK(&ldev->flush_work, lzom_flush_work_fn);
+
+	ret = lzom_store_open(&ldev->store, bdev, lzom.format);
+	if (ret) {
+		LZOM_ERRLOG("failed to open the store: %d", ret);
+		goto err;
+	}
+
+	ret = -ENOMEM;
 
 	bset = kzalloc(sizeof(*bset), GFP_KERNEL);
 	if (!bset) {
@@ -474,13 +3600,68 @@ static int lzom_dev_init(const char *path, struct lzom_dev *ldev)
 		goto err;
 	}
 
-	bioset_init(bset, POOL_SIZE, 0, BIOSET_NEED_BVECS);
 	ldev->under_dev.bset = bset;
+	if (bioset_init(bset, POOL_SIZE, offsetof(struct lzom_req, bio),
+			BIOSET_NEED_BVECS)) {
+		LZOM_ERRLOG("failed to initialize bioset");
+		goto err;
+	}
 	LZOM_LOG("bioset initialized");
 
-	ldev->disk = blk_alloc_disk(NULL, NUMA_NO_NODE);
-	if (!ldev->disk) {
+	/* enough for one bio of BIO_MAX_VECS pages to make progress */
+	mutex_init(&ldev->page_pool_lock);
+	if (mempool_init_page_pool(&ldev->page_pool, BIO_MAX_VECS, 0)) {
+		LZOM_ERRLOG("failed to initialize page pool");
+		goto err;
+	}
+
+	if (mempool_init_kmalloc_pool(&ldev->unit_pool, LZOM_UNIT_POOL_MIN,
+				      sizeof(struct lzom_unit_pages))) {
+		LZOM_ERRLOG("failed to initialize unit pool");
+		goto err;
+	}
+
+	ldev->stats = alloc_percpu(struct lzom_stats);
+	if (!ldev->stats) {
+		LZOM_ERRLOG("failed to allocate per-cpu stats");
+		goto err;
+	}
+
+	if (lzom_dev_tag_set_init(ldev)) {
+		LZOM_ERRLOG("failed to allocate tag set");
+		goto err;
+	}
+
+	ldev->disk = blk_mq_alloc_disk(&ldev->tag_set, &lim, ldev);
+	if (IS_ERR(ldev->disk)) {
 		LZOM_ERRLOG("failed to allocate disk");
+		ldev->disk = NULL;
+		goto err;
+	}
+
+	/* big enough for a whole unit */
+	if (lzom_dev_ws_alloc(ldev, LZOM_UNIT_MAX_SIZE)) {
+		LZOM_ERRLOG("failed to allocate per-cpu workspaces");
+		goto err;
+	}
+
+	if (lzom_dev_dedup_alloc(ldev, lzom.dedup_entries)) {
+		LZOM_ERRLOG("failed to allocate dedup index");
+		goto err;
+	}
+
+	if (lzom_dev_cache_alloc(ldev)) {
+		LZOM_ERRLOG("failed to allocate block cache");
+		goto err;
+	}
+
+	if (lzom_dev_stage_alloc(ldev)) {
+		LZOM_ERRLOG("failed to allocate coalescing buffer");
+		goto err;
+	}
+
+	if (lzom_dev_pipeline_alloc(ldev)) {
+		LZOM_ERRLOG("failed to allocate pipeline");
 		goto err;
 	}
 
@@ -489,7 +3670,7 @@ static int lzom_dev_init(const char *path, struct lzom_dev *ldev)
 
 err:
 	lzom_dev_deinit(ldev);
-	return -ENOMEM;
+	return ret;
 }
 
 static void lzom_path_remove(void)
@@ -591,6 +3772,21 @@ static const struct kernel_param_ops lzom_blk = {
 MODULE_PARM_DESC(path, "Path to the module");
 module_param_cb(path, &lzom_blk, NULL, S_IRUGO | S_IWUSR);
 
+MODULE_PARM_DESC(nr_hw_queues,
+		 "Number of hardware queues, 0 for one per online CPU");
+module_param_named(nr_hw_queues, lzom.nr_hw_queues, uint, S_IRUGO | S_IWUSR);
+
+MODULE_PARM_DESC(queue_depth, "Tags per hardware queue");
+module_param_named(queue_depth, lzom.queue_depth, uint, S_IRUGO | S_IWUSR);
+
+MODULE_PARM_DESC(format, "Format a device that has no lzom superblock");
+module_param_named(format, lzom.format, bool, S_IRUGO | S_IWUSR);
+
+MODULE_PARM_DESC(dedup_entries,
+		 "Blocks the dedup index of a new device remembers, 0 for no index");
+module_param_named(dedup_entries, lzom.dedup_entries, uint,
+		   S_IRUGO | S_IWUSR);
+
 static int __init lzom_init(void)
 {
 	lzom.major = register_blkdev(0, LZOM_NAME);
@@ -1,36 +1,355 @@
 #ifndef LZOM_MODULE
 #define LZOM_MODULE
 
+#include "lzom_store.h"
+
+#define LZOM_NAME "lzom_module"
+
+#define LZOM_LOG(fmt, ...) \
+	pr_info("%s[inf] " fmt "\n", LZOM_NAME, ##__VA_ARGS__)
+
+#define LZOM_ERRLOG(fmt, ...) \
+	pr_err("%s[err] " fmt "\n", LZOM_NAME, ##__VA_ARGS__)
+
 struct underlying_dev {
 	struct block_device *bdev;
 	struct file *bdev_fl;
 	struct bio_set *bset;
 };
 
+/*
+ * Scratch memory for compressing or decompressing one unit of up to
+ * unit_size bytes. src_segs index the plain side, out_segs the compressed
+ * side, verify holds the plain data decompressed back from out.
+ */
+struct lzom_ws {
+	size_t unit_size;
+	void *wrkmem;
+	char *out;
+	size_t out_len;
+	struct bio_vec *out_bvec;
+	struct lzom_sg_seg *out_segs;
+	unsigned int out_vecs;
+	struct lzom_sg_seg *src_segs;
+	unsigned int nr_src_segs;
+	char *verify;
+};
+
+enum lzom_verify_mode {
+	LZOM_VERIFY_OFF,
+	LZOM_VERIFY_ALWAYS,
+	LZOM_VERIFY_SAMPLE,
+};
+
+#define LZOM_VERIFY_SAMPLE_DEFAULT 1024
+
+/*
+ * Event counters of the I/O paths. Every CPU counts into its own copy,
+ * they are only summed up when read. Requests in flight are the started
+ * ones less the completed and requeued ones, a requeued request starts
+ * again.
+ */
+enum lzom_stat_item {
+	LZOM_STAT_STARTED,
+	LZOM_STAT_COMPLETED,
+	LZOM_STAT_REQUEUED, /* short of memory, retried later */
+	LZOM_STAT_BYTES_IN, /* plain bytes written */
+	LZOM_STAT_BYTES_OUT, /* what they take on the lower device */
+	LZOM_STAT_COMPRESSED, /* blocks stored compressed */
+	LZOM_STAT_RAW, /* blocks stored raw */
+	LZOM_STAT_ALLOC_FAILS,
+	LZOM_STAT_COMPRESS_NS,
+	LZOM_STAT_DECOMPRESS_NS,
+	LZOM_STAT_VERIFY_CHECKED,
+	LZOM_STAT_VERIFY_MISMATCHED,
+	LZOM_STAT_DEDUP_HITS,
+	LZOM_STAT_DEDUP_MISSES,
+	LZOM_STAT_DEDUP_COLLISIONS, /* same hash, different content */
+	LZOM_STAT_CACHE_HITS,
+	LZOM_STAT_CACHE_MISSES,
+	LZOM_STAT_RA_BLOCKS, /* prefetched into the cache */
+	NR_LZOM_STATS,
+};
+
+/*
+ * Stages of the write and read paths timed into log2 latency histograms:
+ * bucket i counts the stages that took [2^i, 2^(i+1)) ns, the last one
+ * also everything slower.
+ */
+enum lzom_lat_stage {
+	LZOM_LAT_WRITE_ALLOC, /* workspace, bio and page allocation */
+	LZOM_LAT_WRITE_COMPRESS,
+	LZOM_LAT_WRITE_VERIFY,
+	LZOM_LAT_WRITE_SUBMIT, /* building and submitting the lower bio */
+	LZOM_LAT_WRITE_LOWER, /* lower device, submission to completion */
+	LZOM_LAT_READ_ALLOC,
+	LZOM_LAT_READ_LOWER,
+	LZOM_LAT_READ_DECOMPRESS,
+	NR_LZOM_LAT,
+};
+
+#define LZOM_LAT_BUCKETS 32
+
+struct lzom_stats {
+	u64 items[NR_LZOM_STATS];
+	u64 lat[NR_LZOM_LAT][LZOM_LAT_BUCKETS];
+};
+
+/*
+ * Index of recently written blocks by the hash of their content, so that
+ * a block written again anywhere can map the stored copy. Fixed size, each
+ * bucket keeps its LZOM_DEDUP_WAYS most recently used blocks.
+ */
+#define LZOM_DEDUP_WAYS 4
+#define LZOM_DEDUP_ENTRIES_DEFAULT (1U << 16)
+
+struct lzom_dedup_slot {
+	u64 hash;
+	u64 lba;
+	u64 entry;
+};
+
+struct lzom_dedup_bucket {
+	spinlock_t lock;
+	struct lzom_dedup_slot slots[LZOM_DEDUP_WAYS];
+};
+
+/*
+ * A block written while the copy the index found for it was not cached,
+ * compared with that copy on chunk_wq once it is stored.
+ */
+struct lzom_dedup_job {
+	struct work_struct work;
+	struct lzom_dev *ldev;
+	u64 lba;
+	u64 entry;
+	struct lzom_dedup_slot found;
+};
+
+/*
+ * Decompressed copies of recently read and written blocks by lba. A copy
+ * is only good while the map still holds its entry from the same
+ * generation of the segment, stale ones are dropped by eviction. The
+ * xarray lock also guards the lru, readers only take rcu.
+ */
+#define LZOM_CACHE_SIZE_DEFAULT (32U << 20)
+
+struct lzom_cache_ent {
+	struct list_head lru;
+	struct rcu_head rcu;
+	u64 lba;
+	u64 entry;
+	u32 gen;
+	bool referenced;
+	struct page *page;
+};
+
+struct lzom_cache {
+	struct xarray blocks;
+	struct list_head lru;
+	unsigned long nr;
+	unsigned long max;
+	struct shrinker *shrinker;
+};
+
+/*
+ * Sequential read detector. A read that starts where the previous one
+ * ended doubles the window, anything else halves it. The blocks ahead are
+ * read and decompressed into the cache, at most window blocks at a time.
+ */
+#define LZOM_RA_MIN_BLOCKS 4
+#define LZOM_RA_SIZE_DEFAULT (256U << 10)
+
+struct lzom_ra {
+	spinlock_t lock;
+	u64 next; /* where a sequential read would start */
+	u64 end; /* prefetched up to here */
+	unsigned int window; /* in blocks */
+	unsigned int max;
+	atomic_t inflight;
+};
+
+/*
+ * Write coalescing. Writes are copied into the open unit, an aligned run
+ * of nr_blocks blocks, which is compressed as one extent when it fills,
+ * when a write leaves it, after LZOM_STAGE_TIMEOUT and on flush. A
+ * committed unit is compressed and written out in the background while
+ * writes go on into the other buffer, and stays readable until the map
+ * has its blocks. The lock serializes writers and commits, read_lock
+ * guards the staged blocks against readers and the commit status. With
+ * LZOM_STAGE_ACK_COMMIT writes complete once their unit is in the map,
+ * otherwise once they are staged.
+ */
+#define LZOM_STAGE_TIMEOUT (HZ / 10)
+
+enum lzom_stage_ack {
+	LZOM_STAGE_ACK_IMMEDIATE,
+	LZOM_STAGE_ACK_COMMIT,
+};
+
+struct lzom_stage_stat {
+	atomic64_t units; /* extents written */
+	atomic64_t blocks; /* blocks in them */
+	atomic64_t sectors; /* sectors they take */
+	atomic64_t errors;
+};
+
+struct lzom_stage_buf {
+	u64 base;
+	DECLARE_BITMAP(present, LZOM_UNIT_MAX_BLOCKS);
+	struct page *pages[LZOM_UNIT_MAX_BLOCKS];
+	/* writes waiting for the commit */
+	struct request *rqs[LZOM_UNIT_MAX_BLOCKS];
+	unsigned int nr_rqs;
+};
+
+struct lzom_stage {
+	struct mutex lock;
+	spinlock_t read_lock;
+	unsigned int nr_blocks; /* 0 when coalescing is off */
+	u8 ack;
+	struct lzom_stage_buf bufs[2];
+	struct lzom_stage_buf *open; /* takes the writes */
+	struct lzom_stage_buf *busy; /* being committed, NULL if none */
+	/* the busy unit compressed, each run of blocks at its own index */
+	struct page *out[LZOM_UNIT_MAX_BLOCKS];
+	struct bio_vec src_bvec[LZOM_UNIT_MAX_BLOCKS];
+	struct bio_vec out_bvec[LZOM_UNIT_MAX_BLOCKS];
+	atomic_t pending; /* runs of the busy unit in flight, plus one */
+	blk_status_t busy_status;
+	u64 seq; /* commits started */
+	u64 done; /* commits in the map */
+	struct work_struct commit_work;
+	blk_status_t status; /* first failed commit since the last flush */
+	struct delayed_work work;
+	struct lzom_stage_stat stat;
+};
+
+struct lzom_flush_stat {
+	atomic64_t requests; /* flushes and FUA writes */
+	atomic64_t commits; /* map syncs that completed them */
+};
+
+/* per-CPU list of writes waiting for a pipeline worker */
+struct lzom_queue {
+	spinlock_t lock;
+	struct list_head cmds;
+	struct work_struct work;
+	struct lzom_dev *ldev;
+};
+
+struct lzom_chunk_job {
+	struct work_struct work;
+	struct lzom_chunked *chunked;
+};
+
+/*
+ * A write request whose blocks are compressed and submitted as nr_chunks
+ * units by as many jobs. The first unit takes head blocks, up to the next
+ * multiple of chunk_blocks on the device, the others up to chunk_blocks.
+ */
+struct lzom_chunked {
+	struct lzom_dev *ldev;
+	struct request *rq;
+	bool verify;
+	unsigned int chunk_blocks;
+	unsigned int head;
+	unsigned int nr_chunks;
+	atomic_t remaining;
+	struct completion done;
+	blk_status_t status;
+	struct lzom_chunk_job jobs[];
+};
+
+/* the members of one unit decompressed on their way to the cache */
+struct lzom_unit_pages {
+	struct page *pages[LZOM_UNIT_MAX_BLOCKS];
+	struct bio_vec bvec[LZOM_UNIT_MAX_BLOCKS];
+};
+
+#define LZOM_UNIT_POOL_MIN 4
+
 struct lzom_dev {
 	struct gendisk *disk;
+	struct blk_mq_tag_set tag_set;
 	struct underlying_dev under_dev;
+	struct lzom_store store;
+	struct lzom_ws __percpu *ws;
+	mempool_t page_pool;
+	struct mutex page_pool_lock;
+	/* pages of units decompressed on reads, see struct lzom_unit_pages */
+	mempool_t unit_pool;
+	u8 bitstream_version;
+	u8 verify_mode;
+	u32 verify_sample;
+	struct lzom_stats __percpu *stats;
+	bool latency; /* time the stages into the histograms */
+	struct workqueue_struct *wq;
+	struct lzom_queue __percpu *queues;
+	atomic_t queued;
+	u32 pipeline_depth;
+	u32 pipeline_workers;
+	/* chunk jobs and stage commits */
+	struct workqueue_struct *chunk_wq;
+	u32 chunk_size;
+	/* read completions, stage commits and flushes */
+	struct workqueue_struct *io_wq;
+	/* flushes and FUA writes waiting for the next map sync */
+	spinlock_t flush_lock;
+	struct list_head flush_cmds;
+	struct work_struct flush_work;
+	struct lzom_flush_stat flush_stat;
+	bool dedup;
+	struct lzom_dedup_bucket *dedup_index;
+	unsigned int dedup_buckets;
+	struct lzom_cache cache;
+	struct lzom_ra ra;
+	struct lzom_stage stage;
 };
 
 struct lzom_module_g {
 	int major;
 	int free_minor;
 	char *dev_path;
+	unsigned int nr_hw_queues;
+	unsigned int queue_depth;
+	bool format;
+	unsigned int dedup_entries;
 	struct lzom_dev dev;
 };
 
-struct lzom_req {
-	struct bio *original_bio;
-	struct bio *new_bio;
-	struct lzom_buffer *buffer;
+/*
+ * blk-mq pdu of every request. A request is split into one lower bio per
+ * block, remaining counts them plus the submitter's reference.
+ */
+struct lzom_cmd {
+	struct list_head node;
+	struct bio_vec *bvec;
+	struct lzom_sg_buf payload;
+	atomic_t remaining;
+	blk_status_t status;
 };
 
-struct lzom_buffer {
-	u32 data_sz;
-	u32 buf_sz;
-	char *data;
+/*
+ * Lives in the front_pad of under_dev.bset, in front of the lower bio. rq
+ * is NULL for readahead and stage commits. A read covers nr blocks from
+ * lba, the members of one unit from entry on, a unit write nr blocks from
+ * lba. A stage commit writes the nr blocks from index off of the busy
+ * stage buffer.
+ */
+struct lzom_req {
+	struct request *rq;
+	struct lzom_dev *ldev;
+	u64 lba;
+	u64 entry;
+	u64 hash; /* of the plain block for the dedup index, 0 if none */
+	struct lzom_dedup_job *dedup; /* queued once the block is stored */
+	u32 gen;
+	unsigned int off;
+	unsigned int nr;
+	u64 start; /* submission time for the histograms, 0 if not timed */
+	struct work_struct work;
+	struct bio bio;
 };
 
-int lzom_copy_from_bio_to_buf(struct bio *bio, struct lzom_buffer *buf);
-
 #endif // LZOM_MODULE
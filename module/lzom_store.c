@@ -0,0 +1,1186 @@
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/crc32.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/sched/mm.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#include "lzom_extend.h"
+#include "lzom_sg_helpers.h"
+
+#include "lzom_module.h"
+#include "lzom_store.h"
+
+/* ----------------- sync io -----------------*/
+/*
+ * @buf is page aligned, kmalloc'ed or vmalloc'ed, @len is in whole sectors.
+ * Map syncs and the cleaner run while writes to the device wait for them,
+ * so nothing here may recurse into reclaim that writes to it.
+ */
+static int lzom_store_io(struct lzom_store *store, sector_t sector, void *buf,
+			 size_t len, blk_opf_t opf)
+{
+	while (len) {
+		unsigned int nr_pages = min_t(size_t, DIV_ROUND_UP(len, PAGE_SIZE),
+					      BIO_MAX_VECS);
+		struct bio *bio;
+		unsigned int i;
+		int ret;
+
+		bio = bio_alloc(store->bdev, nr_pages, opf, GFP_NOIO);
+		bio->bi_iter.bi_sector = sector;
+
+		for (i = 0; i < nr_pages; i++) {
+			unsigned int n = min_t(size_t, len, PAGE_SIZE);
+			struct page *page = is_vmalloc_addr(buf) ?
+						    vmalloc_to_page(buf) :
+						    virt_to_page(buf);
+
+			__bio_add_page(bio, page, n, 0);
+			buf += n;
+			len -= n;
+			sector += n >> SECTOR_SHIFT;
+		}
+
+		ret = submit_bio_wait(bio);
+		bio_put(bio);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* ----------------- superblock -----------------*/
+static u32 lzom_sb_csum(const struct lzom_sb *sb)
+{
+	return crc32_le(~0, (const unsigned char *)sb,
+			offsetof(struct lzom_sb, csum));
+}
+
+static void lzom_sb_fill(struct lzom_store *store, struct lzom_sb *sb)
+{
+	memset(sb, 0, sizeof(*sb));
+	sb->magic = cpu_to_le64(LZOM_SB_MAGIC);
+	sb->version = cpu_to_le32(LZOM_SB_VERSION);
+	sb->block_size = cpu_to_le32(LZOM_BLOCK_SIZE);
+	sb->nr_blocks = cpu_to_le64(store->nr_blocks);
+	sb->map_start = cpu_to_le64(store->map_start);
+	sb->map_sectors = cpu_to_le64(store->map_sectors);
+	sb->data_start = cpu_to_le64(store->data_start);
+	sb->data_sectors = cpu_to_le64(store->data_sectors);
+	sb->seg_sectors = cpu_to_le32(LZOM_SEG_SECTORS);
+	sb->csum = cpu_to_le32(lzom_sb_csum(sb));
+}
+
+static int lzom_sb_parse(struct lzom_store *store, const struct lzom_sb *sb)
+{
+	sector_t nr_sectors = bdev_nr_sectors(store->bdev);
+
+	if (le32_to_cpu(sb->csum) != lzom_sb_csum(sb)) {
+		LZOM_ERRLOG("superblock checksum mismatch");
+		return -EINVAL;
+	}
+
+	if (le32_to_cpu(sb->version) != LZOM_SB_VERSION ||
+	    le32_to_cpu(sb->block_size) != LZOM_BLOCK_SIZE ||
+	    le32_to_cpu(sb->seg_sectors) != LZOM_SEG_SECTORS) {
+		LZOM_ERRLOG("unsupported superblock version %u, block size %u, segment %u",
+			    le32_to_cpu(sb->version),
+			    le32_to_cpu(sb->block_size),
+			    le32_to_cpu(sb->seg_sectors));
+		return -EINVAL;
+	}
+
+	store->nr_blocks = le64_to_cpu(sb->nr_blocks);
+	store->map_start = le64_to_cpu(sb->map_start);
+	store->map_sectors = le64_to_cpu(sb->map_sectors);
+	store->data_start = le64_to_cpu(sb->data_start);
+	store->data_sectors = le64_to_cpu(sb->data_sectors);
+
+	if (store->map_sectors << SECTOR_SHIFT <
+		    store->nr_blocks * sizeof(__le64) ||
+	    store->data_start + store->data_sectors > nr_sectors ||
+	    store->data_sectors < store->nr_blocks * LZOM_BLOCK_SECTORS ||
+	    !IS_ALIGNED(store->data_sectors, LZOM_SEG_SECTORS)) {
+		LZOM_ERRLOG("superblock does not fit the device");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Sizes the map and the segments for the device. An eighth of the
+ * segments, and at least the cleaner's reserve, is kept spare so that
+ * the cleaner always finds dead space to compact, even if nothing
+ * compresses.
+ */
+static int lzom_store_layout(struct lzom_store *store)
+{
+	sector_t nr_sectors = bdev_nr_sectors(store->bdev);
+	u64 nr_segs, nr_spare, nr_blocks = U64_MAX;
+	sector_t map_sectors = 0, data_start = LZOM_SB_SECTORS;
+
+	for (;;) {
+		u64 fit;
+
+		if (nr_sectors <= data_start)
+			return -ENOSPC;
+
+		nr_segs = (nr_sectors - data_start) >> LZOM_SEG_SHIFT;
+		nr_spare = max_t(u64, nr_segs / 8, LZOM_GC_RESERVE + 2);
+		if (nr_segs <= nr_spare)
+			return -ENOSPC;
+
+		fit = (nr_segs - nr_spare) << (LZOM_SEG_SHIFT + SECTOR_SHIFT -
+					       LZOM_BLOCK_SHIFT);
+		if (fit >= nr_blocks)
+			break;
+
+		/* a smaller map can only make room for more segments */
+		nr_blocks = fit;
+		map_sectors = round_up(nr_blocks * sizeof(__le64),
+				       LZOM_BLOCK_SIZE) >> SECTOR_SHIFT;
+		data_start = round_up(LZOM_SB_SECTORS + map_sectors,
+				      LZOM_SEG_SECTORS);
+	}
+
+	store->nr_blocks = nr_blocks;
+	store->map_start = LZOM_SB_SECTORS;
+	store->map_sectors = map_sectors;
+	store->data_start = data_start;
+	store->data_sectors = nr_segs << LZOM_SEG_SHIFT;
+	return 0;
+}
+
+static int lzom_store_format(struct lzom_store *store, struct lzom_sb *sb)
+{
+	int ret;
+
+	ret = lzom_store_layout(store);
+	if (ret) {
+		LZOM_ERRLOG("device is too small");
+		return ret;
+	}
+
+	ret = blkdev_issue_zeroout(store->bdev, store->map_start,
+				   store->map_sectors, GFP_KERNEL, 0);
+	if (ret) {
+		LZOM_ERRLOG("failed to clear the map: %d", ret);
+		return ret;
+	}
+
+	lzom_sb_fill(store, sb);
+	ret = lzom_store_io(store, 0, sb, LZOM_SB_SECTORS << SECTOR_SHIFT,
+			    REQ_OP_WRITE | REQ_PREFLUSH | REQ_FUA);
+	if (ret) {
+		LZOM_ERRLOG("failed to write superblock: %d", ret);
+		return ret;
+	}
+
+	LZOM_LOG("formatted %llu blocks", store->nr_blocks);
+	return 0;
+}
+
+/* ----------------- segments -----------------*/
+static u32 lzom_seg_of(struct lzom_store *store, sector_t sector)
+{
+	return (sector - store->data_start) >> LZOM_SEG_SHIFT;
+}
+
+static sector_t lzom_seg_start(struct lzom_store *store, u32 seg)
+{
+	return store->data_start + ((sector_t)seg << LZOM_SEG_SHIFT);
+}
+
+static unsigned int lzom_gc_bucket(u32 live)
+{
+	return min_t(u32, live >> LZOM_GC_BUCKET_SHIFT, LZOM_GC_BUCKETS - 1);
+}
+
+/*
+ * Files @seg in the cleaner's index by its live sectors, or takes it out
+ * unless it is full. Rechecks live after each move, so that an update
+ * that saw the old bucket and left it alone is not lost.
+ */
+static void lzom_seg_file(struct lzom_store *store, u32 seg)
+{
+	struct lzom_seg *s = &store->segs[seg];
+	unsigned long flags;
+
+	spin_lock_irqsave(&store->gc_lock, flags);
+	for (;;) {
+		unsigned int bucket = LZOM_GC_BUCKETS;
+
+		if (READ_ONCE(s->state) == LZOM_SEG_FULL)
+			bucket = lzom_gc_bucket(atomic_read(&s->live));
+		if (bucket == s->bucket)
+			break;
+
+		if (s->bucket < LZOM_GC_BUCKETS)
+			clear_bit(seg, store->gc_buckets[s->bucket]);
+		if (bucket < LZOM_GC_BUCKETS)
+			set_bit(seg, store->gc_buckets[bucket]);
+		WRITE_ONCE(s->bucket, bucket);
+		smp_mb();
+	}
+	spin_unlock_irqrestore(&store->gc_lock, flags);
+}
+
+static void lzom_seg_set_state(struct lzom_store *store, u32 seg, u8 state)
+{
+	WRITE_ONCE(store->segs[seg].state, state);
+	/* pairs with atomic_add_return() in lzom_seg_add() */
+	smp_mb();
+	lzom_seg_file(store, seg);
+}
+
+static struct lzom_seg_sum *lzom_sum_alloc(u32 max)
+{
+	struct lzom_seg_sum *sum;
+	unsigned int noio_flags = memalloc_noio_save();
+
+	sum = kvmalloc(struct_size(sum, recs, max), GFP_KERNEL);
+	memalloc_noio_restore(noio_flags);
+	if (sum) {
+		sum->nr = 0;
+		sum->max = max;
+	}
+	return sum;
+}
+
+/* notes in the summary of @seg that @nr_blocks from @lba went there */
+static void lzom_sum_add(struct lzom_store *store, u32 seg, u64 lba,
+			 unsigned int nr_blocks)
+{
+	struct lzom_seg_sum *sum = store->segs[seg].sum;
+
+	lockdep_assert_held(&store->alloc_lock);
+
+	if (sum && !WARN_ON_ONCE(sum->nr == sum->max))
+		sum->recs[sum->nr++] = lzom_sum_rec(lba, nr_blocks);
+}
+
+/* puts a full size summary aside for the next segment that opens */
+static void lzom_sum_refill(struct lzom_store *store)
+{
+	struct lzom_seg_sum *sum;
+
+	if (READ_ONCE(store->sum_spare))
+		return;
+
+	sum = lzom_sum_alloc(LZOM_SEG_SECTORS);
+
+	spin_lock(&store->alloc_lock);
+	if (!store->sum_spare)
+		swap(store->sum_spare, sum);
+	spin_unlock(&store->alloc_lock);
+
+	kvfree(sum);
+}
+
+/*
+ * Shrinks the summary of the just closed @seg to its records and keeps
+ * the full size one as the spare. Nothing is added to a closed segment,
+ * only a reclaim may take the summary away meanwhile.
+ */
+static void lzom_sum_trim(struct lzom_store *store, u32 seg)
+{
+	struct lzom_seg_sum *sum = NULL, *old;
+	u32 gen;
+
+	spin_lock(&store->alloc_lock);
+	old = store->segs[seg].sum;
+	gen = store->segs[seg].gen;
+	spin_unlock(&store->alloc_lock);
+
+	if (old)
+		sum = lzom_sum_alloc(old->nr);
+
+	spin_lock(&store->alloc_lock);
+	if (sum && store->segs[seg].sum == old &&
+	    store->segs[seg].gen == gen) {
+		memcpy(sum->recs, old->recs, old->nr * sizeof(*old->recs));
+		sum->nr = old->nr;
+		store->segs[seg].sum = sum;
+		sum = old;
+		sum->nr = 0;
+		if (!store->sum_spare)
+			swap(store->sum_spare, sum);
+	}
+	spin_unlock(&store->alloc_lock);
+
+	kvfree(sum);
+	lzom_sum_refill(store);
+}
+
+/* takes a free segment, the last LZOM_GC_RESERVE only for the cleaner */
+static u32 lzom_seg_take(struct lzom_store *store, bool reserve)
+{
+	u32 seg;
+
+	lockdep_assert_held(&store->alloc_lock);
+
+	if (store->nr_free <= (reserve ? 0 : LZOM_GC_RESERVE))
+		return store->nr_segs;
+
+	seg = find_first_bit(store->seg_free, store->nr_segs);
+	clear_bit(seg, store->seg_free);
+	store->nr_free--;
+	store->segs[seg].state = LZOM_SEG_OPEN;
+	store->segs[seg].sum = store->sum_spare;
+	store->sum_spare = NULL;
+
+	return seg;
+}
+
+static bool lzom_seg_has_free(struct lzom_store *store)
+{
+	return READ_ONCE(store->nr_free) > LZOM_GC_RESERVE;
+}
+
+static void lzom_gc_kick(struct lzom_store *store)
+{
+	mod_delayed_work(store->gc_wq, &store->gc_work, 0);
+}
+
+/*
+ * Hands out @nr_sectors at the head of the log for @nr_blocks from @lba.
+ * When no segment is left, waits for the cleaner to free one and gives up
+ * with -ENOSPC if it cannot.
+ */
+int lzom_store_alloc(struct lzom_store *store, unsigned int nr_sectors,
+		     u64 lba, unsigned int nr_blocks, sector_t *sector)
+{
+	for (;;) {
+		u32 seg, open;
+
+		spin_lock(&store->alloc_lock);
+
+		seg = store->open_seg;
+		if (seg < store->nr_segs &&
+		    store->open_used + nr_sectors <= LZOM_SEG_SECTORS) {
+			*sector = lzom_seg_start(store, seg) + store->open_used;
+			store->open_used += nr_sectors;
+			atomic_add(nr_sectors, &store->segs[seg].inflight);
+			lzom_sum_add(store, seg, lba, nr_blocks);
+			spin_unlock(&store->alloc_lock);
+			return 0;
+		}
+
+		if (seg < store->nr_segs)
+			lzom_seg_set_state(store, seg, LZOM_SEG_FULL);
+
+		open = lzom_seg_take(store, false);
+		store->open_seg = open;
+		store->open_used = 0;
+
+		spin_unlock(&store->alloc_lock);
+
+		if (seg < store->nr_segs)
+			lzom_sum_trim(store, seg);
+		else
+			lzom_sum_refill(store);
+		if (open < store->nr_segs)
+			continue;
+
+		lzom_gc_kick(store);
+		if (!wait_event_timeout(store->free_wait,
+					lzom_seg_has_free(store),
+					LZOM_GC_WAIT)) {
+			LZOM_ERRLOG("no free segments");
+			return -ENOSPC;
+		}
+	}
+}
+
+/* gives back the space of an @entry that was allocated but not installed */
+void lzom_store_release(struct lzom_store *store, u64 entry)
+{
+	struct lzom_seg *seg =
+		&store->segs[lzom_seg_of(store, lzom_map_sector(entry))];
+
+	atomic_sub(lzom_map_len(entry), &seg->inflight);
+}
+
+/*
+ * The share of its extent one block mapping @entry accounts for. The
+ * first len % unit members take a sector more, so that the members of an
+ * extent add up to its length.
+ */
+static unsigned int lzom_map_weight(u64 entry)
+{
+	unsigned int len = lzom_map_len(entry), unit = lzom_map_unit(entry);
+
+	return len / unit + (lzom_map_idx(entry) < len % unit);
+}
+
+/*
+ * Adds @weight to the live sectors behind @entry and refiles a full
+ * segment that crossed into another bucket.
+ */
+static void lzom_seg_add(struct lzom_store *store, u64 entry, int weight)
+{
+	u32 seg = lzom_seg_of(store, lzom_map_sector(entry));
+	struct lzom_seg *s = &store->segs[seg];
+	u32 live = atomic_add_return(weight, &s->live);
+
+	if (READ_ONCE(s->state) == LZOM_SEG_FULL &&
+	    lzom_gc_bucket(live) != READ_ONCE(s->bucket))
+		lzom_seg_file(store, seg);
+}
+
+static void lzom_seg_get(struct lzom_store *store, u64 entry)
+{
+	if (entry)
+		lzom_seg_add(store, entry, lzom_map_weight(entry));
+}
+
+static void lzom_seg_put(struct lzom_store *store, u64 entry)
+{
+	if (entry)
+		lzom_seg_add(store, entry, -(int)lzom_map_weight(entry));
+}
+
+/* @entry is already counted live */
+static void lzom_store_set(struct lzom_store *store, u64 lba, u64 entry)
+{
+	u64 old;
+
+	old = le64_to_cpu(xchg(&store->map[lba], cpu_to_le64(entry)));
+	set_bit(lba / LZOM_MAP_PER_PAGE, store->map_dirty);
+
+	lzom_seg_put(store, old);
+}
+
+/*
+ * Points @lba at the freshly written @entry from lzom_store_alloc(), or
+ * unmaps it when @entry is 0. Either way the old space becomes dead.
+ */
+void lzom_store_install(struct lzom_store *store, u64 lba, u64 entry)
+{
+	lzom_seg_get(store, entry);
+	/* pairs with smp_rmb() in lzom_seg_reclaimable() */
+	smp_mb__before_atomic();
+	if (entry)
+		lzom_store_release(store, entry);
+
+	lzom_store_set(store, lba, entry);
+}
+
+/*
+ * Points the @nr_blocks blocks from @lba at their members of the unit
+ * written at @entry from lzom_store_alloc().
+ */
+void lzom_store_install_unit(struct lzom_store *store, u64 lba,
+			     unsigned int nr_blocks, u64 entry)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_blocks; i++)
+		lzom_seg_get(store, lzom_map_member(entry, i));
+	/* pairs with smp_rmb() in lzom_seg_reclaimable() */
+	smp_mb__before_atomic();
+	lzom_store_release(store, entry);
+
+	for (i = 0; i < nr_blocks; i++)
+		lzom_store_set(store, lba + i, lzom_map_member(entry, i));
+}
+
+/*
+ * Takes a reference to @entry for another block, as long as @src still
+ * maps it. Counted as live before @src is checked, a segment that passes
+ * the check cannot be found reclaimable until lzom_store_unref().
+ */
+bool lzom_store_ref(struct lzom_store *store, u64 src, u64 entry)
+{
+	lzom_seg_get(store, entry);
+	smp_mb__after_atomic();
+
+	if (lzom_store_get(store, src) == entry)
+		return true;
+
+	lzom_seg_put(store, entry);
+	return false;
+}
+
+void lzom_store_unref(struct lzom_store *store, u64 entry)
+{
+	lzom_seg_put(store, entry);
+}
+
+/* points @lba at an @entry referenced by lzom_store_ref() */
+void lzom_store_link(struct lzom_store *store, u64 lba, u64 entry)
+{
+	WRITE_ONCE(store->segs[lzom_seg_of(store, lzom_map_sector(entry))]
+			   .linked,
+		   true);
+	lzom_store_set(store, lba, entry);
+}
+
+/*
+ * Moves @lba from @old to an @entry referenced by lzom_store_ref() unless
+ * it was rewritten meanwhile, the reference is the caller's to drop then.
+ */
+bool lzom_store_relink(struct lzom_store *store, u64 lba, u64 old, u64 entry)
+{
+	WRITE_ONCE(store->segs[lzom_seg_of(store, lzom_map_sector(entry))]
+			   .linked,
+		   true);
+	if (cmpxchg(&store->map[lba], cpu_to_le64(old), cpu_to_le64(entry)) !=
+	    cpu_to_le64(old))
+		return false;
+
+	set_bit(lba / LZOM_MAP_PER_PAGE, store->map_dirty);
+	lzom_seg_put(store, old);
+	return true;
+}
+
+/* moves @lba from @old to @entry unless it was rewritten meanwhile */
+static bool lzom_store_relocate(struct lzom_store *store, u64 lba, u64 old,
+				u64 entry)
+{
+	if (cmpxchg(&store->map[lba], cpu_to_le64(old), cpu_to_le64(entry)) !=
+	    cpu_to_le64(old))
+		return false;
+
+	set_bit(lba / LZOM_MAP_PER_PAGE, store->map_dirty);
+	lzom_seg_get(store, entry);
+	lzom_seg_put(store, old);
+	return true;
+}
+
+static bool lzom_seg_reclaimable(struct lzom_store *store, u32 seg)
+{
+	if (READ_ONCE(store->segs[seg].state) != LZOM_SEG_FULL ||
+	    atomic_read(&store->segs[seg].inflight))
+		return false;
+
+	smp_rmb();
+	return !atomic_read(&store->segs[seg].live);
+}
+
+/* frees the segments collected in seg_reclaim, after the map was synced */
+static void lzom_seg_reclaim(struct lzom_store *store)
+{
+	bool discard = bdev_max_discard_sectors(store->bdev);
+	u32 seg;
+
+	for_each_set_bit (seg, store->seg_reclaim, store->nr_segs) {
+		struct lzom_seg_sum *sum;
+
+		if (discard)
+			blkdev_issue_discard(store->bdev,
+					     lzom_seg_start(store, seg),
+					     LZOM_SEG_SECTORS, GFP_NOIO);
+
+		spin_lock(&store->alloc_lock);
+		WRITE_ONCE(store->segs[seg].gen, store->segs[seg].gen + 1);
+		lzom_seg_set_state(store, seg, LZOM_SEG_FREE);
+		sum = store->segs[seg].sum;
+		store->segs[seg].sum = NULL;
+		store->segs[seg].linked = false;
+		set_bit(seg, store->seg_free);
+		store->nr_free++;
+		spin_unlock(&store->alloc_lock);
+
+		kvfree(sum);
+	}
+
+	wake_up_all(&store->free_wait);
+}
+
+/*
+ * Builds the summaries of the full segments from a freshly loaded map, a
+ * record per block. Without memory for them the cleaner walks the map.
+ */
+static void lzom_seg_scan_sums(struct lzom_store *store)
+{
+	u32 *nr, seg;
+	u64 lba;
+
+	nr = kvcalloc(store->nr_segs, sizeof(*nr), GFP_KERNEL);
+	if (!nr)
+		return;
+
+	for (lba = 0; lba < store->nr_blocks; lba++) {
+		u64 entry = lzom_store_get(store, lba);
+
+		if (entry)
+			nr[lzom_seg_of(store, lzom_map_sector(entry))]++;
+	}
+
+	for (seg = 0; seg < store->nr_segs; seg++)
+		if (nr[seg])
+			store->segs[seg].sum = lzom_sum_alloc(nr[seg]);
+
+	for (lba = 0; lba < store->nr_blocks; lba++) {
+		u64 entry = lzom_store_get(store, lba);
+		struct lzom_seg_sum *sum;
+
+		if (!entry)
+			continue;
+
+		sum = store->segs[lzom_seg_of(store, lzom_map_sector(entry))]
+			      .sum;
+		if (sum)
+			sum->recs[sum->nr++] = lzom_sum_rec(lba, 1);
+	}
+
+	kvfree(nr);
+}
+
+/* counts the live sectors of every segment from a freshly loaded map */
+static int lzom_seg_scan(struct lzom_store *store)
+{
+	u64 lba;
+	u32 seg;
+
+	for (seg = 0; seg < store->nr_segs; seg++)
+		store->segs[seg].bucket = LZOM_GC_BUCKETS;
+
+	for (lba = 0; lba < store->nr_blocks; lba++) {
+		u64 entry = lzom_store_get(store, lba);
+		sector_t sector = lzom_map_sector(entry);
+
+		if (entry && (sector < store->data_start ||
+			      sector + lzom_map_len(entry) >
+				      store->data_start + store->data_sectors ||
+			      lzom_seg_of(store, sector) !=
+				      lzom_seg_of(store, sector +
+							 lzom_map_len(entry) -
+							 1))) {
+			LZOM_ERRLOG("corrupted map entry %llx of block %llu",
+				    entry, lba);
+			return -EINVAL;
+		}
+
+		lzom_seg_get(store, entry);
+	}
+
+	for (seg = 0; seg < store->nr_segs; seg++) {
+		if (atomic_read(&store->segs[seg].live)) {
+			lzom_seg_set_state(store, seg, LZOM_SEG_FULL);
+		} else {
+			set_bit(seg, store->seg_free);
+			store->nr_free++;
+		}
+	}
+
+	lzom_seg_scan_sums(store);
+	lzom_sum_refill(store);
+
+	store->open_seg = store->nr_segs;
+	store->gc_seg = store->nr_segs;
+	return 0;
+}
+
+/* ----------------- map -----------------*/
+/*
+ * Writes back the dirty pages of the map behind a flush of the data they
+ * point at, then frees the segments the synced map no longer uses. With a
+ * clean map the first flush is all it takes.
+ */
+int lzom_store_sync(struct lzom_store *store)
+{
+	unsigned long first, last;
+	unsigned int noio_flags;
+	bool written = false;
+	u32 seg;
+	int ret;
+
+	mutex_lock(&store->sync_lock);
+	noio_flags = memalloc_noio_save();
+
+	bitmap_zero(store->seg_reclaim, store->nr_segs);
+	for (seg = 0; seg < store->nr_segs; seg++)
+		if (lzom_seg_reclaimable(store, seg))
+			set_bit(seg, store->seg_reclaim);
+
+	ret = blkdev_issue_flush(store->bdev);
+	if (ret)
+		goto out;
+
+	for_each_set_bitrange (first, last, store->map_dirty,
+			       store->nr_map_pages) {
+		unsigned long i;
+
+		for (i = first; i < last; i++)
+			clear_bit(i, store->map_dirty);
+
+		ret = lzom_store_io(store,
+				    store->map_start +
+					    (first << (PAGE_SHIFT - SECTOR_SHIFT)),
+				    (char *)store->map + first * PAGE_SIZE,
+				    (last - first) * PAGE_SIZE, REQ_OP_WRITE);
+		if (ret) {
+			/* retried by the next sync */
+			for (i = first; i < last; i++)
+				set_bit(i, store->map_dirty);
+			goto out;
+		}
+		written = true;
+	}
+
+	if (written)
+		ret = blkdev_issue_flush(store->bdev);
+	if (!ret)
+		lzom_seg_reclaim(store);
+
+out:
+	memalloc_noio_restore(noio_flags);
+	mutex_unlock(&store->sync_lock);
+
+	if (ret)
+		LZOM_ERRLOG("failed to sync the map: %d", ret);
+	return ret;
+}
+
+/* ----------------- cleaner -----------------*/
+/*
+ * Picks full segments with little live data below @limit sectors, as many
+ * as fit into @room sectors together, from the lowest buckets up. The
+ * index is read unlocked, every candidate is checked again.
+ */
+static unsigned int lzom_gc_pick(struct lzom_store *store, u32 limit, u32 room)
+{
+	unsigned int nr_victims = 0, b;
+	u32 total = 0;
+
+	bitmap_zero(store->gc_victims, store->nr_segs);
+
+	for (b = 0; b < LZOM_GC_BUCKETS && (b << LZOM_GC_BUCKET_SHIFT) < limit &&
+		    total + (b << LZOM_GC_BUCKET_SHIFT) <= room;
+	     b++) {
+		u32 seg;
+
+		for_each_set_bit (seg, store->gc_buckets[b], store->nr_segs) {
+			u32 live = atomic_read(&store->segs[seg].live);
+
+			if (READ_ONCE(store->segs[seg].state) != LZOM_SEG_FULL ||
+			    atomic_read(&store->segs[seg].inflight) || !live ||
+			    live >= limit || total + live > room)
+				continue;
+
+			set_bit(seg, store->gc_victims);
+			total += live;
+			if (++nr_victims == LZOM_GC_MAX_VICTIMS)
+				return nr_victims;
+		}
+	}
+
+	return nr_victims;
+}
+
+/* closes the cleaner's segment and opens a fresh one from the reserve */
+static int lzom_gc_seg_open(struct lzom_store *store)
+{
+	u32 seg = store->gc_seg;
+
+	spin_lock(&store->alloc_lock);
+	if (seg < store->nr_segs)
+		lzom_seg_set_state(store, seg, LZOM_SEG_FULL);
+	store->gc_seg = lzom_seg_take(store, true);
+	store->gc_used = 0;
+	spin_unlock(&store->alloc_lock);
+
+	if (seg < store->nr_segs)
+		lzom_sum_trim(store, seg);
+	else
+		lzom_sum_refill(store);
+
+	return store->gc_seg < store->nr_segs ? 0 : -ENOSPC;
+}
+
+/* orders the cleaner's items by the extent they map */
+static int lzom_gc_item_cmp(const void *a, const void *b)
+{
+	const struct lzom_gc_item *x = a, *y = b;
+	sector_t xs = lzom_map_sector(x->old), ys = lzom_map_sector(y->old);
+
+	if (xs != ys)
+		return xs < ys ? -1 : 1;
+	return x->lba < y->lba ? -1 : x->lba > y->lba;
+}
+
+static void lzom_gc_take(struct lzom_store *store, u64 lba, u64 entry,
+			 unsigned int *nr_items)
+{
+	store->gc_items[*nr_items].lba = lba;
+	store->gc_items[*nr_items].old = entry;
+	store->gc_items[*nr_items].entry = 0;
+	(*nr_items)++;
+}
+
+/*
+ * Collects the blocks that still map into the victims from their
+ * summaries. Victims without one, or with blocks dedup linked to them, are
+ * left to a single walk of the map.
+ */
+static unsigned int lzom_gc_collect(struct lzom_store *store)
+{
+	u32 walk[LZOM_GC_MAX_VICTIMS], victim;
+	unsigned int nr_walk = 0, nr_items = 0, i, j;
+	u64 lba;
+
+	for_each_set_bit (victim, store->gc_victims, store->nr_segs) {
+		struct lzom_seg_sum *sum;
+
+		spin_lock(&store->alloc_lock);
+		sum = store->segs[victim].sum;
+		if (!sum || READ_ONCE(store->segs[victim].linked)) {
+			spin_unlock(&store->alloc_lock);
+			walk[nr_walk++] = victim;
+			continue;
+		}
+
+		for (i = 0; i < sum->nr && nr_items < LZOM_SEG_SECTORS; i++) {
+			u64 first = lzom_sum_lba(sum->recs[i]);
+
+			for (j = 0; j < lzom_sum_blocks(sum->recs[i]) &&
+				    nr_items < LZOM_SEG_SECTORS;
+			     j++) {
+				u64 entry = lzom_store_get(store, first + j);
+
+				if (entry && lzom_seg_of(store,
+							 lzom_map_sector(entry)) ==
+						     victim)
+					lzom_gc_take(store, first + j, entry,
+						     &nr_items);
+			}
+		}
+		spin_unlock(&store->alloc_lock);
+	}
+
+	if (!nr_walk)
+		return nr_items;
+
+	for (lba = 0; lba < store->nr_blocks && nr_items < LZOM_SEG_SECTORS;
+	     lba++) {
+		u64 entry = lzom_store_get(store, lba);
+
+		if (!entry)
+			continue;
+
+		victim = lzom_seg_of(store, lzom_map_sector(entry));
+		for (i = 0; i < nr_walk && walk[i] != victim; i++)
+			;
+		if (i < nr_walk)
+			lzom_gc_take(store, lba, entry, &nr_items);
+	}
+
+	return nr_items;
+}
+
+/*
+ * Copies the live blocks of the victims, still compressed, behind what the
+ * cleaner wrote before and repoints the map at them. Every extent is copied
+ * once, however many blocks map it as members of a unit or as duplicates,
+ * and each of them is moved over only if it still maps the old extent. The
+ * victims are freed by the next map sync. Segments with less than
+ * gc_threshold percent live are cleaned, any segment when @urgent.
+ */
+static int lzom_gc_pass(struct lzom_store *store, bool urgent)
+{
+	u32 limit = urgent ? LZOM_SEG_SECTORS :
+			     LZOM_SEG_SECTORS *
+				     READ_ONCE(store->gc_threshold) / 100;
+	unsigned int nr_victims, nr_items = 0, n, i;
+	u32 victim, used = 0;
+	sector_t dst_start;
+	u64 moved = 0;
+	int ret;
+
+	if (store->gc_seg == store->nr_segs && lzom_gc_seg_open(store))
+		return -ENOSPC;
+
+	nr_victims = lzom_gc_pick(store, limit,
+				  LZOM_SEG_SECTORS - store->gc_used);
+	if (!nr_victims && store->gc_used) {
+		ret = lzom_gc_seg_open(store);
+		if (ret)
+			return ret;
+
+		nr_victims = lzom_gc_pick(store, limit, LZOM_SEG_SECTORS);
+	}
+	if (!nr_victims)
+		return 0;
+
+	dst_start = lzom_seg_start(store, store->gc_seg) + store->gc_used;
+
+	n = lzom_gc_collect(store);
+
+	/* the blocks sharing an extent end up next to each other */
+	sort(store->gc_items, n, sizeof(*store->gc_items), lzom_gc_item_cmp,
+	     NULL);
+
+	/* stale summary records may name a block twice */
+	for (i = 0; i < n; i++)
+		if (!nr_items ||
+		    store->gc_items[i].lba != store->gc_items[nr_items - 1].lba)
+			store->gc_items[nr_items++] = store->gc_items[i];
+
+	for_each_set_bit (victim, store->gc_victims, store->nr_segs) {
+		sector_t start = lzom_seg_start(store, victim);
+		u64 prev_old = 0, prev_new = 0, prev_lba = 0;
+
+		ret = lzom_store_io(store, start, store->gc_in,
+				    LZOM_SEG_SECTORS << SECTOR_SHIFT,
+				    REQ_OP_READ);
+		if (ret)
+			goto err;
+
+		for (i = 0; i < nr_items; i++) {
+			struct lzom_gc_item *item = &store->gc_items[i];
+			sector_t sector = lzom_map_sector(item->old);
+			unsigned int len = lzom_map_len(item->old);
+
+			if (lzom_seg_of(store, sector) != victim)
+				continue;
+
+			/* units and duplicates share the copy of their extent */
+			if (prev_new && lzom_map_member(item->old, 0) == prev_old) {
+				item->entry = lzom_map_member(
+					prev_new, lzom_map_idx(item->old));
+				/* a duplicate the summary cannot name */
+				if (item->lba - lzom_map_idx(item->old) != prev_lba)
+					WRITE_ONCE(store->segs[store->gc_seg].linked,
+						   true);
+				continue;
+			}
+
+			/* what does not fit stays for the next pass */
+			if (store->gc_used + used + len > LZOM_SEG_SECTORS)
+				continue;
+
+			memcpy(store->gc_out + (used << SECTOR_SHIFT),
+			       store->gc_in + ((sector - start) << SECTOR_SHIFT),
+			       len << SECTOR_SHIFT);
+			item->entry = lzom_map_entry(dst_start + used, len,
+						     item->old &
+							     (LZOM_MAP_FLAGS |
+							      LZOM_MAP_IDX));
+			prev_old = lzom_map_member(item->old, 0);
+			prev_new = item->entry;
+			prev_lba = item->lba - lzom_map_idx(item->old);
+			used += len;
+
+			spin_lock(&store->alloc_lock);
+			lzom_sum_add(store, store->gc_seg, prev_lba,
+				     lzom_map_unit(item->old));
+			spin_unlock(&store->alloc_lock);
+		}
+	}
+
+	ret = lzom_store_io(store, dst_start, store->gc_out,
+			    used << SECTOR_SHIFT, REQ_OP_WRITE);
+	if (ret)
+		goto err;
+	store->gc_used += used;
+
+	for (i = 0; i < nr_items; i++) {
+		struct lzom_gc_item *item = &store->gc_items[i];
+
+		if (item->entry && lzom_store_relocate(store, item->lba,
+						       item->old, item->entry))
+			moved++;
+	}
+
+	atomic64_add(nr_victims, &store->gc_stat.segs);
+	atomic64_add(moved, &store->gc_stat.blocks);
+	return nr_victims;
+
+err:
+	/* the cleaner's segment may be partly written, do not reuse it */
+	lzom_gc_seg_open(store);
+	LZOM_ERRLOG("cleaner failed: %d", ret);
+	return ret;
+}
+
+/*
+ * Cleans while free segments run low, syncing after every pass so that
+ * the victims can be reused, and syncs the map on every run.
+ */
+static void lzom_gc_work_fn(struct work_struct *work)
+{
+	struct lzom_store *store =
+		container_of(to_delayed_work(work), struct lzom_store, gc_work);
+	unsigned int noio_flags;
+	int ret;
+
+	while (READ_ONCE(store->nr_free) < store->nr_segs / LZOM_GC_LOW_RATIO) {
+		bool urgent = READ_ONCE(store->nr_free) <= LZOM_GC_RESERVE;
+
+		noio_flags = memalloc_noio_save();
+		ret = lzom_gc_pass(store, urgent);
+		memalloc_noio_restore(noio_flags);
+		if (ret <= 0)
+			break;
+
+		lzom_store_sync(store);
+		cond_resched();
+	}
+
+	lzom_store_sync(store);
+
+	queue_delayed_work(store->gc_wq, &store->gc_work, LZOM_GC_INTERVAL);
+}
+
+static void lzom_gc_free(struct lzom_store *store)
+{
+	vfree(store->gc_out);
+	vfree(store->gc_in);
+	kvfree(store->gc_items);
+	bitmap_free(store->gc_victims);
+}
+
+static int lzom_gc_alloc(struct lzom_store *store)
+{
+	store->gc_threshold = LZOM_GC_THRESHOLD_DEFAULT;
+	store->gc_victims = bitmap_zalloc(store->nr_segs, GFP_KERNEL);
+	store->gc_items = kvmalloc_array(LZOM_SEG_SECTORS,
+					 sizeof(*store->gc_items), GFP_KERNEL);
+	store->gc_in = vmalloc(LZOM_SEG_SECTORS << SECTOR_SHIFT);
+	store->gc_out = vmalloc(LZOM_SEG_SECTORS << SECTOR_SHIFT);
+	store->gc_wq = alloc_ordered_workqueue("lzom_gc", WQ_MEM_RECLAIM);
+	if (!store->gc_victims || !store->gc_items || !store->gc_in ||
+	    !store->gc_out || !store->gc_wq)
+		return -ENOMEM;
+
+	INIT_DELAYED_WORK(&store->gc_work, lzom_gc_work_fn);
+	queue_delayed_work(store->gc_wq, &store->gc_work, LZOM_GC_INTERVAL);
+	return 0;
+}
+
+/* ----------------- open -----------------*/
+static int lzom_store_map_alloc(struct lzom_store *store)
+{
+	unsigned int i;
+
+	store->nr_map_pages = DIV_ROUND_UP(store->nr_blocks, LZOM_MAP_PER_PAGE);
+	store->nr_segs = store->data_sectors >> LZOM_SEG_SHIFT;
+
+	/* whole pages, so the map can be written straight from memory */
+	store->map = vzalloc(store->nr_map_pages * PAGE_SIZE);
+	store->map_dirty = bitmap_zalloc(store->nr_map_pages, GFP_KERNEL);
+	store->segs = vzalloc(array_size(store->nr_segs, sizeof(*store->segs)));
+	store->seg_free = bitmap_zalloc(store->nr_segs, GFP_KERNEL);
+	store->seg_reclaim = bitmap_zalloc(store->nr_segs, GFP_KERNEL);
+	if (!store->map || !store->map_dirty || !store->segs ||
+	    !store->seg_free || !store->seg_reclaim)
+		return -ENOMEM;
+
+	for (i = 0; i < LZOM_GC_BUCKETS; i++) {
+		store->gc_buckets[i] = bitmap_zalloc(store->nr_segs, GFP_KERNEL);
+		if (!store->gc_buckets[i])
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void lzom_store_free(struct lzom_store *store)
+{
+	unsigned int i;
+	u32 seg;
+
+	if (store->gc_wq) {
+		destroy_workqueue(store->gc_wq);
+		store->gc_wq = NULL;
+	}
+	lzom_gc_free(store);
+
+	for (i = 0; i < LZOM_GC_BUCKETS; i++)
+		bitmap_free(store->gc_buckets[i]);
+	kvfree(store->sum_spare);
+	for (seg = 0; store->segs && seg < store->nr_segs; seg++)
+		kvfree(store->segs[seg].sum);
+	bitmap_free(store->seg_reclaim);
+	bitmap_free(store->seg_free);
+	vfree(store->segs);
+	bitmap_free(store->map_dirty);
+	vfree(store->map);
+	store->map = NULL;
+	mutex_destroy(&store->sync_lock);
+}
+
+/*
+ * Loads the map of @bdev and starts the cleaner. A device without an lzom
+ * superblock is formatted when @format is set and refused otherwise, so
+ * that a wrong path cannot destroy data.
+ */
+int lzom_store_open(struct lzom_store *store, struct block_device *bdev,
+		    bool format)
+{
+	struct lzom_sb *sb;
+	int ret;
+
+	memset(store, 0, sizeof(*store));
+	store->bdev = bdev;
+	mutex_init(&store->sync_lock);
+	spin_lock_init(&store->alloc_lock);
+	spin_lock_init(&store->gc_lock);
+	init_waitqueue_head(&store->free_wait);
+
+	sb = (struct lzom_sb *)__get_free_page(GFP_KERNEL | __GFP_ZERO);
+	if (!sb)
+		return -ENOMEM;
+
+	ret = lzom_store_io(store, 0, sb, LZOM_SB_SECTORS << SECTOR_SHIFT,
+			    REQ_OP_READ);
+	if (ret) {
+		LZOM_ERRLOG("failed to read superblock: %d", ret);
+		goto out;
+	}
+
+	if (le64_to_cpu(sb->magic) == LZOM_SB_MAGIC) {
+		ret = lzom_sb_parse(store, sb);
+	} else if (format) {
+		ret = lzom_store_format(store, sb);
+	} else {
+		LZOM_ERRLOG("no lzom superblock, set format=1 to create one");
+		ret = -EINVAL;
+	}
+	if (ret)
+		goto out;
+
+	ret = lzom_store_map_alloc(store);
+	if (ret)
+		goto out;
+
+	ret = lzom_store_io(store, store->map_start, store->map,
+			    min_t(size_t, store->nr_map_pages * PAGE_SIZE,
+				  store->map_sectors << SECTOR_SHIFT),
+			    REQ_OP_READ);
+	if (ret) {
+		LZOM_ERRLOG("failed to read the map: %d", ret);
+		goto out;
+	}
+
+	ret = lzom_seg_scan(store);
+	if (ret)
+		goto out;
+
+	ret = lzom_gc_alloc(store);
+
+out:
+	free_page((unsigned long)sb);
+	if (ret)
+		lzom_store_free(store);
+	return ret;
+}
+
+/* stops the cleaner and writes the map back */
+void lzom_store_close(struct lzom_store *store)
+{
+	cancel_delayed_work_sync(&store->gc_work);
+	lzom_store_sync(store);
+	lzom_store_free(store);
+}
@@ -0,0 +1,262 @@
+#ifndef LZOM_STORE
+#define LZOM_STORE
+
+#include <linux/bitops.h>
+#include <linux/blkdev.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+/*
+ * On-disk layout of the underlying device:
+ *
+ *   [ superblock | logical-to-physical map | segment 0 | segment 1 | ... ]
+ *
+ * The superblock takes the first LZOM_BLOCK_SIZE bytes. The map holds one
+ * __le64 entry per logical block, an all-zero entry is an unmapped block
+ * that reads as zeros. Stored blocks are appended to the open segment and
+ * never rewritten in place, the cleaner moves the live ones out of mostly
+ * dead segments so that those can be reused.
+ */
+#define LZOM_BLOCK_SHIFT 12
+#define LZOM_BLOCK_SIZE (1U << LZOM_BLOCK_SHIFT)
+#define LZOM_BLOCK_SECTORS (LZOM_BLOCK_SIZE >> SECTOR_SHIFT)
+
+#define LZOM_SEG_SHIFT 11 /* in sectors, 1 MiB */
+#define LZOM_SEG_SECTORS (1U << LZOM_SEG_SHIFT)
+
+#define LZOM_SB_MAGIC 0x524f54534d4f5a4cULL /* "LZOMSTOR" */
+#define LZOM_SB_VERSION 3
+#define LZOM_SB_SECTORS LZOM_BLOCK_SECTORS
+
+struct lzom_sb {
+	__le64 magic;
+	__le32 version;
+	__le32 block_size;
+	__le64 nr_blocks;
+	__le64 map_start;
+	__le64 map_sectors;
+	__le64 data_start;
+	__le64 data_sectors;
+	__le32 seg_sectors;
+	__le32 csum;
+};
+
+/*
+ * Map entry: bits 0-39 the first sector of the stored extent, bits 40-49
+ * its length in sectors, bits 50-55 the index of the block within its
+ * unit, bits 56-63 flags. A unit is a run of adjacent blocks compressed
+ * together into one extent, which every block of the run maps with its
+ * own index. Several blocks with the same content may also share one
+ * entry. The live count of a segment counts every block that maps into
+ * it, each with its share of the extent.
+ */
+#define LZOM_MAP_SECTOR_BITS 40
+#define LZOM_MAP_LEN_SHIFT 40
+#define LZOM_MAP_LEN_BITS 10
+#define LZOM_MAP_IDX_SHIFT 50
+#define LZOM_MAP_IDX GENMASK_ULL(55, 50)
+#define LZOM_MAP_RAW BIT_ULL(56) /* stored uncompressed */
+#define LZOM_MAP_UNIT_SHIFT 57
+#define LZOM_MAP_UNIT GENMASK_ULL(62, 57) /* blocks in the unit minus one */
+#define LZOM_MAP_FLAGS GENMASK_ULL(63, 56)
+
+#define LZOM_UNIT_MAX_BLOCKS 32
+#define LZOM_UNIT_MAX_SIZE (LZOM_UNIT_MAX_BLOCKS << LZOM_BLOCK_SHIFT)
+
+#define LZOM_MAP_PER_PAGE (PAGE_SIZE / sizeof(__le64))
+
+enum lzom_seg_state {
+	LZOM_SEG_FREE,
+	LZOM_SEG_OPEN,
+	LZOM_SEG_FULL,
+};
+
+/*
+ * What was written into a segment, so that the cleaner finds its blocks
+ * without walking the map: one record per extent, the lba of its first
+ * block and how many blocks it holds. Records go stale as blocks are
+ * rewritten, the cleaner checks every block against the map. Open
+ * segments have room for a record per sector, closed ones are trimmed.
+ */
+#define LZOM_SUM_NR_SHIFT 56
+
+struct lzom_seg_sum {
+	u32 nr;
+	u32 max;
+	u64 recs[];
+};
+
+static inline u64 lzom_sum_rec(u64 lba, unsigned int nr_blocks)
+{
+	return lba | ((u64)(nr_blocks - 1) << LZOM_SUM_NR_SHIFT);
+}
+
+static inline u64 lzom_sum_lba(u64 rec)
+{
+	return rec & GENMASK_ULL(LZOM_SUM_NR_SHIFT - 1, 0);
+}
+
+static inline unsigned int lzom_sum_blocks(u64 rec)
+{
+	return (rec >> LZOM_SUM_NR_SHIFT) + 1;
+}
+
+struct lzom_seg {
+	atomic_t live; /* sectors the map points at */
+	atomic_t inflight; /* sectors handed out but not in the map yet */
+	u32 gen; /* bumped on every reuse, an entry alone may repeat */
+	u8 state;
+	u8 bucket; /* of the cleaner's index, LZOM_GC_BUCKETS if in none */
+	/* dedup linked blocks to it, which its summary does not know */
+	bool linked;
+	/* under alloc_lock, NULL if unknown and the cleaner walks the map */
+	struct lzom_seg_sum *sum;
+};
+
+/* free segments only the cleaner may take */
+#define LZOM_GC_RESERVE 2
+#define LZOM_GC_THRESHOLD_DEFAULT 50
+#define LZOM_GC_MAX_VICTIMS 8
+/* the cleaner runs while less than 1/LZOM_GC_LOW_RATIO of segments is free */
+#define LZOM_GC_LOW_RATIO 8
+#define LZOM_GC_INTERVAL (5 * HZ)
+/* how long a writer waits for the cleaner before failing with -ENOSPC */
+#define LZOM_GC_WAIT (30 * HZ)
+/*
+ * Full segments are indexed by their live sectors in buckets of
+ * 1 << LZOM_GC_BUCKET_SHIFT, the last one also takes everything above.
+ */
+#define LZOM_GC_BUCKETS 16
+#define LZOM_GC_BUCKET_SHIFT (LZOM_SEG_SHIFT - 4)
+
+struct lzom_gc_stat {
+	atomic64_t segs; /* segments cleaned */
+	atomic64_t blocks; /* live blocks moved */
+};
+
+struct lzom_gc_item {
+	u64 lba;
+	u64 old;
+	u64 entry;
+};
+
+struct lzom_store {
+	struct block_device *bdev;
+	u64 nr_blocks;
+	sector_t map_start;
+	sector_t map_sectors;
+	sector_t data_start;
+	sector_t data_sectors;
+
+	__le64 *map;
+	/* one bit per page of map that differs from the disk */
+	unsigned long *map_dirty;
+	unsigned long nr_map_pages;
+	struct mutex sync_lock;
+
+	/* allocator, open_seg is nr_segs when no segment is open */
+	struct lzom_seg *segs;
+	u32 nr_segs;
+	spinlock_t alloc_lock;
+	unsigned long *seg_free;
+	u32 nr_free;
+	u32 open_seg;
+	u32 open_used;
+	wait_queue_head_t free_wait;
+	unsigned long *seg_reclaim;
+	/* summary for the next segment that opens */
+	struct lzom_seg_sum *sum_spare;
+
+	/* cleaner, appends to gc_seg like writers to open_seg */
+	u32 gc_seg;
+	u32 gc_used;
+	spinlock_t gc_lock;
+	unsigned long *gc_buckets[LZOM_GC_BUCKETS];
+	struct workqueue_struct *gc_wq;
+	struct delayed_work gc_work;
+	unsigned long *gc_victims;
+	struct lzom_gc_item *gc_items;
+	void *gc_in;
+	void *gc_out;
+	u32 gc_threshold;
+	struct lzom_gc_stat gc_stat;
+};
+
+static inline u64 lzom_map_entry(sector_t sector, unsigned int nr_sectors,
+				 u64 flags)
+{
+	return sector | ((u64)nr_sectors << LZOM_MAP_LEN_SHIFT) | flags;
+}
+
+static inline sector_t lzom_map_sector(u64 entry)
+{
+	return entry & GENMASK_ULL(LZOM_MAP_SECTOR_BITS - 1, 0);
+}
+
+static inline unsigned int lzom_map_len(u64 entry)
+{
+	return (entry >> LZOM_MAP_LEN_SHIFT) &
+	       GENMASK_ULL(LZOM_MAP_LEN_BITS - 1, 0);
+}
+
+static inline unsigned int lzom_map_idx(u64 entry)
+{
+	return (entry & LZOM_MAP_IDX) >> LZOM_MAP_IDX_SHIFT;
+}
+
+static inline unsigned int lzom_map_unit(u64 entry)
+{
+	return ((entry & LZOM_MAP_UNIT) >> LZOM_MAP_UNIT_SHIFT) + 1;
+}
+
+/* flags of an extent holding a unit of @nr_blocks */
+static inline u64 lzom_map_unit_flags(unsigned int nr_blocks)
+{
+	return (u64)(nr_blocks - 1) << LZOM_MAP_UNIT_SHIFT;
+}
+
+/* the entry of block @idx of the unit at @entry */
+static inline u64 lzom_map_member(u64 entry, unsigned int idx)
+{
+	return (entry & ~LZOM_MAP_IDX) | ((u64)idx << LZOM_MAP_IDX_SHIFT);
+}
+
+/* raw units keep their members one after another */
+static inline sector_t lzom_map_raw_sector(u64 entry)
+{
+	return lzom_map_sector(entry) +
+	       lzom_map_idx(entry) * LZOM_BLOCK_SECTORS;
+}
+
+static inline u64 lzom_store_get(struct lzom_store *store, u64 lba)
+{
+	return le64_to_cpu(READ_ONCE(store->map[lba]));
+}
+
+/* generation of the segment @entry lies in, see lzom_seg_reclaim() */
+static inline u32 lzom_store_gen(struct lzom_store *store, u64 entry)
+{
+	return READ_ONCE(store->segs[(lzom_map_sector(entry) -
+				      store->data_start) >> LZOM_SEG_SHIFT]
+				 .gen);
+}
+
+int lzom_store_open(struct lzom_store *store, struct block_device *bdev,
+		    bool format);
+int lzom_store_sync(struct lzom_store *store);
+void lzom_store_close(struct lzom_store *store);
+
+int lzom_store_alloc(struct lzom_store *store, unsigned int nr_sectors,
+		     u64 lba, unsigned int nr_blocks, sector_t *sector);
+void lzom_store_release(struct lzom_store *store, u64 entry);
+void lzom_store_install(struct lzom_store *store, u64 lba, u64 entry);
+void lzom_store_install_unit(struct lzom_store *store, u64 lba,
+			     unsigned int nr_blocks, u64 entry);
+bool lzom_store_ref(struct lzom_store *store, u64 src, u64 entry);
+void lzom_store_unref(struct lzom_store *store, u64 entry);
+void lzom_store_link(struct lzom_store *store, u64 lba, u64 entry);
+bool lzom_store_relink(struct lzom_store *store, u64 lba, u64 old, u64 entry);
+
+#endif // LZOM_STORE
@@ -0,0 +1,143 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lzom
+
+#if !defined(LZOM_TRACE) || defined(TRACE_HEADER_MULTI_READ)
+#define LZOM_TRACE
+
+#include <linux/blk-mq.h>
+#include <linux/tracepoint.h>
+
+#define lzom_show_op(op)                                          \
+	__print_symbolic(op, { REQ_OP_READ, "read" },             \
+			 { REQ_OP_WRITE, "write" },               \
+			 { REQ_OP_FLUSH, "flush" },               \
+			 { REQ_OP_DISCARD, "discard" },           \
+			 { REQ_OP_WRITE_ZEROES, "write_zeroes" })
+
+/* a request taken off the blk-mq queue */
+TRACE_EVENT(lzom_rq_start,
+	TP_PROTO(struct request *rq),
+	TP_ARGS(rq),
+
+	TP_STRUCT__entry(
+		__field(sector_t, sector)
+		__field(unsigned int, bytes)
+		__field(unsigned int, op)
+	),
+
+	TP_fast_assign(
+		__entry->sector = blk_rq_pos(rq);
+		__entry->bytes = blk_rq_bytes(rq);
+		__entry->op = req_op(rq);
+	),
+
+	TP_printk("%s sector=%llu bytes=%u", lzom_show_op(__entry->op),
+		  (unsigned long long)__entry->sector, __entry->bytes)
+);
+
+/* a block or unit compressed for the write of block @lba */
+TRACE_EVENT(lzom_compress,
+	TP_PROTO(u64 lba, unsigned int in_len, size_t out_len, u64 ns),
+	TP_ARGS(lba, in_len, out_len, ns),
+
+	TP_STRUCT__entry(
+		__field(u64, lba)
+		__field(unsigned int, in_len)
+		__field(size_t, out_len)
+		__field(u64, ns)
+	),
+
+	TP_fast_assign(
+		__entry->lba = lba;
+		__entry->in_len = in_len;
+		__entry->out_len = out_len;
+		__entry->ns = ns;
+	),
+
+	TP_printk("lba=%llu in_len=%u out_len=%zu ns=%llu", __entry->lba,
+		  __entry->in_len, __entry->out_len, __entry->ns)
+);
+
+/* a block or unit stored at lower @sector decompressed */
+TRACE_EVENT(lzom_decompress,
+	TP_PROTO(sector_t sector, unsigned int in_len, size_t out_len, u64 ns,
+		 int ret),
+	TP_ARGS(sector, in_len, out_len, ns, ret),
+
+	TP_STRUCT__entry(
+		__field(sector_t, sector)
+		__field(unsigned int, in_len)
+		__field(size_t, out_len)
+		__field(u64, ns)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->sector = sector;
+		__entry->in_len = in_len;
+		__entry->out_len = out_len;
+		__entry->ns = ns;
+		__entry->ret = ret;
+	),
+
+	TP_printk("sector=%llu in_len=%u out_len=%zu ns=%llu ret=%d",
+		  (unsigned long long)__entry->sector, __entry->in_len,
+		  __entry->out_len, __entry->ns, __entry->ret)
+);
+
+/* a lower bio for block @lba handed to the lower device */
+TRACE_EVENT(lzom_bio_submit,
+	TP_PROTO(struct bio *bio, u64 lba),
+	TP_ARGS(bio, lba),
+
+	TP_STRUCT__entry(
+		__field(sector_t, sector)
+		__field(unsigned int, bytes)
+		__field(unsigned int, op)
+		__field(u64, lba)
+	),
+
+	TP_fast_assign(
+		__entry->sector = bio->bi_iter.bi_sector;
+		__entry->bytes = bio->bi_iter.bi_size;
+		__entry->op = bio_op(bio);
+		__entry->lba = lba;
+	),
+
+	TP_printk("%s sector=%llu bytes=%u lba=%llu",
+		  lzom_show_op(__entry->op),
+		  (unsigned long long)__entry->sector, __entry->bytes,
+		  __entry->lba)
+);
+
+/* completion of a lower bio, its iterator is used up by now */
+TRACE_EVENT(lzom_bio_endio,
+	TP_PROTO(struct bio *bio, u64 lba),
+	TP_ARGS(bio, lba),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, op)
+		__field(u64, lba)
+		__field(int, status)
+	),
+
+	TP_fast_assign(
+		__entry->op = bio_op(bio);
+		__entry->lba = lba;
+		__entry->status = blk_status_to_errno(bio->bi_status);
+	),
+
+	TP_printk("%s lba=%llu status=%d", lzom_show_op(__entry->op),
+		  __entry->lba, __entry->status)
+);
+
+#endif // LZOM_TRACE
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE lzom_trace
+
+#include <trace/define_trace.h>
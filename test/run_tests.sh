@@ -40,7 +40,7 @@ done
 [ ! -b "$BRD_DEVICE" ] && { echo "BRD device not found"; exit 1; }
 echo "BRD device: $BRD_DEVICE"
 
-insmod $MODULE
+insmod $MODULE format=1
 echo -n "$BRD_DEVICE" > /sys/module/lzom_module/parameters/path
 sleep 1
 
@@ -79,17 +79,210 @@ echo ""
 echo "=== Tests ==="
 
 BLOCK_SIZES=(4096 8192)
+BITSTREAM_VERSIONS=(0 1)
+PIPELINE_DEPTHS=(0 64)
+CHUNK_SIZES=(0 4096)
+SYSFS_DIR="/sys/block/$(basename "$DEVICE")/lzom"
 
-for file in "$TEST_FILES"/*; do
-    [ -f "$file" ] || continue
-    
-    for bs in "${BLOCK_SIZES[@]}"; do
-        test_file "$file" $bs
+echo always > "$SYSFS_DIR/verify"
+echo 1 > "$SYSFS_DIR/latency"
+# reads below must go through decompression, the cache is tested apart
+echo 0 > "$SYSFS_DIR/cache_size"
+
+for chunk in "${CHUNK_SIZES[@]}"; do
+for depth in "${PIPELINE_DEPTHS[@]}"; do
+for version in "${BITSTREAM_VERSIONS[@]}"; do
+    echo "--- bitstream version $version, pipeline depth $depth, chunk size $chunk ---"
+    echo "$version" > "$SYSFS_DIR/bitstream_version"
+    echo "$depth" > "$SYSFS_DIR/pipeline_depth"
+    echo "$chunk" > "$SYSFS_DIR/chunk_size"
+
+    for file in "$TEST_FILES"/*; do
+        [ -f "$file" ] || continue
+
+        for bs in "${BLOCK_SIZES[@]}"; do
+            test_file "$file" $bs
+        done
     done
 done
+done
+done
+
+echo ""
+echo "=== Large I/O ==="
+echo -n "Testing 4 MiB direct I/O... "
+dd if=/dev/urandom of=/tmp/orig.tmp bs=1M count=4 2>/dev/null
+dd if=/tmp/orig.tmp of="$DEVICE" bs=4M count=1 oflag=direct 2>/dev/null
+dd if="$DEVICE" of=/tmp/out.tmp bs=4M count=1 iflag=direct 2>/dev/null
+if cmp -s /tmp/orig.tmp /tmp/out.tmp; then
+    echo "OK"
+    PASSED=$((PASSED+1))
+else
+    echo "FAIL (mismatch)"
+    FAILED=$((FAILED+1))
+fi
+rm -f /tmp/out.tmp /tmp/orig.tmp
+
+echo ""
+echo "=== Discard ==="
+UNMAP_FILE=$(ls "$TEST_FILES"/* | head -n 1)
+for mode in "" "-z"; do
+    echo -n "Testing blkdiscard $mode... "
+    dd if="$UNMAP_FILE" of="$DEVICE" bs=8192 count=1 oflag=direct 2>/dev/null
+    blkdiscard $mode -o 0 -l 8192 "$DEVICE"
+    dd if="$DEVICE" of=/tmp/out.tmp bs=8192 count=1 iflag=direct 2>/dev/null
+    if cmp -s /tmp/out.tmp <(head -c 8192 /dev/zero); then
+        echo "OK"
+        PASSED=$((PASSED+1))
+    else
+        echo "FAIL (not zero)"
+        FAILED=$((FAILED+1))
+    fi
+    rm -f /tmp/out.tmp
+done
+
+echo ""
+echo "=== Flush ==="
+echo -n "Testing synchronous write... "
+dd if="$UNMAP_FILE" of="$DEVICE" bs=8192 count=4 oflag=direct,dsync conv=fsync 2>/dev/null
+if [ "$(awk '{ print $1 }' "$SYSFS_DIR/flush_stat")" -gt 0 ]; then
+    echo "OK"
+    PASSED=$((PASSED+1))
+else
+    echo "FAIL (no flush reached the device)"
+    FAILED=$((FAILED+1))
+fi
+
+echo ""
+echo "=== Dedup ==="
+echo 1 > "$SYSFS_DIR/dedup"
+echo -n "Testing duplicate blocks... "
+for seek in 16 32 48; do
+    dd if="$UNMAP_FILE" of="$DEVICE" bs=8192 count=1 seek=$seek oflag=direct 2>/dev/null
+done
+dd if="$UNMAP_FILE" of=/tmp/orig.tmp bs=8192 count=1 2>/dev/null
+DEDUP_OK=1
+for seek in 16 32 48; do
+    dd if="$DEVICE" of=/tmp/out.tmp bs=8192 count=1 skip=$seek iflag=direct 2>/dev/null
+    cmp -s /tmp/orig.tmp /tmp/out.tmp || DEDUP_OK=0
+done
+if [ $DEDUP_OK -eq 1 ] && [ "$(awk '{ print $1 }' "$SYSFS_DIR/dedup_stat")" -gt 0 ]; then
+    echo "OK"
+    PASSED=$((PASSED+1))
+else
+    echo "FAIL"
+    FAILED=$((FAILED+1))
+fi
+echo 0 > "$SYSFS_DIR/dedup"
+rm -f /tmp/out.tmp /tmp/orig.tmp
+
+echo ""
+echo "=== Cache ==="
+echo 1048576 > "$SYSFS_DIR/cache_size"
+echo -n "Testing cached reads... "
+dd if="$UNMAP_FILE" of="$DEVICE" bs=8192 count=1 seek=64 oflag=direct 2>/dev/null
+dd if="$UNMAP_FILE" of=/tmp/orig.tmp bs=8192 count=1 2>/dev/null
+CACHE_OK=1
+for i in 1 2; do
+    dd if="$DEVICE" of=/tmp/out.tmp bs=8192 count=1 skip=64 iflag=direct 2>/dev/null
+    cmp -s /tmp/orig.tmp /tmp/out.tmp || CACHE_OK=0
+done
+if [ $CACHE_OK -eq 1 ] && [ "$(awk '{ print $1 }' "$SYSFS_DIR/cache_stat")" -gt 0 ]; then
+    echo "OK"
+    PASSED=$((PASSED+1))
+else
+    echo "FAIL"
+    FAILED=$((FAILED+1))
+fi
+rm -f /tmp/out.tmp /tmp/orig.tmp
+
+echo -n "Testing sequential reads... "
+dd if=/dev/urandom of=/tmp/orig.tmp bs=4096 count=64 2>/dev/null
+dd if=/tmp/orig.tmp of="$DEVICE" bs=4096 count=64 seek=128 oflag=direct 2>/dev/null
+echo 0 > "$SYSFS_DIR/cache_size"
+echo 1048576 > "$SYSFS_DIR/cache_size"
+dd if="$DEVICE" of=/tmp/out.tmp bs=4096 count=64 skip=128 iflag=direct 2>/dev/null
+if cmp -s /tmp/orig.tmp /tmp/out.tmp && [ "$(awk '{ print $1 }' "$SYSFS_DIR/readahead_stat")" -gt 0 ]; then
+    echo "OK"
+    PASSED=$((PASSED+1))
+else
+    echo "FAIL"
+    FAILED=$((FAILED+1))
+fi
+rm -f /tmp/out.tmp /tmp/orig.tmp
+
+echo ""
+echo "=== Coalescing ==="
+COALESCE_FILE=$(ls "$TEST_FILES"/* | head -n 1)
+echo 65536 > "$SYSFS_DIR/coalesce"
+for ack in immediate commit; do
+    echo -n "Testing small writes, ack on $ack... "
+    echo "$ack" > "$SYSFS_DIR/coalesce_ack"
+    dd if="$COALESCE_FILE" of=/tmp/orig.tmp bs=4096 count=32 2>/dev/null
+    truncate -s 131072 /tmp/orig.tmp
+    dd if=/tmp/orig.tmp of="$DEVICE" bs=4096 count=32 seek=256 oflag=direct 2>/dev/null
+    # staged blocks read back before and after the commit
+    dd if="$DEVICE" of=/tmp/out.tmp bs=4096 count=32 skip=256 iflag=direct 2>/dev/null
+    COALESCE_OK=1
+    cmp -s /tmp/orig.tmp /tmp/out.tmp || COALESCE_OK=0
+    dd if=/dev/zero of="$DEVICE" bs=4096 count=0 conv=fsync 2>/dev/null
+    echo 0 > "$SYSFS_DIR/cache_size"
+    dd if="$DEVICE" of=/tmp/out.tmp bs=4096 count=32 skip=256 iflag=direct 2>/dev/null
+    cmp -s /tmp/orig.tmp /tmp/out.tmp || COALESCE_OK=0
+    echo 1048576 > "$SYSFS_DIR/cache_size"
+    if [ $COALESCE_OK -eq 1 ] && [ "$(awk '{ print $1 }' "$SYSFS_DIR/coalesce_stat")" -gt 0 ]; then
+        echo "OK"
+        PASSED=$((PASSED+1))
+    else
+        echo "FAIL"
+        FAILED=$((FAILED+1))
+    fi
+done
+echo 0 > "$SYSFS_DIR/coalesce"
+rm -f /tmp/out.tmp /tmp/orig.tmp
+
+VERIFY_STAT=$(cat "$SYSFS_DIR/verify_stat")
+GC_STAT=$(cat "$SYSFS_DIR/gc_stat")
+FLUSH_STAT=$(cat "$SYSFS_DIR/flush_stat")
+DEDUP_STAT=$(cat "$SYSFS_DIR/dedup_stat")
+CACHE_STAT=$(cat "$SYSFS_DIR/cache_stat")
+RA_STAT=$(cat "$SYSFS_DIR/readahead_stat")
+COALESCE_STAT=$(cat "$SYSFS_DIR/coalesce_stat")
+PERF_STAT=$(cat "$SYSFS_DIR/perf_stat")
+LATENCY_HIST=$(cat "$SYSFS_DIR/latency_hist")
+
+echo ""
+echo "=== Remount ==="
+REMOUNT_FILE=$(ls "$TEST_FILES"/* | head -n 1)
+echo -n "Testing $(basename "$REMOUNT_FILE") after reload... "
+dd if="$REMOUNT_FILE" of="$DEVICE" bs=8192 count=1 oflag=direct 2>/dev/null
+rmmod lzom_module
+insmod $MODULE
+echo -n "$BRD_DEVICE" > /sys/module/lzom_module/parameters/path
+sleep 1
+dd if="$DEVICE" of=/tmp/out.tmp bs=8192 count=1 iflag=direct 2>/dev/null
+dd if="$REMOUNT_FILE" of=/tmp/orig.tmp bs=8192 count=1 2>/dev/null
+if diff -q /tmp/orig.tmp /tmp/out.tmp >/dev/null 2>&1; then
+    echo "OK"
+    PASSED=$((PASSED+1))
+else
+    echo "FAIL (mismatch)"
+    FAILED=$((FAILED+1))
+fi
+rm -f /tmp/out.tmp /tmp/orig.tmp
 
 echo ""
 echo "=== Results ==="
+echo "Verified/mismatched blocks: $VERIFY_STAT"
+echo "Free/total segments, cleaned, moved: $GC_STAT"
+echo "Flushes, map syncs: $FLUSH_STAT"
+echo "Dedup hits, misses, collisions: $DEDUP_STAT"
+echo "Cache hits, misses, blocks: $CACHE_STAT"
+echo "Readahead blocks, window: $RA_STAT"
+echo "Coalesced units, blocks, sectors, errors: $COALESCE_STAT"
+echo "Bytes in/out, compressed/raw blocks, mismatches, alloc fails, in flight, compress/decompress ns: $PERF_STAT"
+echo "Latency histograms, log2 ns buckets:"
+echo "$LATENCY_HIST"
 echo "Passed: $PASSED"
 echo "Failed: $FAILED"
 
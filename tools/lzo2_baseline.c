@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include <lzo/lzo1x.h>
+
+#include "lzo2_baseline.h"
+
+int lzo2_init(void)
+{
+	return lzo_init() != LZO_E_OK;
+}
+
+size_t lzo2_wrkmem_len(void)
+{
+	return LZO1X_1_MEM_COMPRESS;
+}
+
+int lzo2_compress(const unsigned char *in, size_t in_len, unsigned char *out,
+		  size_t *out_len, void *wrkmem)
+{
+	lzo_uint len = *out_len;
+	int ret;
+
+	ret = lzo1x_1_compress(in, in_len, out, &len, wrkmem);
+	*out_len = len;
+	return ret;
+}
+
+int lzo2_decompress(const unsigned char *in, size_t in_len,
+		    unsigned char *out, size_t *out_len)
+{
+	lzo_uint len = *out_len;
+	int ret;
+
+	ret = lzo1x_decompress_safe(in, in_len, out, &len, NULL);
+	*out_len = len;
+	return ret;
+}
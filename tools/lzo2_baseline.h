@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Stock LZO1X-1 from liblzo2, kept apart from the lzom headers, which
+ * define the same constants.
+ */
+#ifndef LZO2_BASELINE_H
+#define LZO2_BASELINE_H
+
+#include <stddef.h>
+
+int lzo2_init(void);
+size_t lzo2_wrkmem_len(void);
+int lzo2_compress(const unsigned char *in, size_t in_len, unsigned char *out,
+		  size_t *out_len, void *wrkmem);
+int lzo2_decompress(const unsigned char *in, size_t in_len,
+		    unsigned char *out, size_t *out_len);
+
+#endif /* LZO2_BASELINE_H */
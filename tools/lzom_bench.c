@@ -0,0 +1,581 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Throughput of the lzom codec without the block layer. Every file is cut
+ * into blocks as the device stores them, a block is compressed from page
+ * bvecs into a flat workspace, decompressed from page bvecs into page
+ * bvecs, as lzom_module does, and checked against the original. Stock
+ * LZO1X-1 from liblzo2 runs on the same blocks as the baseline when the
+ * build found it. With -l the blocks are instead replayed under several
+ * bvec layouts of their plain side, relative to a flat buffer.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lzom_extend.h"
+#include "lzom_sg_helpers.h"
+
+#ifdef HAVE_LZO2
+#include "lzo2_baseline.h"
+#endif
+
+#define BENCH_BLOCK_SIZE 4096
+#define BENCH_MIN_MS 200
+
+enum bench_codec {
+	BENCH_LZOM,
+	BENCH_LZOM_RLE,
+#ifdef HAVE_LZO2
+	BENCH_LZO2,
+#endif
+	NR_BENCH_CODECS,
+};
+
+static const char *const bench_codec_names[NR_BENCH_CODECS] = {
+	[BENCH_LZOM] = "lzom",
+	[BENCH_LZOM_RLE] = "lzom-rle",
+#ifdef HAVE_LZO2
+	[BENCH_LZO2] = "lzo1x-1",
+#endif
+};
+
+/*
+ * How a block is split into bvecs: @seg_len bytes per bvec, 0 for the
+ * whole block in one, each @offset bytes into a slot with @gap bytes
+ * after it. The gap keeps the sg index from merging neighbours into one
+ * flat run, as the pages of a real bio are rarely adjacent.
+ */
+struct bench_layout {
+	const char *name;
+	unsigned int seg_len;
+	unsigned int offset;
+	unsigned int gap;
+};
+
+enum bench_layout_id {
+	BENCH_FLAT,
+	BENCH_PAGES,
+	BENCH_UNALIGNED,
+	BENCH_SECTORS,
+	BENCH_BYTES,
+	BENCH_MULTIPAGE,
+	NR_BENCH_LAYOUTS,
+};
+
+static const struct bench_layout bench_layouts[NR_BENCH_LAYOUTS] = {
+	[BENCH_FLAT] = { "flat", 0, 0, 0 },
+	[BENCH_PAGES] = { "pages", PAGE_SIZE, 0, PAGE_SIZE },
+	/* a page long but straddling two */
+	[BENCH_UNALIGNED] = { "unaligned", PAGE_SIZE, 100, PAGE_SIZE },
+	[BENCH_SECTORS] = { "512", 512, 0, 512 },
+	[BENCH_BYTES] = { "1", 1, 0, 1 },
+	[BENCH_MULTIPAGE] = { "multipage", 4 * PAGE_SIZE, 0, PAGE_SIZE },
+};
+
+/* compressed blocks sit in adjacent pool pages */
+static const struct bench_layout bench_packed_layout = { "packed", PAGE_SIZE,
+							 0, 0 };
+
+/* blocks of block_len bytes, each split as a layout says */
+struct bench_buf {
+	unsigned char *data;
+	struct bio_vec *bvec;
+	struct lzom_sg_seg *segs;
+	size_t block_len;
+	unsigned int bvecs_per_block;
+	unsigned int segs_per_block;
+};
+
+/* one file cut into blocks, with room for every block compressed */
+struct bench_file {
+	const char *name;
+	size_t size;
+	size_t block_size;
+	unsigned int nr_blocks;
+	unsigned char *data; /* the file as read */
+	unsigned char *flat; /* scratch of the same size */
+	struct bench_buf plain;
+	struct bench_buf check;
+	struct bench_buf packed;
+	size_t *packed_len;
+};
+
+struct bench_result {
+	size_t packed;
+	double compress_mbs;
+	double decompress_mbs;
+};
+
+static void *bench_alloc(size_t size)
+{
+	void *ptr = aligned_alloc(PAGE_SIZE, size);
+
+	if (!ptr) {
+		perror("aligned_alloc");
+		exit(1);
+	}
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+static unsigned long long bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_buf_init(struct bench_buf *buf, unsigned int nr_blocks,
+			   size_t block_len, const struct bench_layout *layout)
+{
+	size_t seg_len = layout->seg_len ?: block_len;
+	size_t slot = layout->offset + seg_len + layout->gap;
+	unsigned int nr_bvecs, i, j;
+	size_t size;
+
+	buf->block_len = block_len;
+	buf->bvecs_per_block = (block_len + seg_len - 1) / seg_len;
+	/* an unaligned bvec may touch one page more than its length needs */
+	buf->segs_per_block = buf->bvecs_per_block *
+			      ((seg_len + PAGE_SIZE - 1) / PAGE_SIZE + 1);
+
+	nr_bvecs = nr_blocks * buf->bvecs_per_block;
+	size = (nr_bvecs * slot + PAGE_SIZE - 1) & PAGE_MASK;
+	buf->data = bench_alloc(size);
+	buf->bvec = calloc(nr_bvecs, sizeof(*buf->bvec));
+	buf->segs = calloc((size_t)nr_blocks * buf->segs_per_block,
+			   sizeof(*buf->segs));
+	if (!buf->bvec || !buf->segs) {
+		perror("calloc");
+		exit(1);
+	}
+
+	for (i = 0; i < nr_blocks; i++) {
+		for (j = 0; j < buf->bvecs_per_block; j++) {
+			unsigned int k = i * buf->bvecs_per_block + j;
+			unsigned char *addr = buf->data + k * slot +
+					      layout->offset;
+
+			bvec_set_page(&buf->bvec[k], virt_to_page(addr),
+				      min(seg_len, block_len - j * seg_len),
+				      offset_in_page(addr));
+		}
+	}
+}
+
+static void bench_buf_free(struct bench_buf *buf)
+{
+	free(buf->data);
+	free(buf->bvec);
+	free(buf->segs);
+}
+
+/* the first @len bytes of block @i of @buf, indexed */
+static struct lzom_sg_buf bench_slice(struct bench_buf *buf, unsigned int i,
+				      size_t len)
+{
+	struct lzom_sg_buf slice;
+
+	slice = lzom_sg_buf_create((struct bvec_iter){ .bi_size = len },
+				   buf->bvec + i * buf->bvecs_per_block);
+	lzom_sg_index_build(&slice, buf->segs + i * buf->segs_per_block,
+			    lzom_sg_index_count(&slice));
+	return slice;
+}
+
+static size_t bench_block_len(struct bench_file *file, unsigned int i)
+{
+	return min_t(size_t, file->block_size,
+		     file->size - i * file->block_size);
+}
+
+static int bench_file_load(struct bench_file *file, const char *name,
+			   size_t block_size, const struct bench_layout *layout)
+{
+	FILE *f;
+	size_t stride = (lzo_worst_compress(block_size) + PAGE_SIZE - 1) &
+			PAGE_MASK;
+	unsigned int i;
+	long size;
+
+	f = fopen(name, "rb");
+	if (!f || fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0 ||
+	    fseek(f, 0, SEEK_SET)) {
+		fprintf(stderr, "%s: %s\n", name, strerror(errno));
+		if (f)
+			fclose(f);
+		return -1;
+	}
+
+	memset(file, 0, sizeof(*file));
+	file->name = name;
+	file->size = size;
+	file->block_size = block_size;
+	file->nr_blocks = (size + block_size - 1) / block_size;
+	if (!size) {
+		fclose(f);
+		return 0;
+	}
+
+	file->data = bench_alloc(file->nr_blocks * block_size);
+	file->flat = bench_alloc(file->nr_blocks * block_size);
+	bench_buf_init(&file->plain, file->nr_blocks, block_size, layout);
+	bench_buf_init(&file->check, file->nr_blocks, block_size, layout);
+	bench_buf_init(&file->packed, file->nr_blocks, stride,
+		       &bench_packed_layout);
+	file->packed_len = calloc(file->nr_blocks, sizeof(*file->packed_len));
+	if (!file->packed_len) {
+		perror("calloc");
+		exit(1);
+	}
+
+	if (fread(file->data, 1, size, f) != (size_t)size) {
+		fprintf(stderr, "%s: short read\n", name);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	for (i = 0; i < file->nr_blocks; i++) {
+		struct lzom_sg_buf slice = bench_slice(&file->plain, i,
+						       bench_block_len(file, i));
+
+		sg_write_bytes(&slice, file->data + i * block_size,
+			       bench_block_len(file, i));
+	}
+
+	return 0;
+}
+
+static void bench_file_free(struct bench_file *file)
+{
+	free(file->data);
+	free(file->flat);
+	bench_buf_free(&file->plain);
+	bench_buf_free(&file->check);
+	bench_buf_free(&file->packed);
+	free(file->packed_len);
+}
+
+/*
+ * Compresses every block of @file once with @codec. The output goes to
+ * the flat workspace @out first and is then copied to its place in
+ * file->packed, as the module copies it into the lower bio.
+ */
+static size_t bench_compress_all(struct bench_file *file,
+				 enum bench_codec codec, unsigned char *out,
+				 struct bio_vec *out_bvec,
+				 struct lzom_sg_seg *out_segs, void *wrkmem)
+{
+	struct lzom_sg_buf src, wsbuf;
+	size_t total = 0;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < file->nr_blocks; i++) {
+		size_t len = bench_block_len(file, i);
+		size_t out_len = lzo_worst_compress(len);
+		struct lzom_sg_buf dst = bench_slice(&file->packed, i,
+						     file->packed.block_len);
+
+		switch (codec) {
+		case BENCH_LZOM:
+		case BENCH_LZOM_RLE:
+			src = bench_slice(&file->plain, i, len);
+			wsbuf = lzom_sg_buf_create(
+				(struct bvec_iter){ .bi_size = out_len },
+				out_bvec);
+			lzom_sg_index_build(&wsbuf, out_segs,
+					    lzom_sg_index_count(&wsbuf));
+
+			ret = codec == BENCH_LZOM ?
+				      lzom_compress(&src, &wsbuf, wrkmem) :
+				      lzom_rle_compress(&src, &wsbuf, wrkmem);
+			out_len = wsbuf.iter.bi_size;
+			break;
+#ifdef HAVE_LZO2
+		case BENCH_LZO2:
+			ret = lzo2_compress(file->data + i * file->block_size,
+					    len, out, &out_len, wrkmem);
+			break;
+#endif
+		default:
+			abort();
+		}
+
+		if (ret != LZO_E_OK) {
+			fprintf(stderr, "%s: block %u: compress failed: %d\n",
+				file->name, i, ret);
+			exit(1);
+		}
+
+		sg_write_bytes(&dst, out, out_len);
+		file->packed_len[i] = out_len;
+		total += out_len;
+	}
+
+	return total;
+}
+
+static void bench_decompress_all(struct bench_file *file,
+				 enum bench_codec codec)
+{
+	struct lzom_sg_buf src, dst;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < file->nr_blocks; i++) {
+		size_t len = bench_block_len(file, i);
+		size_t out_len = len;
+
+		switch (codec) {
+		case BENCH_LZOM:
+		case BENCH_LZOM_RLE:
+			src = bench_slice(&file->packed, i,
+					  file->packed_len[i]);
+			dst = bench_slice(&file->check, i, len);
+			ret = lzom_decompress_sg(&src, &dst, &out_len);
+			break;
+#ifdef HAVE_LZO2
+		case BENCH_LZO2:
+			ret = lzo2_decompress(file->packed.data +
+						      i * file->packed.block_len,
+					      file->packed_len[i],
+					      file->flat +
+						      i * file->block_size,
+					      &out_len);
+			break;
+#endif
+		default:
+			abort();
+		}
+
+		if (ret != LZO_E_OK || out_len != len) {
+			fprintf(stderr,
+				"%s: block %u: decompress failed: %d, %zu of %zu bytes\n",
+				file->name, i, ret, out_len, len);
+			exit(1);
+		}
+	}
+}
+
+/* copies the decompressed blocks to file->flat */
+static void bench_gather(struct bench_file *file)
+{
+	unsigned int i;
+
+	for (i = 0; i < file->nr_blocks; i++) {
+		struct lzom_sg_buf slice = bench_slice(&file->check, i,
+						       bench_block_len(file, i));
+
+		sg_read_bytes(&slice, file->flat + i * file->block_size,
+			      bench_block_len(file, i));
+	}
+}
+
+static void bench_run(struct bench_file *file, enum bench_codec codec,
+		      unsigned long long min_ns, struct bench_result *res)
+{
+	size_t ws_len = lzo_worst_compress(file->block_size);
+	unsigned int ws_vecs = ws_len / PAGE_SIZE + 2;
+	unsigned char *out = malloc(ws_len);
+	struct bio_vec *out_bvec = calloc(ws_vecs, sizeof(*out_bvec));
+	struct lzom_sg_seg *out_segs = calloc(ws_vecs, sizeof(*out_segs));
+	size_t wrkmem_len = LZO1X_1_MEM_COMPRESS;
+	void *wrkmem;
+	unsigned long long start, elapsed;
+	size_t done, off;
+	unsigned int i;
+
+#ifdef HAVE_LZO2
+	wrkmem_len = max(wrkmem_len, lzo2_wrkmem_len());
+#endif
+	wrkmem = malloc(wrkmem_len);
+	if (!out || !out_bvec || !out_segs || !wrkmem) {
+		perror("malloc");
+		exit(1);
+	}
+
+	/* the workspace is one kmalloc'ed buffer cut at page boundaries */
+	for (i = 0, off = 0; off < ws_len; i++) {
+		unsigned int len = min_t(size_t, ws_len - off,
+					 PAGE_SIZE - offset_in_page(out + off));
+
+		bvec_set_page(&out_bvec[i], virt_to_page(out + off), len,
+			      offset_in_page(out + off));
+		off += len;
+	}
+
+	res->packed = bench_compress_all(file, codec, out, out_bvec, out_segs,
+					 wrkmem);
+	bench_decompress_all(file, codec);
+	if (codec == BENCH_LZOM || codec == BENCH_LZOM_RLE)
+		bench_gather(file);
+	if (memcmp(file->data, file->flat, file->size)) {
+		fprintf(stderr, "%s: %s: round trip mismatch\n", file->name,
+			bench_codec_names[codec]);
+		exit(1);
+	}
+
+	done = 0;
+	start = bench_now_ns();
+	do {
+		bench_compress_all(file, codec, out, out_bvec, out_segs,
+				   wrkmem);
+		done += file->size;
+		elapsed = bench_now_ns() - start;
+	} while (elapsed < min_ns);
+	res->compress_mbs = done * 1e3 / elapsed;
+
+	done = 0;
+	start = bench_now_ns();
+	do {
+		bench_decompress_all(file, codec);
+		done += file->size;
+		elapsed = bench_now_ns() - start;
+	} while (elapsed < min_ns);
+	res->decompress_mbs = done * 1e3 / elapsed;
+
+	free(out);
+	free(out_bvec);
+	free(out_segs);
+	free(wrkmem);
+}
+
+static const char *bench_base_name(const char *path)
+{
+	const char *base = strrchr(path, '/');
+
+	return base ? base + 1 : path;
+}
+
+static int bench_codecs(const char *path, size_t block_size,
+			unsigned long long min_ns)
+{
+	struct bench_file file;
+	unsigned int codec;
+
+	if (bench_file_load(&file, path, block_size,
+			    &bench_layouts[BENCH_PAGES]))
+		return -1;
+
+	for (codec = 0; codec < NR_BENCH_CODECS && file.size; codec++) {
+		struct bench_result res;
+
+		bench_run(&file, codec, min_ns, &res);
+		printf("%-24s %-10s %12zu %8.3f %12.1f %12.1f\n",
+		       bench_base_name(path), bench_codec_names[codec],
+		       file.size, (double)file.size / res.packed,
+		       res.compress_mbs, res.decompress_mbs);
+	}
+
+	bench_file_free(&file);
+	return 0;
+}
+
+/* every layout relative to the flat one, which comes first */
+static int bench_layouts_run(const char *path, size_t block_size,
+			     unsigned long long min_ns)
+{
+	struct bench_result flat = {};
+	unsigned int id;
+
+	for (id = 0; id < NR_BENCH_LAYOUTS; id++) {
+		struct bench_file file;
+		struct bench_result res;
+
+		if (bench_file_load(&file, path, block_size, &bench_layouts[id]))
+			return -1;
+
+		if (!file.size) {
+			bench_file_free(&file);
+			return 0;
+		}
+
+		bench_run(&file, BENCH_LZOM, min_ns, &res);
+		if (id == BENCH_FLAT)
+			flat = res;
+
+		printf("%-24s %-10s %8u %12.1f %12.1f %8.1f%% %8.1f%%\n",
+		       bench_base_name(path), bench_layouts[id].name,
+		       file.plain.bvecs_per_block, res.compress_mbs,
+		       res.decompress_mbs,
+		       res.compress_mbs * 100 / flat.compress_mbs,
+		       res.decompress_mbs * 100 / flat.decompress_mbs);
+		bench_file_free(&file);
+	}
+
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-b block_size] [-t min_ms] [-l] file...\n"
+		"  -b  bytes compressed together, 4096 as stored by the device,\n"
+		"      up to 131072 like a coalesced unit\n"
+		"  -t  how long to repeat each measurement, in ms\n"
+		"  -l  lzom under each bvec layout instead of every codec:\n"
+		"      flat, pages, unaligned, 512, 1 and multipage\n",
+		prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	size_t block_size = BENCH_BLOCK_SIZE;
+	unsigned long long min_ns = BENCH_MIN_MS * 1000000ULL;
+	bool layouts = false;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "b:t:lh")) != -1) {
+		switch (opt) {
+		case 'b':
+			block_size = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			min_ns = strtoull(optarg, NULL, 0) * 1000000ULL;
+			break;
+		case 'l':
+			layouts = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind == argc || !block_size || block_size % PAGE_SIZE)
+		usage(argv[0]);
+
+#ifdef HAVE_LZO2
+	if (lzo2_init()) {
+		fprintf(stderr, "lzo_init failed\n");
+		return 1;
+	}
+#else
+	fprintf(stderr, "built without liblzo2, no lzo1x-1 baseline\n");
+#endif
+
+	if (layouts)
+		printf("%-24s %-10s %8s %12s %12s %9s %9s\n", "file", "layout",
+		       "bvecs", "comp MB/s", "decomp MB/s", "comp", "decomp");
+	else
+		printf("%-24s %-10s %12s %8s %12s %12s\n", "file", "codec",
+		       "bytes", "ratio", "comp MB/s", "decomp MB/s");
+
+	for (i = optind; i < argc; i++) {
+		int ret = layouts ? bench_layouts_run(argv[i], block_size,
+						      min_ns) :
+				    bench_codecs(argv[i], block_size, min_ns);
+
+		if (ret)
+			return 1;
+	}
+
+	return 0;
+}
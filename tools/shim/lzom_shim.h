@@ -0,0 +1,272 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Just enough of the kernel for the codec in lzom/ to build in userspace.
+ * A struct page is a PAGE_SIZE aligned chunk of ordinary memory, so page
+ * pointer arithmetic and page_address() behave as with the direct mapping
+ * and there is no highmem. The bvec iterators follow include/linux/bvec.h.
+ */
+#ifndef LZOM_SHIM_H
+#define LZOM_SHIM_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+typedef u64 sector_t;
+
+/* what the kernel config would say for the build host */
+#if defined(__x86_64__)
+#define CONFIG_X86_64 1
+#define CONFIG_X86 1
+#define CONFIG_HAVE_EFFICIENT_UNALIGNED_ACCESS 1
+#elif defined(__i386__)
+#define CONFIG_X86 1
+#define CONFIG_HAVE_EFFICIENT_UNALIGNED_ACCESS 1
+#elif defined(__aarch64__)
+#define CONFIG_ARM64 1
+#define CONFIG_HAVE_EFFICIENT_UNALIGNED_ACCESS 1
+#elif defined(__powerpc__)
+#define CONFIG_PPC 1
+#endif
+
+/* the kernel defines exactly one of them */
+#if !defined(__LITTLE_ENDIAN) && !defined(__BIG_ENDIAN)
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define __LITTLE_ENDIAN 1234
+#else
+#define __BIG_ENDIAN 4321
+#endif
+#endif
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1UL << PAGE_SHIFT)
+#define PAGE_MASK (~(PAGE_SIZE - 1))
+
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define noinline __attribute__((__noinline__))
+#ifndef __always_inline
+#define __always_inline inline __attribute__((__always_inline__))
+#endif
+
+#define min(a, b)                      \
+	({                             \
+		__typeof__(a) __a = (a); \
+		__typeof__(b) __b = (b); \
+		__a < __b ? __a : __b; \
+	})
+#define max(a, b)                      \
+	({                             \
+		__typeof__(a) __a = (a); \
+		__typeof__(b) __b = (b); \
+		__a > __b ? __a : __b; \
+	})
+#define min3(a, b, c) min(min(a, b), c)
+#define min_t(type, a, b) min((type)(a), (type)(b))
+#define max_t(type, a, b) max((type)(a), (type)(b))
+
+#define BUILD_BUG_ON(cond) _Static_assert(!(cond), #cond)
+#define BUG() __builtin_trap()
+#define BUG_ON(cond)                  \
+	do {                          \
+		if (unlikely(cond))   \
+			BUG();        \
+	} while (0)
+#define WARN_ONCE(cond, fmt, ...) unlikely(cond)
+
+#define pr_err(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
+#define pr_info(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
+
+#define EXPORT_SYMBOL(sym)
+#define EXPORT_SYMBOL_GPL(sym)
+#define MODULE_LICENSE(s)
+#define MODULE_DESCRIPTION(s)
+
+/* ----------------- unaligned -----------------*/
+/* packed structs as in the kernel's unaligned accessors */
+#define get_unaligned(ptr)                                                   \
+	({                                                                   \
+		const struct {                                               \
+			__typeof__(*(ptr)) x;                                \
+		} __attribute__((__packed__)) *__p = (const void *)(ptr);    \
+		__p->x;                                                      \
+	})
+#define put_unaligned(val, ptr)                                              \
+	do {                                                                 \
+		struct {                                                     \
+			__typeof__(*(ptr)) x;                                \
+		} __attribute__((__packed__)) *__p = (void *)(ptr);          \
+		__p->x = (val);                                              \
+	} while (0)
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define le16_to_cpu(x) ((u16)(x))
+#define le32_to_cpu(x) ((u32)(x))
+#define le64_to_cpu(x) ((u64)(x))
+#else
+#define le16_to_cpu(x) __builtin_bswap16(x)
+#define le32_to_cpu(x) __builtin_bswap32(x)
+#define le64_to_cpu(x) __builtin_bswap64(x)
+#endif
+#define cpu_to_le16(x) le16_to_cpu(x)
+#define cpu_to_le32(x) le32_to_cpu(x)
+#define cpu_to_le64(x) le64_to_cpu(x)
+
+static inline u16 get_unaligned_le16(const void *p)
+{
+	return le16_to_cpu(get_unaligned((const u16 *)p));
+}
+
+static inline u32 get_unaligned_le32(const void *p)
+{
+	return le32_to_cpu(get_unaligned((const u32 *)p));
+}
+
+static inline void put_unaligned_le16(u16 val, void *p)
+{
+	put_unaligned(cpu_to_le16(val), (u16 *)p);
+}
+
+static inline void put_unaligned_le32(u32 val, void *p)
+{
+	put_unaligned(cpu_to_le32(val), (u32 *)p);
+}
+
+/* ----------------- pages -----------------*/
+struct page {
+	unsigned char data[PAGE_SIZE];
+};
+
+static inline void *page_address(const struct page *page)
+{
+	return (void *)page;
+}
+
+static inline struct page *virt_to_page(const void *addr)
+{
+	return (struct page *)((uintptr_t)addr & PAGE_MASK);
+}
+
+static inline unsigned long offset_in_page(const void *addr)
+{
+	return (uintptr_t)addr & ~PAGE_MASK;
+}
+
+#define PageHighMem(page) 0
+
+static inline void memcpy_to_page(struct page *page, size_t offset,
+				  const char *from, size_t len)
+{
+	memcpy((char *)page_address(page) + offset, from, len);
+}
+
+static inline void memcpy_from_page(char *to, struct page *page,
+				    size_t offset, size_t len)
+{
+	memcpy(to, (char *)page_address(page) + offset, len);
+}
+
+/* ----------------- bvec -----------------*/
+struct bio_vec {
+	struct page *bv_page;
+	unsigned int bv_len;
+	unsigned int bv_offset;
+};
+
+struct bvec_iter {
+	sector_t bi_sector;
+	unsigned int bi_size;
+	unsigned int bi_idx;
+	unsigned int bi_bvec_done;
+};
+
+#define __bvec_iter_bvec(bvec, iter) (&(bvec)[(iter).bi_idx])
+
+#define mp_bvec_iter_page(bvec, iter) (__bvec_iter_bvec((bvec), (iter))->bv_page)
+#define mp_bvec_iter_len(bvec, iter)                        \
+	min((iter).bi_size,                                 \
+	    __bvec_iter_bvec((bvec), (iter))->bv_len - (iter).bi_bvec_done)
+#define mp_bvec_iter_offset(bvec, iter) \
+	(__bvec_iter_bvec((bvec), (iter))->bv_offset + (iter).bi_bvec_done)
+#define mp_bvec_iter_page_idx(bvec, iter) \
+	(mp_bvec_iter_offset((bvec), (iter)) / PAGE_SIZE)
+
+#define bvec_iter_offset(bvec, iter) \
+	(mp_bvec_iter_offset((bvec), (iter)) % PAGE_SIZE)
+#define bvec_iter_len(bvec, iter)                             \
+	min_t(unsigned int, mp_bvec_iter_len((bvec), (iter)), \
+	      PAGE_SIZE - bvec_iter_offset((bvec), (iter)))
+#define bvec_iter_page(bvec, iter) \
+	(mp_bvec_iter_page((bvec), (iter)) + mp_bvec_iter_page_idx((bvec), (iter)))
+
+#define bvec_iter_bvec(bvec, iter)                              \
+	((struct bio_vec){                                      \
+		.bv_page = bvec_iter_page((bvec), (iter)),      \
+		.bv_len = bvec_iter_len((bvec), (iter)),        \
+		.bv_offset = bvec_iter_offset((bvec), (iter)),  \
+	})
+
+static inline bool bvec_iter_advance(const struct bio_vec *bv,
+				     struct bvec_iter *iter, unsigned int bytes)
+{
+	unsigned int idx = iter->bi_idx;
+
+	if (WARN_ONCE(bytes > iter->bi_size,
+		      "Attempted to advance past end of bvec iter\n")) {
+		iter->bi_size = 0;
+		return false;
+	}
+
+	iter->bi_size -= bytes;
+	bytes += iter->bi_bvec_done;
+
+	while (bytes && bytes >= bv[idx].bv_len) {
+		bytes -= bv[idx].bv_len;
+		idx++;
+	}
+
+	iter->bi_idx = idx;
+	iter->bi_bvec_done = bytes;
+	return true;
+}
+
+static inline void bvec_iter_advance_single(const struct bio_vec *bv,
+					    struct bvec_iter *iter,
+					    unsigned int bytes)
+{
+	unsigned int done = iter->bi_bvec_done + bytes;
+
+	if (done == bv[iter->bi_idx].bv_len) {
+		done = 0;
+		iter->bi_idx++;
+	}
+	iter->bi_bvec_done = done;
+	iter->bi_size -= bytes;
+}
+
+#define for_each_bvec(bvl, bio_vec, iter, start)                   \
+	for (iter = (start);                                       \
+	     (iter).bi_size &&                                     \
+	     ((bvl = bvec_iter_bvec((bio_vec), (iter))), 1);       \
+	     bvec_iter_advance_single((bio_vec), &(iter), (bvl).bv_len))
+
+static inline void bvec_set_page(struct bio_vec *bv, struct page *page,
+				 unsigned int len, unsigned int offset)
+{
+	bv->bv_page = page;
+	bv->bv_len = len;
+	bv->bv_offset = offset;
+}
+
+#endif /* LZOM_SHIM_H */